@@ -0,0 +1,287 @@
+// ahead of time compiler: walks a rom from PROGRAM_START and writes a C file where every
+// reachable basic block is a label working on a Cip8*, see cip8_aot_run in the output.
+//
+//   $ gcc aot.c -o aot && ./aot tests/3-corax+.ch8 corax.c
+//
+// the output includes cip8.h and calls its cip8_op_* handlers with constant operands, so like
+// cip8.h it gets #included into the one translation unit of the program instead of linked.
+// jumps it can't follow (OP_JMV0, OP_RET to an unknown site, undecodable op-codes) go back
+// through the dispatch switch and from there to the interpreter, and writes over the
+// translated code make it hand the rest of the run to cip8_run.
+//
+// the quirk profile (cip8_quirks_name, legacy when not given) is baked into the handler calls, a
+// machine set to another one runs through cip8_run instead.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define CIP8_NO_SDL
+#include "cip8.h"
+
+typedef struct {
+    bool reachable[MEMORY_SIZE];
+    bool leader[MEMORY_SIZE];
+    Addr work[MEMORY_SIZE];
+    size_t work_count;
+} Cfg;
+
+static const char* handler_name(Operation op) {
+    switch (op)
+    {
+        case OP_CLD:   return "cld";   case OP_RET:   return "ret";   case OP_GOTO:  return "goto";
+        case OP_CALLS: return "calls"; case OP_JVEQ:  return "jveq";  case OP_JVNEQ: return "jvneq";
+        case OP_JEQ:   return "jeq";   case OP_JNEQ:  return "jneq";  case OP_MOV:   return "mov";
+        case OP_ADD:   return "add";   case OP_ASS:   return "ass";   case OP_OR:    return "or";
+        case OP_XOR:   return "xor";   case OP_AND:   return "and";   case OP_ADDC:  return "addc";
+        case OP_SUBC:  return "subc";  case OP_SHR:   return "shr";   case OP_SUBR:  return "subr";
+        case OP_SHL:   return "shl";   case OP_SETI:  return "seti";  case OP_JMV0:  return "jmv0";
+        case OP_RND:   return "rnd";   case OP_DRW:   return "drw";   case OP_KEYD:  return "keyd";
+        case OP_KEYU:  return "keyu";  case OP_GETDT: return "getdt"; case OP_GETK:  return "getk";
+        case OP_SETDT: return "setdt"; case OP_SETST: return "setst"; case OP_ADDI:  return "addi";
+        case SETISPR:  return "setispr"; case OP_BCD: return "bcd";   case OP_DUMP:  return "dump";
+        case OP_LOAD:  return "load";
+        default: return NULL;
+    }
+}
+// ops that can trap, the block has to stop right after them if one did
+static bool can_trap(Operation op) {
+    return op == OP_DRW || op == OP_BCD || op == OP_DUMP || op == OP_LOAD;
+}
+static bool is_skip(Operation op) {
+    return op == OP_JEQ || op == OP_JNEQ || op == OP_JVEQ || op == OP_JVNEQ || op == OP_KEYD || op == OP_KEYU;
+}
+// ops after which the straight line code stops
+static bool ends_block(Operation op) {
+    return is_skip(op) || op == OP_GOTO || op == OP_CALLS || op == OP_RET || op == OP_JMV0 ||
+           op == OP_GETK || op == OP_INVALID || op == OP_CALL;
+}
+static Inst inst_at(const Cip8* cip, Addr a) {
+    return cip8_decode_inst(cip8_read16(cip,a));
+}
+
+static void push(Cfg* cfg, Addr a, bool leader) {
+    if(a + 1 >= MEMORY_SIZE || (a & 1)) return; // odd targets are left to the interpreter
+    if(leader) cfg->leader[a] = true;
+    if(cfg->reachable[a]) return;
+    cfg->reachable[a] = true;
+    cfg->work[cfg->work_count++] = a;
+}
+// recursive descent over everything reachable from PROGRAM_START
+static void walk(Cfg* cfg, const Cip8* cip) {
+    push(cfg,PROGRAM_START,true);
+    while(cfg->work_count > 0) {
+        Addr pc = cfg->work[--cfg->work_count];
+        Inst inst = inst_at(cip,pc);
+        switch (inst.op)
+        {
+            case OP_GOTO:  push(cfg,GET_NNN(inst.oprand),true); break;
+            case OP_CALLS: push(cfg,GET_NNN(inst.oprand),true); push(cfg,pc + 2,true); break;
+            case OP_GETK:  push(cfg,pc + 2,true); break;
+            case OP_RET: case OP_JMV0: case OP_INVALID: case OP_CALL: break;
+            default:
+                if(is_skip(inst.op)) {
+                    push(cfg,pc + 2,true);
+                    push(cfg,pc + 4,true);
+                } else {
+                    push(cfg,pc + 2,false);
+                }
+            break;
+        }
+    }
+    // a reachable inst right after one that ends a block starts a new one
+    for (size_t a = 0; a + 1 < MEMORY_SIZE; a += 2) {
+        if(cfg->reachable[a] && a >= 2 && cfg->reachable[a - 2] && ends_block(inst_at(cip,a - 2).op)) {
+            cfg->leader[a] = true;
+        }
+    }
+}
+
+// the profile the handlers get called with
+static Cip8Quirks quirks = CIP8_QUIRKS_LEGACY;
+static void emit_call(FILE* out, Inst inst) {
+    const char* name = handler_name(inst.op);
+    char upper[16];
+    size_t i = 0;
+    for (; name[i] && i + 1 < sizeof(upper); i++) upper[i] = (name[i] >= 'a' && name[i] <= 'z') ? name[i] - 'a' + 'A' : name[i];
+    upper[i] = 0;
+    // SETISPR is the one op without the OP_ prefix
+    fprintf(out,"    cip8_op_%s(cip,(Inst){.op = %s%s, .oprand = 0x%03X}",name,inst.op == SETISPR ? "" : "OP_",upper,inst.oprand);
+    switch (inst.op) {
+        case OP_SHR: case OP_SHL: case OP_JMV0: case OP_DRW: case OP_DUMP: case OP_LOAD:
+            fprintf(out,",0x%02X",cip8_quirk_flags(quirks));
+        break;
+        default: break;
+    }
+    fprintf(out,");\n");
+}
+static bool uses_bail = false;
+// ip is not kept up inside a block, a trap leaves it on the inst that trapped and takes back
+// the count of the ones after it
+static void emit_trap_check(FILE* out, Addr pc, size_t left) {
+    fprintf(out,"    if(cip->halted) { cip->ip = 0x%03X; n -= %zu; return n; }\n",pc,left);
+}
+
+static void emit_jump(FILE* out, const Cfg* cfg, Addr target) {
+    if(target + 1 < MEMORY_SIZE && cfg->leader[target]) {
+        fprintf(out,"    goto L_%03X;\n",target);
+    } else {
+        fprintf(out,"    cip->ip = 0x%03X; goto dispatch;\n",target);
+    }
+}
+
+static void emit_block(FILE* out, const Cfg* cfg, const Cip8* cip, Addr start) {
+    size_t len = 0;
+    for (Addr a = start; a + 1 < MEMORY_SIZE && cfg->reachable[a]; a += 2) {
+        if(a != start && cfg->leader[a]) break;
+        Operation op = inst_at(cip,a).op;
+        if(op == OP_INVALID || op == OP_CALL) break;
+        len++;
+        if(ends_block(op)) break;
+    }
+
+    fprintf(out,"L_%03X:\n",start);
+    fprintf(out,"    if(count - n < %zu) { cip->ip = 0x%03X; goto interpret; }\n",len ? len : 1,start);
+    if(len == 0) {
+        fprintf(out,"    cip->ip = 0x%03X; goto interpret;\n",start);
+        return;
+    }
+    fprintf(out,"    n += %zu;\n",len);
+
+    Addr a = start;
+    for (size_t i = 0; i < len; i++, a += 2) {
+        Inst inst = inst_at(cip,a);
+        Addr next = a + 2;
+        switch (inst.op)
+        {
+            case OP_GOTO:
+                emit_jump(out,cfg,GET_NNN(inst.oprand));
+            return;
+            case OP_CALLS:
+                fprintf(out,"    cip->ip = 0x%03X;\n",next);
+                emit_call(out,inst);
+                fprintf(out,"    if(cip->halted) return n;\n");
+                emit_jump(out,cfg,GET_NNN(inst.oprand));
+            return;
+            case OP_RET:
+            case OP_JMV0:
+            case OP_GETK:
+                fprintf(out,"    cip->ip = 0x%03X;\n",next);
+                emit_call(out,inst);
+                fprintf(out,"    goto dispatch;\n");
+            return;
+            case OP_BCD:
+            case OP_DUMP:
+                // a dump may move I past what it wrote (CIP8_QUIRK_LOAD_I), check where it started
+                fprintf(out,"    {\n    Addr written = cip->regs.I;\n");
+                emit_call(out,inst);
+                emit_trap_check(out,a,len - i - 1);
+                uses_bail = true;
+                // n was bumped for the whole block up front, take back what won't run
+                fprintf(out,"    if(aot_touches_code(written,%d)) { cip->ip = 0x%03X; n -= %zu; goto bail; }\n    }\n",
+                        inst.op == OP_BCD ? 3 : (GET_X(inst.oprand)) + 1,next,len - i - 1);
+            break;
+            default:
+                if(is_skip(inst.op)) {
+                    fprintf(out,"    cip->ip = 0x%03X;\n",next);
+                    emit_call(out,inst);
+                    fprintf(out,"    if(cip->ip == 0x%03X) {\n",next + 2);
+                    emit_jump(out,cfg,next + 2);
+                    fprintf(out,"    }\n");
+                    emit_jump(out,cfg,next);
+                    return;
+                }
+                emit_call(out,inst);
+                if(can_trap(inst.op)) emit_trap_check(out,a,len - i - 1);
+            break;
+        }
+    }
+    // ran into the next leader or into something only the interpreter can do
+    emit_jump(out,cfg,a);
+}
+
+static void emit(FILE* out, const Cfg* cfg, const Cip8* cip, const char* rom_name, const char* fn_name) {
+    fprintf(out,"// generated by aot from %s, do not edit\n",rom_name);
+    fprintf(out,"// cip8.h defines its functions, so #include this in the translation unit that has it\n");
+    fprintf(out,"#include <string.h>\n");
+    fprintf(out,"#include \"cip8.h\"\n\n");
+
+    // the translated bytes, checked on entry so code written while interpreting is noticed
+    fprintf(out,"static const struct { Addr start; Addr len; const uint8_t* bytes; } aot_ranges[] = {\n");
+    size_t ranges = 0;
+    for (size_t a = 0; a + 1 < MEMORY_SIZE; a += 2) {
+        if(!cfg->reachable[a] || (a >= 2 && cfg->reachable[a - 2])) continue;
+        size_t end = a;
+        while(end + 1 < MEMORY_SIZE && cfg->reachable[end]) end += 2;
+        fprintf(out,"    {0x%03zX,%zu,(const uint8_t[]){",a,end - a);
+        for (size_t i = a; i < end; i++) fprintf(out,"0x%02X,",cip8_read(cip,i));
+        fprintf(out,"}},\n");
+        ranges++;
+    }
+    fprintf(out,"};\n\n");
+
+    fprintf(out,"static inline bool aot_touches_code(Addr start, size_t len) {\n");
+    fprintf(out,"    for (size_t r = 0; r < %zu; r++) {\n",ranges);
+    fprintf(out,"        if(start < aot_ranges[r].start + aot_ranges[r].len && aot_ranges[r].start < start + len) return true;\n");
+    fprintf(out,"    }\n    return false;\n}\n");
+    fprintf(out,"static inline bool aot_intact(const Cip8* cip) {\n");
+    fprintf(out,"    for (size_t r = 0; r < %zu; r++) {\n",ranges);
+    fprintf(out,"        for (size_t i = 0; i < aot_ranges[r].len; i++) {\n");
+    fprintf(out,"            if(cip8_read(cip,aot_ranges[r].start + i) != aot_ranges[r].bytes[i]) return false;\n");
+    fprintf(out,"        }\n");
+    fprintf(out,"    }\n    return true;\n}\n\n");
+
+    fprintf(out,"// runs up to count instructions, returns how many ran\n");
+    fprintf(out,"size_t %s(Cip8* cip, size_t count) {\n",fn_name);
+    fprintf(out,"    size_t n = 0;\n");
+    fprintf(out,"    if(cip->quirks != %d || !aot_intact(cip)) return cip8_run(cip,count); // %s only\n",quirks,cip8_quirks_name(quirks));
+    fprintf(out,"dispatch:\n");
+    fprintf(out,"    if(n >= count || cip->halted) return n;\n");
+    fprintf(out,"    switch (cip->ip) {\n");
+    for (size_t a = 0; a + 1 < MEMORY_SIZE; a += 2) {
+        if(cfg->leader[a]) fprintf(out,"        case 0x%03zX: goto L_%03zX;\n",a,a);
+    }
+    fprintf(out,"        default: goto interpret;\n    }\n");
+    fprintf(out,"interpret:\n");
+    fprintf(out,"    if(n >= count) return n;\n");
+    fprintf(out,"    n += cip8_run(cip,1);\n");
+    fprintf(out,"    goto dispatch;\n\n");
+    for (size_t a = 0; a + 1 < MEMORY_SIZE; a += 2) {
+        if(cfg->leader[a]) emit_block(out,cfg,cip,a);
+    }
+    if(uses_bail) {
+        fprintf(out,"bail:\n");
+        fprintf(out,"    return n + cip8_run(cip,count - n);\n");
+    }
+    fprintf(out,"}\n");
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        fprintf(stderr,"usage: %s rom.ch8 [out.c] [function name] [profile]\n",argv[0]);
+        return 1;
+    }
+    if(argc > 4 && !cip8_quirks_from_name(argv[4],&quirks)) {
+        printf("[ERROR]: %s is not a quirk profile\n",argv[4]);
+        return 1;
+    }
+    const char* out_name = argc > 2 ? argv[2] : NULL;
+    const char* fn_name  = argc > 3 ? argv[3] : "cip8_aot_run";
+
+    static Cip8 cip;
+    cip8_init(&cip);
+    if(!cip8_load_file(&cip,argv[1])) return 1;
+
+    static Cfg cfg;
+    walk(&cfg,&cip);
+
+    FILE* out = out_name ? fopen(out_name,"w") : stdout;
+    if(!out) {
+        printf("[ERROR]: Could not open %s\n",out_name);
+        return 1;
+    }
+    emit(out,&cfg,&cip,argv[1],fn_name);
+    if(out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,258 @@
+// cip8-batch: headless runs of many roms and many instances of each over every core.
+//
+//   $ gcc -O2 batch.c -o cip8-batch -lpthread
+//   $ ./cip8-batch [-j threads] [-n instances] [-c instructions] [-s ips] [-l 1] [-r seed] [-p replay.keys] [-q profile] rom[:instances[:instructions[:profile]]] ...
+//
+// each instance is one task with its own Cip8, the timers tick at 60 Hz of emulated time at -s
+// instructions per second. -l 1 runs the instances of a rom CIP8_LANES at a time in the lockstep
+// engine of cip8_soa.h instead. every instance draws OP_RND from its own generator seeded with -r,
+// and -p plays an input log (cip8_replay.h) into all of them with the seed it was recorded with,
+// so every instance of a rom runs the same workload. results go to stdout as a JSON array, one object per instance.
+// roms go through a cip8_cache.h cache, the same rom given twice is loaded once. -q or the last
+// field of a rom picks the quirk profile it runs with (cip8_quirks_name), legacy by default.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define CIP8_NO_SDL
+#include "cip8.h"
+#include "cip8_sched.h"
+#include "cip8_cache.h"
+#include "cip8_pool.h"
+#include "cip8_soa.h"
+#include "cip8_replay.h"
+
+typedef struct {
+    const char* path;
+    const Cip8* image; // from the cache, every instance shares its pages until it writes them
+    size_t instances;
+    uint64_t instructions;
+    Cip8Quirks quirks;
+} RomJob;
+
+typedef struct {
+    const RomJob* rom;
+    size_t instance;
+    uint32_t ips;
+    size_t group; // instances from this one on that run in one Cip8Lanes, 0 for a plain Cip8
+    uint64_t seed;
+    const Cip8InputLog* replay; // NULL for no input
+
+    // filled by the task
+    uint64_t executed;
+    uint64_t state_hash;
+    uint64_t display_hash;
+    double seconds;
+    bool halted;
+    Cip8Trap trap; // what halted it, if it was a trap
+    Addr trap_ip;  // the inst that trapped
+} Run;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run_instance(void* arg, size_t worker) {
+    Run* run = arg;
+    Cip8* cip = malloc(sizeof(Cip8));
+    assert(cip && "out of memory for an instance");
+    cip8_init_shared(cip,run->rom->image);
+    cip->quirks = run->rom->quirks;
+    cip8_seed(cip,run->seed);
+
+    Cip8Sched sched;
+    cip8_sched_init(&sched,cip,run->ips,CIP8_TIMER_HZ);
+    double start = now_seconds();
+    if(run->replay) {
+        Cip8InputLog replay = *run->replay; // playback position is per instance, the records are shared
+        run->halted = !cip8_replay_run_until(&sched,&replay,run->rom->instructions);
+    } else {
+        run->halted = !cip8_sched_run_until(&sched,run->rom->instructions);
+    }
+    run->seconds = now_seconds() - start;
+
+    run->executed = sched.cycle;
+    run->trap = cip->trap;
+    run->trap_ip = cip->ip;
+    run->state_hash = cip8_state_hash(cip);
+    run->display_hash = cip8_display_hash(cip);
+    cip8_free(cip);
+    free(cip);
+}
+
+static void run_lanes(void* arg, size_t worker) {
+    Run* runs = arg;
+    Cip8Lanes* lanes = malloc(sizeof(Cip8Lanes));
+    assert(lanes && "out of memory for lanes");
+    cip8_lanes_init(lanes,runs->group,runs->rom->image,runs->ips);
+    cip8_lanes_set_quirks(lanes,runs->rom->quirks);
+    for (size_t l = 0; l < lanes->count; l++) cip8_seed(lanes->body[l],runs->seed);
+    double start = now_seconds();
+    // every lane gets the same keys at the same cycle, so replaying keeps them together
+    if(runs->replay) {
+        const Cip8InputLog* log = runs->replay;
+        for (size_t r = 0; r < log->count && log->records[r].cycle < runs->rom->instructions; r++) {
+            cip8_lanes_run_until(lanes,log->records[r].cycle);
+            for (size_t l = 0; l < lanes->count; l++) {
+                for (uint8_t key = 0; key < 16; key++) {
+                    cip8_lanes_set_key(lanes,l,key,(log->records[r].keys >> key) & 1);
+                }
+            }
+        }
+    }
+    cip8_lanes_run_until(lanes,runs->rom->instructions);
+    double seconds = now_seconds() - start;
+
+    for (size_t l = 0; l < lanes->count; l++) {
+        Cip8* cip = cip8_lanes_sync(lanes,l);
+        runs[l].executed = lanes->executed[l];
+        runs[l].halted = cip->halted;
+        runs[l].trap = cip->trap;
+        runs[l].trap_ip = cip->ip;
+        runs[l].state_hash = cip8_state_hash(cip);
+        runs[l].display_hash = cip8_display_hash(cip);
+        runs[l].seconds = seconds / lanes->count; // what the lane cost of the shared run
+    }
+    cip8_lanes_free(lanes);
+    free(lanes);
+}
+
+static void print_json_string(const char* s) {
+    putchar('"');
+    for (; *s; s++) {
+        if(*s == '"' || *s == '\\') putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,"usage: %s [-j threads] [-n instances] [-c instructions] [-s ips] [-l 1] [-r seed] [-p replay.keys] [-q profile] rom[:instances[:instructions[:profile]]] ...\n",name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    size_t threads = 0;
+    size_t instances = 1;
+    uint64_t instructions = 1000000;
+    uint32_t ips = CIP8_DEFAULT_IPS;
+    bool lockstep = false;
+    uint64_t seed = CIP8_DEFAULT_SEED;
+    bool seeded = false;
+    const char* replay_file = NULL;
+    Cip8Quirks quirks = CIP8_QUIRKS_LEGACY;
+
+    RomJob* roms = calloc(argc,sizeof(RomJob));
+    size_t rom_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            switch (argv[i][1]) {
+                case 'j': threads      = strtoull(argv[++i],NULL,10); break;
+                case 'n': instances    = strtoull(argv[++i],NULL,10); break;
+                case 'c': instructions = strtoull(argv[++i],NULL,10); break;
+                case 's': ips          = strtoul(argv[++i],NULL,10);  break;
+                case 'l': lockstep     = atoi(argv[++i]) != 0;        break;
+                case 'r': seed = strtoull(argv[++i],NULL,10); seeded = true; break;
+                case 'p': replay_file  = argv[++i];                   break;
+                case 'q': if(!cip8_quirks_from_name(argv[++i],&quirks)) usage(argv[0]); break;
+                default: usage(argv[0]);
+            }
+            continue;
+        }
+        // rom[:instances[:instructions[:profile]]], the rest default to the flags seen so far
+        RomJob* rom = &roms[rom_count++];
+        char* spec = argv[i];
+        char* colon = strchr(spec,':');
+        rom->instances = instances;
+        rom->instructions = instructions;
+        rom->quirks = quirks;
+        if(colon) {
+            *colon = 0;
+            char* rest = colon + 1;
+            rom->instances = strtoull(rest,&rest,10);
+            if(*rest == ':') rom->instructions = strtoull(rest + 1,&rest,10);
+            if(*rest == ':' && !cip8_quirks_from_name(rest + 1,&rom->quirks)) usage(argv[0]);
+        }
+        rom->path = spec;
+    }
+    if(rom_count == 0) usage(argv[0]);
+
+    Cip8Cache cache;
+    cip8_cache_init(&cache);
+    size_t run_count = 0;
+    for (size_t r = 0; r < rom_count; r++) {
+        roms[r].image = cip8_cache_load(&cache,roms[r].path);
+        if(!roms[r].image) return 1;
+        run_count += roms[r].instances;
+    }
+
+    Cip8InputLog replay;
+    cip8_input_log_init(&replay,seed);
+    if(replay_file) {
+        if(!cip8_input_log_load(&replay,replay_file)) return 1;
+        if(!seeded) seed = replay.seed;
+    }
+
+    Run* runs = calloc(run_count,sizeof(Run));
+    Cip8Pool pool;
+    cip8_pool_init(&pool,threads);
+    double start = now_seconds();
+    size_t k = 0;
+    for (size_t r = 0; r < rom_count; r++) {
+        for (size_t i = 0; i < roms[r].instances; i++, k++) {
+            runs[k].rom = &roms[r];
+            runs[k].instance = i;
+            runs[k].ips = ips;
+            runs[k].seed = seed;
+            runs[k].replay = replay_file ? &replay : NULL;
+        }
+    }
+    for (size_t i = 0; i < run_count;) {
+        if(lockstep) {
+            size_t group = 1;
+            while(group < CIP8_LANES && i + group < run_count && runs[i + group].rom == runs[i].rom) group++;
+            runs[i].group = group;
+            cip8_pool_submit(&pool,i,(Cip8Task){run_lanes,&runs[i]});
+            i += group;
+        } else {
+            cip8_pool_submit(&pool,i,(Cip8Task){run_instance,&runs[i]});
+            i++;
+        }
+    }
+    cip8_pool_wait(&pool);
+    double total = now_seconds() - start;
+    cip8_pool_free(&pool);
+
+    uint64_t executed = 0;
+    printf("[\n");
+    for (size_t i = 0; i < run_count; i++) {
+        Run* run = &runs[i];
+        executed += run->executed;
+        printf("  {\"rom\": ");
+        print_json_string(run->rom->path);
+        printf(", \"instance\": %zu, \"quirks\": \"%s\", \"instructions\": %llu, \"halted\": %s, \"trap\": ",
+               run->instance,cip8_quirks_name(run->rom->quirks),(unsigned long long)run->executed,run->halted ? "true" : "false");
+        if(run->trap) {
+            printf("{\"kind\": \"%s\", \"ip\": \"0x%03x\"}",cip8_trap_name(run->trap),run->trap_ip);
+        } else {
+            printf("null");
+        }
+        printf(", \"state_hash\": \"%016llx\", \"framebuffer_hash\": \"%016llx\", \"instructions_per_sec\": %.0f}%s\n",
+               (unsigned long long)run->state_hash,(unsigned long long)run->display_hash,
+               run->seconds > 0 ? run->executed / run->seconds : 0.0,i + 1 < run_count ? "," : "");
+    }
+    printf("]\n");
+    fprintf(stderr,"[INFO]: %zu runs, %llu instructions in %.3f s on %zu threads, %.0f instructions/sec\n",
+            run_count,(unsigned long long)executed,total,pool.workers,total > 0 ? executed / total : 0.0);
+
+    cip8_input_log_free(&replay);
+    cip8_cache_free(&cache);
+    free(roms);
+    free(runs);
+    return 0;
+}
@@ -0,0 +1,333 @@
+// cip8-bench: every dispatch engine over the test roms on the same footing.
+//
+//   $ gcc -O2 bench.c -o cip8-bench
+//   $ ./cip8-bench [-c instructions] [-s ips] [-e engines] [-g golden] [-u] [rom ...]
+//
+// each rom (tests/*.ch8 when none are given) runs headless for -c instructions at -s instructions
+// per second of emulated time, with the timers ticked at 60 Hz and the same scripted key presses
+// every frame. per engine it prints instructions/sec and ns/instruction, the p50/p99 wall time of
+// emulating one frame (from a second run, reading the clock every frame would slow the first),
+// and checks the framebuffer and state hash at the end against the golden file. -u writes the
+// hashes of this run into it instead. exits 1 when an engine misses its hash.
+//
+// engines: decode  decodes the op-code at ip every step, no decoded table
+//          switch  cip8_step over the decoded table
+//          threaded cip8_run_threaded
+//          run     cip8_run, what the scheduler uses: the switch with idle loops fast-forwarded
+//          jit     cip8_jit_run (falls back to the interpreter off x86-64)
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+
+#define CIP8_NO_SDL
+#include "cip8.h"
+#include "cip8_sched.h"
+#include "cip8_cache.h"
+#include "cip8_jit.h"
+
+#define BENCH_GOLDEN "tests/bench.golden"
+#define BENCH_MAX_GOLDEN 256
+
+typedef struct {
+    const char* name;
+    size_t (*run)(Cip8Jit* jit, Cip8* cip, size_t count);
+} Engine;
+
+typedef struct {
+    char rom[256];
+    uint64_t instructions;
+    uint32_t ips;
+    uint64_t display_hash;
+    uint64_t state_hash;
+} Golden;
+
+typedef struct {
+    uint64_t executed;
+    uint64_t display_hash;
+    uint64_t state_hash;
+    double seconds;
+    double p50, p99; // ns per frame
+    bool halted;
+} Result;
+
+static size_t run_decode(Cip8Jit* jit, Cip8* cip, size_t count) {
+    size_t n = 0;
+    while(n < count && !cip->halted) {
+        Inst inst = cip8_decode_inst(cip8_read16(cip,cip->ip));
+        cip->ip += 2;
+        cip8_execute(cip,inst);
+        n++;
+    }
+    return n;
+}
+static size_t run_switch(Cip8Jit* jit, Cip8* cip, size_t count) {
+    size_t n = 0;
+    while(n < count && !cip->halted) {
+        cip8_step(cip);
+        n++;
+    }
+    return n;
+}
+static size_t run_threaded(Cip8Jit* jit, Cip8* cip, size_t count) {
+    return cip8_run_threaded(cip,count);
+}
+static size_t run_run(Cip8Jit* jit, Cip8* cip, size_t count) {
+    return cip8_run(cip,count);
+}
+static size_t run_jit(Cip8Jit* jit, Cip8* cip, size_t count) {
+    return cip8_jit_run(jit,cip,count);
+}
+
+static const Engine engines[] = {
+    {"decode",   run_decode},
+    {"switch",   run_switch},
+    {"threaded", run_threaded},
+    {"run",      run_run},
+    {"jit",      run_jit},
+};
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// the input every engine sees: a key goes down for 8 frames and up for 8, then the next one,
+// walking the keypad in a fixed order so roms waiting on keys get through their screens
+static void script_input(Cip8* cip, uint64_t frame) {
+    uint8_t key = (frame / 16 * 7 + 3) % 16;
+    cip->keys = frame % 16 < 8 ? 1u << key : 0;
+}
+
+// the smallest back to back clock reading, taken off every frame time
+static double clock_overhead_ns(void) {
+    double best = 1e9;
+    for (int i = 0; i < 1000; i++) {
+        double t = now_seconds();
+        double d = (now_seconds() - t) * 1e9;
+        if(d < best) best = d;
+    }
+    return best;
+}
+
+// one run of the budget a frame at a time. frame_ns gets the wall time of every frame when
+// given, without it only the whole run is timed so the clock does not show up in the speed
+static void run_frames(const Engine* engine, const Cip8* image, uint64_t instructions, uint32_t ips,
+                       Result* r, double* frame_ns, size_t* frames) {
+    Cip8* cip = malloc(sizeof(Cip8));
+    Cip8Jit* jit = malloc(sizeof(Cip8Jit));
+    assert(cip && jit && "out of memory for a bench run");
+    cip8_init_shared(cip,image);
+    cip8_jit_init(jit);
+    cip8_seed(cip,CIP8_DEFAULT_SEED); // every engine draws the same OP_RND numbers
+
+    uint64_t executed = 0;
+    size_t f = 0;
+    double start = now_seconds();
+    while(executed < instructions && !cip->halted) {
+        uint64_t end = (f + 1) * ips / CIP8_TIMER_HZ;
+        if(end > instructions) end = instructions;
+        script_input(cip,f);
+        double t = frame_ns ? now_seconds() : 0;
+        executed += engine->run(jit,cip,end - executed);
+        cip8_tick_timers(cip);
+        if(frame_ns) frame_ns[f] = (now_seconds() - t) * 1e9;
+        f++;
+    }
+    double seconds = now_seconds() - start;
+    if(!frame_ns) {
+        r->executed = executed;
+        r->seconds = seconds;
+        r->halted = cip->halted;
+        r->display_hash = cip8_display_hash(cip);
+        r->state_hash = cip8_state_hash(cip);
+    }
+    *frames = f;
+
+    cip8_jit_free(jit);
+    free(jit);
+    cip8_free(cip);
+    free(cip);
+}
+
+static Result bench(const Engine* engine, const Cip8* image, uint64_t instructions, uint32_t ips, double overhead) {
+    Result r = {0};
+    size_t frames = 0;
+    run_frames(engine,image,instructions,ips,&r,NULL,&frames);
+
+    double* frame_ns = malloc((frames + 1) * sizeof(double));
+    assert(frame_ns && "out of memory for frame times");
+    run_frames(engine,image,instructions,ips,&r,frame_ns,&frames);
+    for (size_t f = 0; f < frames; f++) {
+        frame_ns[f] = frame_ns[f] > overhead ? frame_ns[f] - overhead : 0;
+    }
+    qsort(frame_ns,frames,sizeof(double),cmp_double);
+    r.p50 = frames ? frame_ns[frames / 2] : 0;
+    r.p99 = frames ? frame_ns[frames * 99 / 100] : 0;
+    free(frame_ns);
+    return r;
+}
+
+// lines of "rom instructions ips framebuffer_hash state_hash", # starts a comment
+static size_t golden_read(const char* path, Golden* golden) {
+    FILE* f = fopen(path,"r");
+    if(!f) return 0;
+    size_t n = 0;
+    char line[512];
+    while(n < BENCH_MAX_GOLDEN && fgets(line,sizeof(line),f)) {
+        Golden* g = &golden[n];
+        unsigned long long instructions, display, state;
+        if(line[0] == '#') continue;
+        if(sscanf(line,"%255s %llu %u %llx %llx",g->rom,&instructions,&g->ips,&display,&state) != 5) continue;
+        g->instructions = instructions;
+        g->display_hash = display;
+        g->state_hash = state;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+static bool golden_write(const char* path, const Golden* golden, size_t n) {
+    FILE* f = fopen(path,"w");
+    if(!f) {
+        printf("[ERROR]: Could not write %s\n",path);
+        return false;
+    }
+    fprintf(f,"# cip8-bench golden hashes: rom instructions ips framebuffer_hash state_hash\n");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(f,"%s %llu %u %016llx %016llx\n",golden[i].rom,(unsigned long long)golden[i].instructions,
+                golden[i].ips,(unsigned long long)golden[i].display_hash,(unsigned long long)golden[i].state_hash);
+    }
+    fclose(f);
+    return true;
+}
+static Golden* golden_find(Golden* golden, size_t n, const char* rom, uint64_t instructions, uint32_t ips) {
+    for (size_t i = 0; i < n; i++) {
+        if(!strcmp(golden[i].rom,rom) && golden[i].instructions == instructions && golden[i].ips == ips) {
+            return &golden[i];
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,"usage: %s [-c instructions] [-s ips] [-e decode,switch,threaded,run,jit] [-g golden] [-u] [rom ...]\n",name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    uint64_t instructions = 10000000;
+    uint32_t ips = CIP8_DEFAULT_IPS;
+    const char* engine_list = NULL;
+    const char* golden_path = BENCH_GOLDEN;
+    bool update = false;
+
+    const char** roms = calloc(argc,sizeof(char*));
+    size_t rom_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i],"-u")) {
+            update = true;
+        } else if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            switch (argv[i][1]) {
+                case 'c': instructions = strtoull(argv[++i],NULL,10); break;
+                case 's': ips          = strtoul(argv[++i],NULL,10);  break;
+                case 'e': engine_list  = argv[++i];                   break;
+                case 'g': golden_path  = argv[++i];                   break;
+                default: usage(argv[0]);
+            }
+        } else if(argv[i][0] == '-') {
+            usage(argv[0]);
+        } else {
+            roms[rom_count++] = argv[i];
+        }
+    }
+    if(ips == 0 || instructions == 0) usage(argv[0]);
+
+    glob_t found = {0};
+    if(rom_count == 0) {
+        if(glob("tests/*.ch8",0,NULL,&found) != 0) {
+            printf("[ERROR]: no roms given and none in tests/\n");
+            return 1;
+        }
+        free(roms);
+        roms = (const char**)found.gl_pathv;
+        rom_count = found.gl_pathc;
+    }
+
+    bool use[ENGINE_COUNT];
+    for (size_t e = 0; e < ENGINE_COUNT; e++) {
+        use[e] = !engine_list;
+        if(engine_list) {
+            size_t len = strlen(engines[e].name);
+            for (const char* p = strstr(engine_list,engines[e].name); p; p = strstr(p + 1,engines[e].name)) {
+                if((p == engine_list || p[-1] == ',') && (p[len] == 0 || p[len] == ',')) use[e] = true;
+            }
+        }
+    }
+
+    static Golden golden[BENCH_MAX_GOLDEN];
+    size_t golden_count = golden_read(golden_path,golden);
+
+    Cip8Cache cache;
+    cip8_cache_init(&cache);
+    bool failed = false;
+    double overhead = clock_overhead_ns();
+    printf("%-28s %-8s %10s %8s %10s %10s  %s\n","rom","engine","MIPS","ns/inst","p50 frame","p99 frame","hash");
+    for (size_t r = 0; r < rom_count; r++) {
+        const Cip8* image = cip8_cache_load(&cache,roms[r]);
+        if(!image) {
+            failed = true;
+            continue;
+        }
+        Golden* g = golden_find(golden,golden_count,roms[r],instructions,ips);
+        Golden seen = {0};
+        bool have_seen = false;
+        for (size_t e = 0; e < ENGINE_COUNT; e++) {
+            if(!use[e]) continue;
+            Result res = bench(&engines[e],image,instructions,ips,overhead);
+            const char* verdict;
+            if(!update && g) {
+                verdict = res.display_hash == g->display_hash && res.state_hash == g->state_hash ? "ok" : "MISMATCH";
+            } else if(have_seen) {
+                verdict = res.display_hash == seen.display_hash && res.state_hash == seen.state_hash ? "new" : "MISMATCH";
+            } else {
+                verdict = "new";
+            }
+            if(!strcmp(verdict,"MISMATCH")) failed = true;
+            if(!have_seen) {
+                snprintf(seen.rom,sizeof(seen.rom),"%s",roms[r]);
+                seen.instructions = instructions;
+                seen.ips = ips;
+                seen.display_hash = res.display_hash;
+                seen.state_hash = res.state_hash;
+                have_seen = true;
+            }
+            printf("%-28s %-8s %10.1f %8.2f %8.0fns %8.0fns  %016llx %s%s\n",roms[r],engines[e].name,
+                   res.seconds > 0 ? res.executed / res.seconds / 1e6 : 0.0,
+                   res.executed ? res.seconds * 1e9 / res.executed : 0.0,res.p50,res.p99,
+                   (unsigned long long)res.display_hash,verdict,res.halted ? " (halted)" : "");
+        }
+        if(update && have_seen) {
+            if(!g && golden_count < BENCH_MAX_GOLDEN) g = &golden[golden_count++];
+            if(g) *g = seen;
+        }
+    }
+    if(update && !failed && !golden_write(golden_path,golden,golden_count)) failed = true;
+
+    cip8_cache_free(&cache);
+    if(found.gl_pathv) {
+        globfree(&found);
+    } else {
+        free(roms);
+    }
+    return failed ? 1 : 0;
+}
@@ -2,14 +2,64 @@
 #define CIP8_H_
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+// define CIP8_NO_SDL for a headless core, it drops the texture renderer and the SDL dependency
+#ifndef CIP8_NO_SDL
 #include <SDL2/SDL.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define CIP8_MMAP 1
+#else
+#define CIP8_MMAP 0
+#endif
 
-#define ENABLE_PRINT_DEBUG true
+// printf every instruction as it runs
+#ifndef ENABLE_PRINT_DEBUG
+#define ENABLE_PRINT_DEBUG false
+#endif
+// 1 compiles in the binary trace ring buffer (Cip8.trace), 0 leaves no trace of it in the step loop
+#ifndef CIP8_TRACE
+#define CIP8_TRACE 0
+#endif
+// 1 compiles in the profiler (Cip8.profile): op counts and host cycles, a pc histogram and the call tree
+#ifndef CIP8_PROFILE
+#define CIP8_PROFILE 0
+#endif
+// 1 lets cip8_run fast-forward polling loops that can not change anything before the next event
+#ifndef CIP8_IDLE_SKIP
+#define CIP8_IDLE_SKIP 1
+#endif
+// 1 lets the decoder merge frequent instruction pairs into superinstructions, see cip8_fusions
+#ifndef CIP8_FUSE
+#define CIP8_FUSE 1
+#endif
+// 1 makes cip8_run use the threaded dispatch engine instead of the switch in cip8_execute
+#ifndef CIP8_THREADED_DISPATCH
+#define CIP8_THREADED_DISPATCH 0
+#endif
+// keeps a cold function from being pasted into the hot one that calls it
+#if defined(__GNUC__) || defined(__clang__)
+#define CIP8_NOINLINE __attribute__((noinline))
+#else
+#define CIP8_NOINLINE
+#endif
+// the other way round, for a body that only pays off once its quirks are constants
+#if defined(__GNUC__) || defined(__clang__)
+#define CIP8_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define CIP8_ALWAYS_INLINE inline
+#endif
 
 
 #define PROGRAM_START 0x200
-#define MAX_EXCUTED_INST 20
-#define CURR_INST(cip) (cip->memory[cip->ip] << 8) | cip->memory[cip->ip + 1]
+#define CURR_INST(cip) cip8_read16(cip,cip->ip)
 
 #define GET_N(code) (code) & 0xF
 #define GET_NN(code) (code) & 0xFF
@@ -21,11 +71,12 @@
 #define GET_VX(code) cip->regs.V[GET_X(code) ] 
 #define GET_VY(code) cip->regs.V[GET_Y(code)] 
 #define SET_FLAG(cip,val) (cip)->regs.V[0xF] = (val)
-#define GET_KEY(i) cip->keyboard[(i)]
+#define GET_KEY(i) ((cip->keys >> ((i) & 0xF)) & 1)
 
 
 
-typedef double Timer; 
+typedef uint8_t Timer; // counts down at 60 Hz, see cip8_tick_timers
+#define CIP8_DEFAULT_SEED 1 // what cip8_init seeds OP_RND with
 typedef unsigned short Addr;
 typedef uint16_t OpCode; 
 
@@ -33,31 +84,10 @@ typedef uint16_t OpCode;
 #define BACKGROUND 0x000000
 #define FOREGROUND 0x00FFFF
 #define MEMORY_SIZE 4096
-typedef struct  {
-    uint8_t memory[MEMORY_SIZE];
-    uint8_t* display_refresh;
-    uint8_t* call_stack; 
-
-    Addr ip;
-    Addr sp;
-
-    struct {
-        uint8_t V[16]; // VF for flags
-        Addr I; // 12 bits used
-    } regs;    
-
-    Timer delay_timer;
-    Timer sound_timer;
-    size_t keyboard[16];
-
-
-    bool blocked;
-    bool halted;
-    bool display_changed;
-    bool waiting_release;
-} Cip8;
-
-
+#define CIP8_STACK_TOP   0xEFF // sp of an empty stack, it grows down
+#define CIP8_STACK_LIMIT 0xEA0 // OP_CALLS with sp at or below this overflows
+#define CIP8_DISPLAY_WIDTH 64
+#define CIP8_DISPLAY_HEIGHT 32
 typedef enum  {
     OP_CALL,      
     OP_CLD, 
@@ -94,43 +124,446 @@ typedef enum  {
     OP_BCD,
     OP_DUMP,
     OP_LOAD,
+    // fused pairs, only ever in decoded tables. each stands for its inst and the one after it
+    OP_SKIP_GOTO, // any skip, 1NNN
+    OP_ADD_JEQ,   // 7XNN, 3XNN
+    OP_ADD_JNEQ,  // 7XNN, 4XNN
+    OP_MOV_KEYD,  // 6XNN, EX9E
+    OP_MOV_KEYU,  // 6XNN, EXA1
+    OP_SETI_ADDI, // ANNN, FX1E
+    OP_ADDI_LOAD, // FX1E, FX65
+    OP_SPR_DRW,   // FX29, DXYN
+    OP_INVALID,   // not a known op-code, traps when run. also the second of an inst that is not fused
 } Operation;
+// goes by value through every handler, at 12 bytes instead of 8 every op got a third slower
 typedef struct {
-    Operation op;
+    uint8_t op;       // an Operation
+    uint8_t first;    // op of this inst on its own, the same as op when it is not fused
     uint16_t oprand;
+    uint16_t oprand2; // of the second inst when op is fused
+    uint8_t second;   // op of the second inst when op is fused
+    bool idle; // ends a loop that may only poll, see cip8_idle_skip
 } Inst;
+// why a machine stopped by itself. the op that trapped did nothing, ip is left on it and halted is set,
+// so every run loop stops there and the rest of the process carries on
+typedef enum {
+    CIP8_TRAP_NONE,
+    CIP8_TRAP_BAD_OPCODE,      // OP_INVALID, or a 0NNN machine code call
+    CIP8_TRAP_STACK_OVERFLOW,  // OP_CALLS with the stack full
+    CIP8_TRAP_STACK_UNDERFLOW, // OP_RET with nothing to return to
+    CIP8_TRAP_BAD_ADDRESS,     // I plus the bytes the op reads or writes past the end of memory
+} Cip8Trap;
+// the CHIP-8 variants disagree on a few ops. a quirk is one variant's way of doing one of them
+#define CIP8_QUIRK_SHIFT_VY  1u // 8XY6/8XYE shift VY into VX instead of shifting VX
+#define CIP8_QUIRK_LOAD_I    2u // FX55/FX65 leave I past the last register they touched, I + X + 1
+#define CIP8_QUIRK_LOAD_I_X  4u // FX55/FX65 leave I at I + X, the CHIP-48 off by one
+#define CIP8_QUIRK_CLIP      8u // DXYN cuts sprites off at the right and bottom edges instead of wrapping
+#define CIP8_QUIRK_JUMP_VX  16u // BXNN jumps to XNN + VX instead of NNN + V0
+// a profile is the quirks of one variant, picked per rom through Cip8.quirks. the engines resolve
+// them when they are compiled: the switch loops get a copy per profile and the threaded one a
+// handler table per profile, so no op looks at a quirk while it runs
+#define CIP8_QUIRK_PROFILES(X)                                                          \
+    X(LEGACY, "legacy", 0) /* what this emulator always did */                          \
+    X(VIP,    "vip",    CIP8_QUIRK_SHIFT_VY | CIP8_QUIRK_LOAD_I | CIP8_QUIRK_CLIP)       \
+    X(CHIP48, "chip48", CIP8_QUIRK_LOAD_I_X | CIP8_QUIRK_CLIP | CIP8_QUIRK_JUMP_VX)      \
+    X(SCHIP,  "schip",  CIP8_QUIRK_CLIP | CIP8_QUIRK_JUMP_VX)                            \
+    X(XOCHIP, "xochip", CIP8_QUIRK_SHIFT_VY | CIP8_QUIRK_LOAD_I)
+typedef enum {
+#define CIP8_QUIRKS_ENUM(id,name,flags) CIP8_QUIRKS_##id,
+    CIP8_QUIRK_PROFILES(CIP8_QUIRKS_ENUM)
+#undef CIP8_QUIRKS_ENUM
+    CIP8_QUIRKS_COUNT,
+} Cip8Quirks;
+// memory is 16 pages of 256 bytes. a page can be shared read-only between instances (a rom
+// image, the zero page) and gets copied into one the instance owns the first time it is written
+#define CIP8_PAGE_SIZE 256
+#define CIP8_PAGES (MEMORY_SIZE / CIP8_PAGE_SIZE)
+typedef struct {
+    uint8_t bytes[CIP8_PAGE_SIZE];
+    Inst* decoded; // inst for every even address, NULL until something runs from the page
+} Cip8Page;
+
+typedef struct  {
+    Cip8Page* pages[CIP8_PAGES];
+    Inst* code[CIP8_PAGES]; // pages[p]->decoded, saves fetch a load
+    uint16_t owned; // bit per page this instance copied and has to free
+    uint64_t display[CIP8_DISPLAY_HEIGHT]; // one word per row, bit x is pixel x
+
+    Addr ip;
+    Addr sp;
+    Addr dirty_start, dirty_end; // memory re-decoded since cip8_jit last looked, empty when equal
+
+    struct {
+        uint8_t V[16]; // VF for flags
+        Addr I; // 12 bits used
+    } regs;    
+
+    Timer delay_timer;
+    Timer sound_timer;
+    uint16_t keys; // bit per key held down
+    uint64_t rng;  // xorshift64* state for OP_RND, never 0, see cip8_seed
+    uint64_t mem_hash; // zobrist hash of memory, every write keeps it up, see cip8_zobrist
+    uint8_t quirks;    // a Cip8Quirks, instances share it with their image like the rom
+
+
+#if CIP8_TRACE
+    struct Cip8Trace* trace; // NULL when not tracing
+#endif
+#if CIP8_PROFILE
+    struct Cip8Profile* profile; // NULL when not profiling
+#endif
+
+    bool halted;
+    Cip8Trap trap; // CIP8_TRAP_NONE unless a trap halted it
+    bool display_changed;
+    uint32_t dirty_rows; // bit per display row drawn to since the renderer last picked them up
+    bool waiting_release;
+} Cip8;
+
+
 typedef struct {
     uint8_t val[5];
 } Char;
 
+// what the terminal shows, two display rows per text line drawn with half blocks
+#define CIP8_TERM_LINES 16
+#define CIP8_TERM_COLS  64
+typedef struct {
+    uint8_t cells[CIP8_TERM_LINES][CIP8_TERM_COLS]; // bit 0 top pixel, bit 1 bottom pixel
+    bool drawn;                                     // false until the first full frame went out
+    char out[CIP8_TERM_LINES * CIP8_TERM_COLS * 16];
+} Cip8Term;
+
+// save state. a flat copy of everything that makes up the machine, no pointers, so it can be
+// written to a file or compared byte by byte. bump the version when the layout changes
+#define CIP8_SNAPSHOT_MAGIC "CIP8SNAP"
+#define CIP8_SNAPSHOT_VERSION 3
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t size; // sizeof(Cip8Snapshot) of the writer
+    uint8_t memory[MEMORY_SIZE];
+    uint64_t display[CIP8_DISPLAY_HEIGHT];
+    uint8_t V[16];
+    Addr I;
+    Addr ip;
+    Addr sp;
+    uint16_t keys;
+    Timer delay_timer;
+    Timer sound_timer;
+    uint8_t halted;
+    uint8_t trap;
+    uint8_t waiting_release;
+    uint64_t rng;
+} Cip8Snapshot;
+
+// a rom file as it is on disk, mapped read only where there is mmap and read into a buffer elsewhere
+#define CIP8_ROM_MAX_SIZE (MEMORY_SIZE - PROGRAM_START)
+typedef struct {
+    const uint8_t* bytes;
+    size_t size;
+    bool mapped;
+} Cip8Rom;
+
+#if CIP8_TRACE
+#include <stdatomic.h>
+// fixed size binary record of one step, taken before the instruction runs.
+// trace.c turns a dump of these back into cip8_print_inst lines
+typedef struct {
+    uint32_t seq;     // low bits of the record index, a reader uses it to spot overwritten records
+    Addr pc;
+    OpCode opcode;
+    Addr I;
+    Addr sp;
+    uint8_t vx, vy;   // registers named by the X and Y nibbles
+    uint8_t vf;
+    uint8_t pad;
+} Cip8TraceRecord;
+
+#define CIP8_TRACE_SIZE (1 << 16) // records, has to be a power of two
+#define CIP8_TRACE_MAGIC "CIP8TRC1"
+
+// single producer ring: the emulating thread is the only writer and only ever publishes head,
+// so a dump from another thread (or a crash handler) needs no lock. every slot is a seqlock, the
+// record sits in two atomic words so a reader racing the writer gets a torn copy it can tell
+// from a good one instead of undefined behaviour
+typedef struct {
+    _Atomic uint32_t seq;      // 2 * index + 2 once record index is in, odd while it is written
+    _Atomic uint64_t words[2]; // the Cip8TraceRecord
+} Cip8TraceSlot;
+typedef struct Cip8Trace {
+    _Atomic uint64_t head; // records ever written
+    Cip8TraceSlot slots[CIP8_TRACE_SIZE];
+} Cip8Trace;
+
+void cip8_trace_init(Cip8Trace* trace);
+bool cip8_trace_dump(Cip8Trace* trace, const char* file_name);
+#define CIP8_TRACE_STEP(cip) do { if((cip)->trace) cip8_trace_record((cip)->trace,(cip)); } while(0)
+#else
+#define CIP8_TRACE_STEP(cip) ((void)0)
+#endif
+
+#if CIP8_PROFILE
+// every step is counted before it runs and charged the host cycles until the next one starts,
+// so an op's cycles include its dispatch. OP_CALLS and OP_RET move through a call tree whose
+// nodes are the entry addresses on the way down, that is what the folded stacks are made of
+#define CIP8_PROFILE_MAX_NODES 4096
+#define CIP8_PROFILE_MAX_DEPTH 64
+typedef struct {
+    Addr fn;              // entry address, PROGRAM_START for the root
+    uint16_t parent;
+    uint16_t child;       // first child, 0 for none (the root is never a child)
+    uint16_t sibling;     // next child of the parent
+    uint16_t depth;
+    uint64_t calls;       // times entered through OP_CALLS
+    uint64_t steps;       // instructions run in it, callees not included
+    uint64_t cycles;
+} Cip8ProfileNode;
+
+typedef struct Cip8Profile {
+    uint64_t op_count[OP_INVALID + 1];
+    uint64_t op_cycles[OP_INVALID + 1];
+    uint64_t pc_hits[MEMORY_SIZE];
+    Cip8ProfileNode nodes[CIP8_PROFILE_MAX_NODES];
+    size_t node_count;
+    uint16_t node;        // where the machine is in the call tree
+    uint16_t lost;        // calls deeper than the tree can hold, their returns pop these first
+    uint64_t last;        // clock when the previous step started
+    Operation last_op;
+    uint16_t last_node;
+    bool started;
+} Cip8Profile;
+
+void cip8_profile_init(Cip8Profile* prof);
+void cip8_profile_report(const Cip8Profile* prof, const Cip8* cip, size_t top);
+bool cip8_profile_folded(const Cip8Profile* prof, const char* file_name);
+#define CIP8_PROFILE_STEP(cip,inst) do { if((cip)->profile) cip8_profile_record((cip)->profile,(cip)->ip,(inst)); } while(0)
+#else
+#define CIP8_PROFILE_STEP(cip,inst) ((void)0)
+#endif
+
 void cip8_init(Cip8* cip); 
-void cip8_load_program(Cip8* cip, size_t size , OpCode* program);
+void cip8_init_shared(Cip8* cip, const Cip8* image);
+void cip8_free(Cip8* cip);
+void cip8_set_key(Cip8* cip, uint8_t key, bool down);
+void cip8_seed(Cip8* cip, uint64_t seed);
+bool cip8_load_program(Cip8* cip, const uint8_t* program, size_t size);
 void cip8_print_program(const Cip8 cip, size_t start,size_t count);
-Inst cip8_compile_inst(OpCode code);
+Inst cip8_decode_inst(OpCode code);
+void cip8_predecode(Cip8* cip, Addr start, size_t count);
+Inst cip8_inst_at(Cip8* cip, Addr addr);
+Inst cip8_inst_peek(const Cip8* cip, Addr addr);
+Inst cip8_fetch(Cip8* cip);
 void cip8_print_inst(Cip8 cip,Inst inst);
-void cip8_execute(Cip8* cip,Inst inst);
-void cip8_step(Cip8* cip);
-void  cip8_run(Cip8* cip);
+size_t cip8_execute(Cip8* cip,Inst inst);
+Cip8Trap cip8_step(Cip8* cip);
+Cip8Trap cip8_step_reference(Cip8* cip);
+const char* cip8_trap_name(Cip8Trap trap);
+unsigned cip8_quirk_flags(Cip8Quirks quirks);
+const char* cip8_quirks_name(Cip8Quirks quirks);
+bool cip8_quirks_from_name(const char* name, Cip8Quirks* quirks);
+size_t cip8_run_threaded(Cip8* cip, size_t count);
+size_t cip8_run(Cip8* cip, size_t count);
 void cip8_clear_display(Cip8* cip);
-void cip8_sdl_from_mem_to_texture(const Cip8 cip,SDL_Surface* surface,SDL_Texture* texture);
-void cip8_from_mem_to_terminal(const Cip8 cip); 
+#ifndef CIP8_NO_SDL
+void cip8_sdl_stream_to_texture(Cip8* cip,SDL_Texture* texture);
+void cip8_sdl_stream_rows(const uint64_t display[CIP8_DISPLAY_HEIGHT],uint32_t dirty_rows,SDL_Texture* texture);
+#endif
+void cip8_terminal_init(Cip8Term* term);
+void cip8_from_mem_to_terminal(Cip8Term* term,const Cip8* cip); 
 void cip8_write_char(Cip8* cip, uint8_t i);
-OpCode* cip8_load_from_file(const char* file_name,int* size);
+bool cip8_rom_open(Cip8Rom* rom, const char* file_name);
+void cip8_rom_close(Cip8Rom* rom);
+bool cip8_load_file(Cip8* cip, const char* file_name);
+uint64_t cip8_state_hash(const Cip8* cip);
+uint64_t cip8_zobrist(const Cip8* cip);
+uint64_t cip8_display_hash(const Cip8* cip);
+void cip8_snapshot(const Cip8* cip, Cip8Snapshot* snap);
+bool cip8_restore(Cip8* cip, const Cip8Snapshot* snap);
+
+
+// every page starts out as this one, nothing ever writes to it
+static Cip8Page cip8_zero_page;
+
+// idle loops: a backward goto over at most CIP8_IDLE_MAX_LOOP insts that only compare, read the
+// delay timer or keys and do register arithmetic, or a getk spinning on itself. timers only tick
+// and keys only change between cip8_run calls, so once one pass of such a loop leaves every
+// register as it found them every later pass will too, and cip8_run can count the passes up to
+// the end of its budget (the next event) instead of running them
+#define CIP8_IDLE_MAX_LOOP 8
+static inline bool cip8_idle_pure(Operation op) {
+    switch (op) {
+        case OP_JVEQ: case OP_JVNEQ: case OP_JEQ: case OP_JNEQ: case OP_KEYD: case OP_KEYU:
+        case OP_MOV: case OP_ADD: case OP_ASS: case OP_OR: case OP_XOR: case OP_AND:
+        case OP_ADDC: case OP_SUBC: case OP_SHR: case OP_SUBR: case OP_SHL:
+        case OP_SETI: case OP_ADDI: case SETISPR: case OP_GETDT:
+        case OP_GOTO: case OP_GETK:
+            return true;
+        default:
+            return false;
+    }
+}
+static inline uint8_t cip8_read(const Cip8* cip, Addr addr);
+static inline OpCode cip8_read16(const Cip8* cip, Addr addr);
+// decode time half: flags the goto at addr when its loop body qualifies, the rest is checked as it runs
+static void cip8_idle_mark(const Cip8* cip, Inst* inst, Addr addr) {
+    if(inst->op != OP_GOTO) return;
+    Addr target = GET_NNN(inst->oprand);
+    inst->idle = false;
+    if(target > addr || target & 1 || addr - target > 2 * CIP8_IDLE_MAX_LOOP) return;
+    for (Addr a = target; a < addr; a += 2) {
+        Operation op = cip8_decode_inst(cip8_read16(cip,a)).op;
+        if(!cip8_idle_pure(op) || op == OP_GOTO || op == OP_GETK) return;
+    }
+    inst->idle = true;
+}
 
+// superinstructions: the pairs that run back to back most, counted over the test roms (skip then
+// goto 2.3% of all steps, add then skip 1.9%, ANNN FX1E 1.7%, FX1E FX65 1.5%, a key number then
+// its key skip 1.4%, FX29 DXYN 1.1%).
+//
+// a fused op only replaces the table entry of the first inst, the second keeps its own, so a jump
+// straight to it still runs it alone. the first inst of a pair never jumps or writes code, only
+// SETISPR writes the font below PROGRAM_START, and nothing there is fused. pairs never cross a
+// page, the two halves are always owned and decoded together
+static const struct { Operation first, second, fused; } cip8_fusions[] = {
+    {OP_JEQ,  OP_GOTO,OP_SKIP_GOTO}, {OP_JNEQ, OP_GOTO,OP_SKIP_GOTO}, {OP_JVEQ,OP_GOTO,OP_SKIP_GOTO},
+    {OP_JVNEQ,OP_GOTO,OP_SKIP_GOTO}, {OP_KEYD, OP_GOTO,OP_SKIP_GOTO}, {OP_KEYU,OP_GOTO,OP_SKIP_GOTO},
+    {OP_ADD,  OP_JEQ, OP_ADD_JEQ},   {OP_ADD,  OP_JNEQ,OP_ADD_JNEQ},
+    {OP_MOV,  OP_KEYD,OP_MOV_KEYD},  {OP_MOV,  OP_KEYU,OP_MOV_KEYU},
+    {OP_SETI, OP_ADDI,OP_SETI_ADDI}, {OP_ADDI, OP_LOAD,OP_ADDI_LOAD}, {SETISPR, OP_DRW, OP_SPR_DRW},
+};
+static inline bool cip8_fused(Operation op) {
+    return op > OP_LOAD && op < OP_INVALID;
+}
+// the first inst of a pair on its own
+static inline Inst cip8_unfuse(Inst inst) {
+    if(inst.op != inst.first) {
+        inst.op = inst.first;
+        inst.idle = false;
+    }
+    return inst;
+}
+static inline Inst cip8_fused_second(Inst inst) {
+    Inst second = inst;
+    second.op = second.first = inst.second;
+    second.oprand = inst.oprand2;
+    return second;
+}
+// fuses the table entry for addr with next, or puts it back the way it decoded
+static void cip8_fuse(Inst* inst, Inst next, Addr addr) {
+    *inst = cip8_unfuse(*inst);
+    next = cip8_unfuse(next);
+    if(!CIP8_FUSE || addr < PROGRAM_START || addr % CIP8_PAGE_SIZE == CIP8_PAGE_SIZE - 2) return;
+    for (size_t i = 0; i < sizeof(cip8_fusions) / sizeof(cip8_fusions[0]); i++) {
+        if(cip8_fusions[i].first == inst->op && cip8_fusions[i].second == next.op) {
+            inst->op = cip8_fusions[i].fused;
+            inst->second = next.op;
+            inst->oprand2 = next.oprand;
+            inst->idle = next.idle; // a goto closing an idle loop
+            return;
+        }
+    }
+}
+
+static void cip8_page_decode(Cip8* cip, size_t p) {
+    Cip8Page* page = cip->pages[p];
+    if(!page->decoded) {
+        page->decoded = malloc(CIP8_PAGE_SIZE / 2 * sizeof(Inst));
+        assert(page->decoded && "out of memory for a decoded page");
+    }
+    for (size_t i = 0; i < CIP8_PAGE_SIZE; i += 2) {
+        page->decoded[i / 2] = cip8_decode_inst((page->bytes[i] << 8) | page->bytes[i + 1]);
+    }
+    cip->code[p] = page->decoded;
+    for (size_t i = 0; i < CIP8_PAGE_SIZE; i += 2) {
+        cip8_idle_mark(cip,page->decoded + i / 2,p * CIP8_PAGE_SIZE + i);
+    }
+    for (size_t i = 0; i + 2 < CIP8_PAGE_SIZE; i += 2) {
+        cip8_fuse(page->decoded + i / 2,page->decoded[i / 2 + 1],p * CIP8_PAGE_SIZE + i);
+    }
+}
+// copy on write, a page that had a decoded table keeps one
+static void cip8_page_own(Cip8* cip, size_t p) {
+    const Cip8Page* shared = cip->pages[p];
+    Cip8Page* page = malloc(sizeof(Cip8Page));
+    assert(page && "out of memory for a page");
+    memcpy(page->bytes,shared->bytes,CIP8_PAGE_SIZE);
+    page->decoded = NULL;
+    if(shared->decoded) {
+        page->decoded = malloc(CIP8_PAGE_SIZE / 2 * sizeof(Inst));
+        assert(page->decoded && "out of memory for a decoded page");
+        memcpy(page->decoded,shared->decoded,CIP8_PAGE_SIZE / 2 * sizeof(Inst));
+    }
+    cip->pages[p] = page;
+    cip->code[p] = page->decoded;
+    cip->owned |= 1u << p;
+}
+// splitmix64 finalizer
+static inline uint64_t cip8_mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+// key of one memory byte in the zobrist hash. a zero byte has none, so all zero memory hashes to 0
+static inline uint64_t cip8_zobrist_byte(size_t addr, uint8_t val) {
+    return val ? cip8_mix64(((uint64_t)addr << 8 | val) * 0x9E3779B97F4A7C15ull) : 0;
+}
+// addresses wrap at MEMORY_SIZE
+static inline uint8_t cip8_read(const Cip8* cip, Addr addr) {
+    return cip->pages[addr / CIP8_PAGE_SIZE % CIP8_PAGES]->bytes[addr % CIP8_PAGE_SIZE];
+}
+static inline OpCode cip8_read16(const Cip8* cip, Addr addr) {
+    return (cip8_read(cip,addr) << 8) | cip8_read(cip,addr + 1);
+}
+// does not re-decode, callers cip8_predecode what they wrote like before
+static inline void cip8_write(Cip8* cip, Addr addr, uint8_t val) {
+    size_t p = addr / CIP8_PAGE_SIZE % CIP8_PAGES;
+    if(!((cip->owned >> p) & 1)) cip8_page_own(cip,p);
+    uint8_t* byte = &cip->pages[p]->bytes[addr % CIP8_PAGE_SIZE];
+    cip->mem_hash ^= cip8_zobrist_byte(addr % MEMORY_SIZE,*byte) ^ cip8_zobrist_byte(addr % MEMORY_SIZE,val);
+    *byte = val;
+}
+// memcpy into memory that keeps mem_hash up, the range can not cross a page
+static void cip8_write_bytes(Cip8* cip, size_t addr, const uint8_t* bytes, size_t n) {
+    size_t p = addr / CIP8_PAGE_SIZE;
+    if(!((cip->owned >> p) & 1)) cip8_page_own(cip,p);
+    uint8_t* to = cip->pages[p]->bytes + addr % CIP8_PAGE_SIZE;
+    for (size_t i = 0; i < n; i++) {
+        cip->mem_hash ^= cip8_zobrist_byte(addr + i,to[i]) ^ cip8_zobrist_byte(addr + i,bytes[i]);
+    }
+    memcpy(to,bytes,n);
+}
 
 void cip8_init(Cip8* cip) { 
     cip->ip = PROGRAM_START; 
-    cip->sp = 0xEFF;
-    cip->display_refresh = cip->memory + 0xF00;
-    cip->call_stack      = cip->memory + 0xEA0;
-    
+    cip->sp = CIP8_STACK_TOP;
 
-    for (size_t i = 0; i < MEMORY_SIZE; i++)  cip->memory[i] = 0;
+    for (size_t p = 0; p < CIP8_PAGES; p++) {
+        cip->pages[p] = &cip8_zero_page;
+        cip->code[p] = NULL;
+    }
+    cip->owned = 0;
+    cip->mem_hash = 0;
+    cip->quirks = CIP8_QUIRKS_LEGACY;
+    cip8_clear_display(cip);
 
-    cip->blocked = false;
     cip->halted = false;
+    cip->trap = CIP8_TRAP_NONE;
+#if CIP8_TRACE
+    cip->trace = NULL;
+#endif
+#if CIP8_PROFILE
+    cip->profile = NULL;
+#endif
     cip->waiting_release = false;
     cip->display_changed = false;
+    cip->dirty_rows = 0xFFFFFFFF;
+    cip->dirty_start = cip->dirty_end = 0;
+    cip->keys = 0;
+    cip->delay_timer = 0;
+    cip->sound_timer = 0;
+    cip8_seed(cip,CIP8_DEFAULT_SEED);
 
     const Char chars[16] = {
         (Char){.val = {0xF0, 0x90, 0x90, 0x90, 0xF0}}, // 0
@@ -153,55 +586,89 @@ void cip8_init(Cip8* cip) {
 
 
     for (size_t i = 0; i < 16; i++) { 
-        cip->keyboard[i] = 0; // Reset keyboard 
         cip->regs.V[i] = 0;  // Reset Regs
 
         // OP_LOAD Font
         for (size_t j = 0; j < 5; j++) {
-            cip->memory[5 * i+j]   = chars[i].val[j];
+            cip8_write(cip,5 * i + j,chars[i].val[j]);
         }
         
     }
 
 
     cip8_write_char(cip,0xB);
-
+    cip8_predecode(cip,0,MEMORY_SIZE);
+}
+// cip starts out as a copy of image and shares its pages until it writes to them,
+// image has to outlive cip and must not run while anything shares it
+void cip8_init_shared(Cip8* cip, const Cip8* image) {
+    *cip = *image;
+    cip->owned = 0;
+}
+void cip8_free(Cip8* cip) {
+    for (size_t p = 0; p < CIP8_PAGES; p++) {
+        if((cip->owned >> p) & 1) {
+            free(cip->pages[p]->decoded);
+            free(cip->pages[p]);
+        }
+        cip->pages[p] = &cip8_zero_page;
+        cip->code[p] = NULL;
+    }
+    cip->owned = 0;
+}
+void cip8_set_key(Cip8* cip, uint8_t key, bool down) {
+    uint16_t bit = 1u << (key & 0xF);
+    cip->keys = down ? cip->keys | bit : cip->keys & ~bit;
+}
+// every instance draws its own numbers, the same seed gives the same OP_RND results on any engine.
+// the seed goes through splitmix64 first so neighbouring seeds do not start out alike
+void cip8_seed(Cip8* cip, uint64_t seed) {
+    uint64_t z = cip8_mix64(seed + 0x9E3779B97F4A7C15ull);
+    cip->rng = z ? z : 1;
 }
 
 // every time i draw a font, i OP_LOAD it to memory location OP_AND point I to it 
 void cip8_write_char(Cip8* cip, uint8_t i) { 
     for (size_t j = 0; j < 5; j++) {
-        cip->memory[5 * 16 +  j] = cip->memory[5 * i + j];
+        cip8_write(cip,5 * 16 + j,cip8_read(cip,5 * i + j));
     }
+    cip8_predecode(cip,5 * 16,5);
     cip->regs.I = 5 * 16;    
 }
 
 
-void cip8_load_program(Cip8* cip, size_t size , OpCode* program) {
-    size_t ip = PROGRAM_START;
-
-    // check if little endian AND OP_LOAD
-    int n = 1;
-    if(*(char*)(&n) == 1) {
-        for (size_t i = 0; i < size; i++) {
-            cip->memory[ip + 2 * i    ] = (program[i] & 0x00FF) >> 0;
-            cip->memory[ip + 2 * i + 1] = (program[i] & 0xFF00) >> 8;
-        }
-    } else {
-        for (size_t i = 0; i < size; i++) {
-            cip->memory[ip + 2 * i    ] = (program[i] & 0xFF00) >> 8;
-            cip->memory[ip + 2 * i + 1] = (program[i] & 0x00FF) >> 0;
-        }
+// copies the rom as it is in the file to PROGRAM_START. every page the machine owns afterwards
+// has its decoded table, so nothing is built lazily later and the result can be shared between
+// threads with cip8_init_shared
+bool cip8_load_program(Cip8* cip, const uint8_t* program, size_t size) {
+    if(size > CIP8_ROM_MAX_SIZE) {
+        printf("[ERROR]: rom is %zu bytes, only %d fit in memory\n",size,CIP8_ROM_MAX_SIZE);
+        return false;
     }
+    for (size_t done = 0; done < size;) {
+        size_t addr = PROGRAM_START + done;
+        size_t n = CIP8_PAGE_SIZE - addr % CIP8_PAGE_SIZE;
+        if(n > size - done) n = size - done;
+        cip8_write_bytes(cip,addr,program + done,n);
+        done += n;
+    }
+    for (size_t p = 0; p < CIP8_PAGES; p++) {
+        if((cip->owned >> p) & 1) cip8_page_decode(cip,p);
+    }
+    cip8_predecode(cip,PROGRAM_START,size);
+    return true;
 }
 void cip8_print_program(const Cip8 cip, size_t start,size_t count) {
     for (size_t i = 0; i < count * 2; i+=2) {
-        printf("0x%02X%02X\n",  cip.memory[start + i], cip.memory[start + i + 1]);
+        printf("0x%04X\n",  cip8_read16(&cip,start + i));
     }
 }
-Inst cip8_compile_inst(OpCode code) {
+// unknown op-codes become OP_INVALID and only trap if they are run, so this can go over data in
+// the rom when filling the decoded table
+Inst cip8_decode_inst(OpCode code) {
     Inst inst;
     inst.oprand = code & 0x0FFF;
+    inst.idle = false;
 
     switch ((code & 0xF000) >> (4 * 3))
     {
@@ -209,10 +676,7 @@ Inst cip8_compile_inst(OpCode code) {
             switch (code & 0x00FF) {
                 case 0xEE: inst.op = OP_RET;      break;                                          
                 case 0xE0: inst.op = OP_CLD;      break;                                          
-                default:
-                    printf("op-code: 0x%02X\n",code);
-                    assert(0 && "Unreachable unknown op-code 0X__");
-                break;
+                default: inst.op = OP_INVALID; break;
             }
         break;
         case 1: inst.op = OP_GOTO;     break;
@@ -233,10 +697,7 @@ Inst cip8_compile_inst(OpCode code) {
                 case 6:     inst.op = OP_SHR;   break;           
                 case 7:     inst.op = OP_SUBR;  break;            
                 case 14:  inst.op = OP_SHL;   break;                                                                                                                               
-                default: 
-                    printf("op-code: 0x%X\n",code);
-                    assert(0 && "Unreachable unknown op-code 8XX_");
-                break;
+                default: inst.op = OP_INVALID; break;
             }
         break; 
         case 9: inst.op = OP_JVNEQ;      break;                                          
@@ -248,10 +709,7 @@ Inst cip8_compile_inst(OpCode code) {
             switch (code & 0x00FF) {
                 case 0x9E: inst.op = OP_KEYD;      break;                                          
                 case 0xA1: inst.op = OP_KEYU;      break;                                          
-                default:
-                    printf("op-code: 0x%X\n",code);
-                    assert(0 && "Unreachable unknown op-code EX__");
-                break;
+                default: inst.op = OP_INVALID; break;
             }
         break;        
         case 15: 
@@ -265,23 +723,297 @@ Inst cip8_compile_inst(OpCode code) {
                 case 0x33: inst.op = OP_BCD;      break;                                          
                 case 0x55: inst.op = OP_DUMP;      break;                                          
                 case 0x65: inst.op = OP_LOAD;      break;                                          
-                default:
-                    printf("op-code: 0x%X\n",code);
-                    assert(0 && "Unreachable unknown op-code EX__");
-                break;
+                default: inst.op = OP_INVALID; break;
             }
         break;                                             
-        default: 
-            printf("op-code: 0x%X\n",code);
-            assert(0 && "Unreachable unknown op-code");
-        break;
+        default: inst.op = OP_INVALID; break;
     }
 
+    inst.idle = inst.op == OP_GETK;
+    inst.first = inst.op;
+    inst.second = OP_INVALID;
+    inst.oprand2 = 0;
     return inst;
 }
+// decodes again every table entry overlapping memory[start .. start + count),
+// has to be called after anything writes to memory that could be executed
+void cip8_predecode(Cip8* cip, Addr start, size_t count) {
+    if(count == 0) return;
+    // I can point past the end of memory and cip8_write wraps around, so the range wraps too
+    start %= MEMORY_SIZE;
+    if(count > MEMORY_SIZE) count = MEMORY_SIZE;
+    if(start + count > MEMORY_SIZE) {
+        cip8_predecode(cip,0,start + count - MEMORY_SIZE);
+        count = MEMORY_SIZE - start;
+    }
+    size_t end = start + count;
+    if(cip->dirty_start == cip->dirty_end) {
+        cip->dirty_start = start;
+        cip->dirty_end   = end;
+    } else {
+        if(start < cip->dirty_start) cip->dirty_start = start;
+        if(end   > cip->dirty_end)   cip->dirty_end   = end;
+    }
+    // shared pages never change, only tables of owned pages can be stale
+    for (size_t addr = start & ~1; addr < end; addr += 2) {
+        size_t p = addr / CIP8_PAGE_SIZE;
+        if(((cip->owned >> p) & 1) && cip->code[p]) {
+            cip->code[p][addr % CIP8_PAGE_SIZE / 2] = cip8_decode_inst(cip8_read16(cip,addr));
+        }
+    }
+    // gotos just after the range may close a loop over it. a stale flag on a shared page is
+    // harmless, cip8_idle_skip checks every inst it runs
+    size_t last = end + 2 * CIP8_IDLE_MAX_LOOP < MEMORY_SIZE ? end + 2 * CIP8_IDLE_MAX_LOOP : MEMORY_SIZE;
+    for (size_t addr = start & ~1; addr < last; addr += 2) {
+        size_t p = addr / CIP8_PAGE_SIZE;
+        if(((cip->owned >> p) & 1) && cip->code[p]) {
+            cip8_idle_mark(cip,&cip->code[p][addr % CIP8_PAGE_SIZE / 2],addr);
+        }
+    }
+    // and so may the pairs starting just before it or at a goto that got marked
+    for (size_t addr = (start & ~1) >= 2 ? (start & ~1) - 2 : 0; addr < last; addr += 2) {
+        size_t p = addr / CIP8_PAGE_SIZE;
+        if(((cip->owned >> p) & 1) && cip->code[p] && addr % CIP8_PAGE_SIZE != CIP8_PAGE_SIZE - 2) {
+            Inst* inst = &cip->code[p][addr % CIP8_PAGE_SIZE / 2];
+            cip8_fuse(inst,inst[1],addr);
+        }
+    }
+}
+// the decoded inst at addr, OP_INVALID included, never a fused pair. odd addresses are not in the
+// table, they are rare enough to decode every time, and so are shared pages without one (the zero page)
+Inst cip8_inst_at(Cip8* cip, Addr addr) {
+    size_t p = addr / CIP8_PAGE_SIZE % CIP8_PAGES;
+    if(!(addr & 1) && !cip->code[p] && ((cip->owned >> p) & 1)) {
+        cip8_page_decode(cip,p);
+    }
+    return cip8_inst_peek(cip,addr);
+}
+// same without building a table, for images other threads are reading
+Inst cip8_inst_peek(const Cip8* cip, Addr addr) {
+    const Inst* code = cip->code[addr / CIP8_PAGE_SIZE % CIP8_PAGES];
+    if((addr & 1) || !code) {
+        return cip8_decode_inst(cip8_read16(cip,addr));
+    }
+    return cip8_unfuse(code[addr % CIP8_PAGE_SIZE / 2]);
+}
+Inst cip8_fetch(Cip8* cip) {
+    const Inst* code = cip->code[cip->ip / CIP8_PAGE_SIZE % CIP8_PAGES];
+    // fused pairs and OP_INVALID sort after every plain op, one compare keeps both off this path
+    if(!(cip->ip & 1) && code && code[cip->ip % CIP8_PAGE_SIZE / 2].op <= OP_LOAD) {
+        return code[cip->ip % CIP8_PAGE_SIZE / 2];
+    }
+    return cip8_inst_at(cip,cip->ip);
+}
+// cip8_fetch for the run loops, hands out a fused pair as it is when left has room for both halves
+static inline Inst cip8_fetch_fused(Cip8* cip, size_t left) {
+    const Inst* code = cip->code[cip->ip / CIP8_PAGE_SIZE % CIP8_PAGES];
+    if(left > 1 && !(cip->ip & 1) && code && code[cip->ip % CIP8_PAGE_SIZE / 2].op != OP_INVALID) {
+        return code[cip->ip % CIP8_PAGE_SIZE / 2];
+    }
+    return cip8_fetch(cip);
+}
+#if CIP8_TRACE
+_Static_assert(sizeof(Cip8TraceRecord) == 2 * sizeof(uint64_t),"a trace record is two words");
+void cip8_trace_init(Cip8Trace* trace) {
+    atomic_init(&trace->head,0);
+    for (size_t i = 0; i < CIP8_TRACE_SIZE; i++) atomic_init(&trace->slots[i].seq,0);
+}
+static inline void cip8_trace_record(Cip8Trace* trace, const Cip8* cip) {
+    uint64_t i = atomic_load_explicit(&trace->head,memory_order_relaxed);
+    OpCode code = CURR_INST(cip);
+    Cip8TraceRecord r = {
+        .seq = i, .pc = cip->ip, .opcode = code, .I = cip->regs.I, .sp = cip->sp,
+        .vx = GET_VX(code), .vy = GET_VY(code), .vf = cip->regs.V[0xF],
+    };
+    uint64_t words[2];
+    memcpy(words,&r,sizeof(words));
+    Cip8TraceSlot* slot = &trace->slots[i & (CIP8_TRACE_SIZE - 1)];
+    atomic_store_explicit(&slot->seq,2 * (uint32_t)i + 1,memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->words[0],words[0],memory_order_relaxed);
+    atomic_store_explicit(&slot->words[1],words[1],memory_order_relaxed);
+    atomic_store_explicit(&slot->seq,2 * (uint32_t)i + 2,memory_order_release);
+    atomic_store_explicit(&trace->head,i + 1,memory_order_release);
+}
+// writes the records still in the ring, oldest first: magic, record count, records
+bool cip8_trace_dump(Cip8Trace* trace, const char* file_name) {
+    FILE* f = fopen(file_name,"wb");
+    if(!f) return false;
+
+    uint64_t head = atomic_load_explicit(&trace->head,memory_order_acquire);
+    uint64_t start = head > CIP8_TRACE_SIZE ? head - CIP8_TRACE_SIZE : 0;
+    uint64_t count = head - start;
+    fwrite(CIP8_TRACE_MAGIC,1,8,f);
+    fwrite(&count,sizeof(count),1,f);
+    for (uint64_t i = start; i < head; i++) {
+        Cip8TraceSlot* slot = &trace->slots[i & (CIP8_TRACE_SIZE - 1)];
+        uint32_t before = atomic_load_explicit(&slot->seq,memory_order_acquire);
+        uint64_t words[2] = {
+            atomic_load_explicit(&slot->words[0],memory_order_relaxed),
+            atomic_load_explicit(&slot->words[1],memory_order_relaxed),
+        };
+        atomic_thread_fence(memory_order_acquire);
+        uint32_t after = atomic_load_explicit(&slot->seq,memory_order_relaxed);
+        Cip8TraceRecord r;
+        memcpy(&r,words,sizeof(r));
+        // the producer kept going while we copied, this slot holds or is getting a newer record
+        if(before != 2 * (uint32_t)i + 2 || after != before) r.pc = 0xFFFF;
+        fwrite(&r,sizeof(r),1,f);
+    }
+    fclose(f);
+    return true;
+}
+#endif
+#if CIP8_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t cip8_profile_clock(void) { return __rdtsc(); }
+#else
+#include <time.h>
+// no cycle counter, nanoseconds instead
+static inline uint64_t cip8_profile_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+static const char* const cip8_op_names[OP_INVALID + 1] = {
+    "OP_CALL",  "OP_CLD",   "OP_RET",   "OP_GOTO",  "OP_CALLS", "OP_JVEQ",  "OP_JVNEQ", "OP_JEQ",
+    "OP_MOV",   "OP_ADD",   "OP_ASS",   "OP_OR",    "OP_XOR",   "OP_AND",   "OP_ADDC",  "OP_SUBC",
+    "OP_SHR",   "OP_SUBR",  "OP_SHL",   "OP_JNEQ",  "OP_SETI",  "OP_JMV0",  "OP_RND",   "OP_DRW",
+    "OP_KEYD",  "OP_KEYU",  "OP_GETDT", "OP_GETK",  "OP_SETDT", "OP_SETST", "OP_ADDI",  "SETISPR",
+    "OP_BCD",   "OP_DUMP",  "OP_LOAD",
+    "OP_SKIP_GOTO", "OP_ADD_JEQ", "OP_ADD_JNEQ", "OP_MOV_KEYD", "OP_MOV_KEYU", "OP_SETI_ADDI", "OP_ADDI_LOAD", "OP_SPR_DRW",
+    "OP_INVALID",
+};
+
+void cip8_profile_init(Cip8Profile* prof) {
+    memset(prof,0,sizeof(*prof));
+    prof->nodes[0].fn = PROGRAM_START;
+    prof->node_count = 1;
+}
+static uint16_t cip8_profile_child(Cip8Profile* prof, uint16_t parent, Addr fn) {
+    Cip8ProfileNode* p = &prof->nodes[parent];
+    for (uint16_t c = p->child; c; c = prof->nodes[c].sibling) {
+        if(prof->nodes[c].fn == fn) return c;
+    }
+    if(prof->node_count == CIP8_PROFILE_MAX_NODES || p->depth + 1 >= CIP8_PROFILE_MAX_DEPTH) return 0;
+    uint16_t c = prof->node_count++;
+    Cip8ProfileNode* n = &prof->nodes[c];
+    n->fn = fn;
+    n->parent = parent;
+    n->depth = p->depth + 1;
+    n->sibling = p->child;
+    p->child = c;
+    return c;
+}
+static inline void cip8_profile_record(Cip8Profile* prof, Addr pc, Inst inst) {
+    uint64_t now = cip8_profile_clock();
+    if(prof->started) {
+        prof->op_cycles[prof->last_op] += now - prof->last;
+        prof->nodes[prof->last_node].cycles += now - prof->last;
+    }
+    prof->op_count[inst.op]++;
+    prof->pc_hits[pc % MEMORY_SIZE]++;
+    prof->nodes[prof->node].steps++;
+    prof->last = now;
+    prof->last_op = inst.op;
+    prof->last_node = prof->node;
+    prof->started = true;
+
+    if(inst.op == OP_CALLS) {
+        uint16_t c = prof->lost ? 0 : cip8_profile_child(prof,prof->node,GET_NNN(inst.oprand));
+        if(c) {
+            prof->node = c;
+            prof->nodes[c].calls++;
+        } else {
+            prof->lost++;
+        }
+    } else if(inst.op == OP_RET) {
+        if(prof->lost) {
+            prof->lost--;
+        } else if(prof->node) {
+            prof->node = prof->nodes[prof->node].parent;
+        }
+    }
+}
+
+static void cip8_profile_path(const Cip8Profile* prof, uint16_t node, FILE* f) {
+    if(node != 0) {
+        cip8_profile_path(prof,prof->nodes[node].parent,f);
+        fputc(';',f);
+    }
+    fprintf(f,"0x%03X",prof->nodes[node].fn);
+}
+// one line per call stack that ran anything, "0x200;0x2A4;0x31C steps", the input flamegraph.pl
+// and speedscope take. weighted by instructions so two runs of a rom give the same file
+bool cip8_profile_folded(const Cip8Profile* prof, const char* file_name) {
+    FILE* f = fopen(file_name,"w");
+    if(!f) return false;
+    for (size_t n = 0; n < prof->node_count; n++) {
+        if(!prof->nodes[n].steps) continue;
+        cip8_profile_path(prof,n,f);
+        fprintf(f," %llu\n",(unsigned long long)prof->nodes[n].steps);
+    }
+    fclose(f);
+    return true;
+}
+
+static void cip8_profile_tree(const Cip8Profile* prof, uint16_t node, uint64_t total) {
+    const Cip8ProfileNode* n = &prof->nodes[node];
+    printf("%*s0x%03X  calls %llu  self %llu (%.1f%%)  cycles %llu\n",2 * n->depth + 2,"",n->fn,
+           (unsigned long long)n->calls,(unsigned long long)n->steps,total ? 100.0 * n->steps / total : 0.0,
+           (unsigned long long)n->cycles);
+    for (uint16_t c = n->child; c; c = prof->nodes[c].sibling) {
+        cip8_profile_tree(prof,c,total);
+    }
+}
+// ops by count, the top hottest addresses disassembled from cip's memory, and the call tree
+void cip8_profile_report(const Cip8Profile* prof, const Cip8* cip, size_t top) {
+    uint64_t total = 0, cycles = 0;
+    for (size_t op = 0; op <= OP_INVALID; op++) {
+        total += prof->op_count[op];
+        cycles += prof->op_cycles[op];
+    }
+    printf("%llu instructions, %llu cycles\n\n",(unsigned long long)total,(unsigned long long)cycles);
+
+    printf("op            count      %%     cycles   cycles/op\n");
+    bool shown[OP_INVALID + 1] = {0};
+    for (size_t i = 0; i <= OP_INVALID; i++) {
+        size_t best = OP_INVALID + 1;
+        for (size_t op = 0; op <= OP_INVALID; op++) {
+            if(!shown[op] && prof->op_count[op] && (best > OP_INVALID || prof->op_count[op] > prof->op_count[best])) best = op;
+        }
+        if(best > OP_INVALID) break;
+        shown[best] = true;
+        printf("%-12s %10llu %5.1f%% %10llu %10.1f\n",cip8_op_names[best],(unsigned long long)prof->op_count[best],
+               100.0 * prof->op_count[best] / total,(unsigned long long)prof->op_cycles[best],
+               (double)prof->op_cycles[best] / prof->op_count[best]);
+    }
+
+    printf("\nhot addresses\n");
+    static bool taken[MEMORY_SIZE];
+    memset(taken,0,sizeof(taken));
+    Cip8 at = *cip;
+    for (size_t i = 0; i < top; i++) {
+        size_t best = MEMORY_SIZE;
+        for (size_t a = 0; a < MEMORY_SIZE; a++) {
+            if(!taken[a] && prof->pc_hits[a] && (best == MEMORY_SIZE || prof->pc_hits[a] > prof->pc_hits[best])) best = a;
+        }
+        if(best == MEMORY_SIZE) break;
+        taken[best] = true;
+        printf("%10llu %5.1f%%  ",(unsigned long long)prof->pc_hits[best],100.0 * prof->pc_hits[best] / total);
+        at.ip = best;
+        cip8_print_inst(at,cip8_decode_inst(cip8_read16(&at,best)));
+    }
+
+    printf("\ncall tree\n");
+    cip8_profile_tree(prof,0,total);
+}
+#endif
 void cip8_print_inst(Cip8 cip,Inst inst) {
     printf("0x%X     ",cip.ip);
-    printf("0x%02X%02X     ",cip.memory[cip.ip] ,cip.memory[cip.ip+1]);
+    printf("0x%04X     ",cip8_read16(&cip,cip.ip));
     switch (inst.op)
     {
         case OP_CLD:   printf("OP_CLD\n");  break;
@@ -324,301 +1056,903 @@ void cip8_print_inst(Cip8 cip,Inst inst) {
         case SETISPR: printf("SETISPR V%X\n",GET_X(inst.oprand)); break;  
 
         case OP_DRW:   printf("OP_DRW   V%X V%X 0x%X\n",GET_X(inst.oprand),GET_Y(inst.oprand),GET_N(inst.oprand));  break;
-        default: assert(0 && "Unreachable unknown inst"); break;
+
+        case OP_SKIP_GOTO: case OP_ADD_JEQ: case OP_ADD_JNEQ: case OP_MOV_KEYD: case OP_MOV_KEYU:
+        case OP_SETI_ADDI: case OP_ADDI_LOAD: case OP_SPR_DRW:
+            printf("fused    0x%04X\n",cip8_read16(&cip,cip.ip + 2));  break;
+        default:       printf("???\n"); break;
     }
 }
-void cip8_execute(Cip8* cip,Inst inst) {
-    switch (inst.op)
-    {
-        case OP_CLD:  cip8_clear_display(cip); break;  
-        case OP_GOTO: cip->ip = GET_NNN(inst.oprand); break; 
-        case OP_MOV: GET_VX(inst.oprand) = GET_NN(inst.oprand);  break;
-        case OP_ADD: GET_VX(inst.oprand) += GET_NN(inst.oprand); break;        
-
-        case OP_RET: 
-            cip->sp += 2;
-            cip->ip = (cip->call_stack[cip->sp - 1] << 4) | (cip->call_stack[cip->sp]);
-        break;  
-        case OP_CALLS: 
-            assert((cip->sp > 0xEA0) && "overflowing the stack");
-            cip->call_stack[cip->sp - 1]     = (cip->ip & 0xFF0) >> 4;
-            cip->call_stack[cip->sp]         = (cip->ip & 0xF);
-            cip->sp -= 2;
-            cip->ip = GET_NNN(inst.oprand);
-        break;     
-        case OP_JEQ: {
-            int vx =  GET_VX(inst.oprand);
-            int nn =  GET_NN(inst.oprand);
-            if(vx == nn) {
-                cip->ip += 2; 
-            }
-        }
-        break;
-        case OP_JNEQ: {
-            int vx =  GET_VX(inst.oprand);
-            int nn =  GET_NN(inst.oprand);
-            if(vx != nn) {
-                cip->ip += 2; 
-            }
-        }
-        break;
-        case OP_JVEQ: {
-            int vx =  GET_VX(inst.oprand);
-            int vy =  GET_VY(inst.oprand);
-            if(vx == vy) {
-                cip->ip += 2; 
-            }
-        }
-        break;
-        case OP_JVNEQ: {
-            int vx =  GET_VX(inst.oprand);
-            int vy =  GET_VY(inst.oprand);
-            if(vx != vy) {
-                cip->ip += 2; 
-            }
-        }        
-
-
-
-        case OP_ASS:  GET_VX(inst.oprand) = GET_VY(inst.oprand); break;
-        case OP_OR:   GET_VX(inst.oprand) |= GET_VY(inst.oprand);  break;
-        case OP_AND: GET_VX(inst.oprand) &= GET_VY(inst.oprand);  break;
-        case OP_XOR: GET_VX(inst.oprand) ^= GET_VY(inst.oprand);  break;
-
+static inline uint8_t cip8_reverse_byte(uint8_t b) {
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+// xors one sprite byte into a display row with its left most pixel at x, wrapping around the edge
+// or cut off at it when clip. sprites have their left pixel in the high bit and rows in bit 0, so the
+// byte is mirrored first. returns true when a lit pixel got turned off
+static inline bool cip8_draw_row(uint64_t* row, uint8_t sprite, unsigned x, bool clip) {
+    uint64_t bits = cip8_reverse_byte(sprite);
+    x &= CIP8_DISPLAY_WIDTH - 1;
+    bits = clip ? bits << x : (bits << x) | (bits >> ((CIP8_DISPLAY_WIDTH - x) & (CIP8_DISPLAY_WIDTH - 1)));
+    bool hit = (*row & bits) != 0;
+    *row ^= bits;
+    return hit;
+}
 
-        case OP_ADDC: {
-            uint16_t r = GET_VX(inst.oprand) + GET_VY(inst.oprand);   
-            GET_VX(inst.oprand) += GET_VY(inst.oprand); 
-            SET_FLAG(cip,GET_VX(inst.oprand) != r);
-        }
-        break;
-        case OP_SUBC: {
-            uint16_t r = GET_VX(inst.oprand) - GET_VY(inst.oprand);   
-            GET_VX(inst.oprand) -= GET_VY(inst.oprand); 
-            SET_FLAG(cip,GET_VX(inst.oprand) == r);
-        }
-        break;
-        case OP_SUBR: {
-            uint16_t r = GET_VY(inst.oprand) - GET_VX(inst.oprand);   
-            GET_VX(inst.oprand) = GET_VY(inst.oprand) - GET_VX(inst.oprand); 
-            SET_FLAG(cip,GET_VX(inst.oprand) == r);
-        }
-        break;        
-        case OP_SHR:   {
-            bool a = GET_VX(inst.oprand) & 0x1; 
-            GET_VX(inst.oprand) >>= 1; 
-            cip->regs.V[0xF] = a;
-        }
-        break;
-        case OP_SHL:  {
-            bool a = GET_VX(inst.oprand) & 0x80; 
-            GET_VX(inst.oprand) <<= 1; 
-            SET_FLAG(cip,a);
+// halts on the inst that is running, ip is already past it
+static inline void cip8_trap(Cip8* cip, Cip8Trap trap) {
+    cip->trap = trap;
+    cip->halted = true;
+    cip->ip -= 2;
+}
+const char* cip8_trap_name(Cip8Trap trap) {
+    switch (trap) {
+        case CIP8_TRAP_NONE:            return "none";
+        case CIP8_TRAP_BAD_OPCODE:      return "bad op-code";
+        case CIP8_TRAP_STACK_OVERFLOW:  return "stack overflow";
+        case CIP8_TRAP_STACK_UNDERFLOW: return "stack underflow";
+        case CIP8_TRAP_BAD_ADDRESS:     return "I out of range";
+    }
+    return "unknown trap";
+}
+unsigned cip8_quirk_flags(Cip8Quirks quirks) {
+    switch (quirks) {
+#define CIP8_QUIRKS_CASE(id,name,flags) case CIP8_QUIRKS_##id: return flags;
+        CIP8_QUIRK_PROFILES(CIP8_QUIRKS_CASE)
+#undef CIP8_QUIRKS_CASE
+        default: return 0;
+    }
+}
+const char* cip8_quirks_name(Cip8Quirks quirks) {
+    switch (quirks) {
+#define CIP8_QUIRKS_CASE(id,name,flags) case CIP8_QUIRKS_##id: return name;
+        CIP8_QUIRK_PROFILES(CIP8_QUIRKS_CASE)
+#undef CIP8_QUIRKS_CASE
+        default: return "unknown";
+    }
+}
+// false when name is not a profile, quirks is left alone then
+bool cip8_quirks_from_name(const char* name, Cip8Quirks* quirks) {
+    for (int q = 0; q < CIP8_QUIRKS_COUNT; q++) {
+        if(strcmp(name,cip8_quirks_name(q)) == 0) {
+            *quirks = q;
+            return true;
         }
-        break;    
-
-        case OP_SETI:   cip->regs.I = inst.oprand;    break;
-        case OP_JMV0:   cip->ip     = cip->regs.V[0] + inst.oprand;    break;
-        case OP_RND:    GET_VX(inst.oprand) = rand() % (inst.oprand & 0x0FF);    break;
-
-        case OP_KEYD:
-            if(GET_KEY(GET_VX(inst.oprand))) {
-                cip->ip += 2;
-            }       
-        break;
-        case OP_KEYU:  
-            if(!GET_KEY(GET_VX(inst.oprand))) {
-                cip->ip += 2;;
-            }       
-        break;
-        case OP_GETK:
-            cip->ip -= 2;
-            for (size_t i = 0; i < 16; i++) {
-                if(GET_KEY(i)) {
-                    GET_VX(inst.oprand) = i;
-                    cip->waiting_release = true;
-                    break;
-                }
-            }
-            if(!GET_KEY(GET_VX(inst.oprand)) && cip->waiting_release) {
-                cip->ip += 2;
-                cip->waiting_release = true;
-            }
-        break;
-
-
-        case OP_GETDT: GET_VX(inst.oprand) = (int) cip->delay_timer; break;
-        case OP_SETDT: cip->delay_timer =  GET_VX(inst.oprand); break;
-        case OP_SETST: cip->sound_timer =  GET_VX(inst.oprand); break;
-        case OP_ADDI:  cip->regs.I +=  GET_VX(inst.oprand);     break;
+    }
+    return false;
+}
 
-        case OP_BCD: {
-            int vx =  GET_VX(inst.oprand);
-            cip->memory[cip->regs.I + 0] = (int) vx / 100;
-            cip->memory[cip->regs.I + 1] = (int) (vx % 100) / 10 ;
-            cip->memory[cip->regs.I + 2] = (int) vx % 10;
-        }      
-        break;
-        case OP_DUMP: 
-        {
-            uint8_t end = inst.oprand >> 8;
-            for (size_t i = 0; i <= end; i++) {
-                cip->memory[cip->regs.I + i] = cip->regs.V[i];
-            }
-        }      
-        break;
-        case OP_LOAD:
-        {
-            uint8_t end = inst.oprand >> 8;
-            for (size_t i = 0; i <= end; i++) {
-                cip->regs.V[i] = cip->memory[cip->regs.I + i];
-            }
+// one handler per op, cip8_execute and cip8_run_threaded both dispatch to these
+// so there is only one copy of what an instruction does. the ops the variants disagree on
+// take the CIP8_QUIRK_* flags too, every caller passes a constant so the checks fold away
+static inline void cip8_op_cld(Cip8* cip,Inst inst)  { cip8_clear_display(cip); }
+static inline void cip8_op_goto(Cip8* cip,Inst inst) { cip->ip = GET_NNN(inst.oprand); }
+static inline void cip8_op_mov(Cip8* cip,Inst inst)  { GET_VX(inst.oprand) = GET_NN(inst.oprand); }
+static inline void cip8_op_add(Cip8* cip,Inst inst)  { GET_VX(inst.oprand) += GET_NN(inst.oprand); }
+static inline void cip8_op_ret(Cip8* cip,Inst inst) {
+    if(cip->sp >= CIP8_STACK_TOP) {
+        cip8_trap(cip,CIP8_TRAP_STACK_UNDERFLOW);
+        return;
+    }
+    cip->sp += 2;
+    cip->ip = (cip8_read(cip,cip->sp - 1) << 4) | cip8_read(cip,cip->sp);
+}
+static inline void cip8_op_calls(Cip8* cip,Inst inst) {
+    if(cip->sp <= CIP8_STACK_LIMIT) {
+        cip8_trap(cip,CIP8_TRAP_STACK_OVERFLOW);
+        return;
+    }
+    // sp is an absolute address, indexing call_stack with it ran past the end of memory
+    cip8_write(cip,cip->sp - 1,(cip->ip & 0xFF0) >> 4);
+    cip8_write(cip,cip->sp    ,(cip->ip & 0xF));
+    cip->sp -= 2;
+    cip->ip = GET_NNN(inst.oprand);
+}
+static inline void cip8_op_jeq(Cip8* cip,Inst inst) {
+    int vx =  GET_VX(inst.oprand);
+    int nn =  GET_NN(inst.oprand);
+    if(vx == nn) {
+        cip->ip += 2; 
+    }
+}
+static inline void cip8_op_jneq(Cip8* cip,Inst inst) {
+    int vx =  GET_VX(inst.oprand);
+    int nn =  GET_NN(inst.oprand);
+    if(vx != nn) {
+        cip->ip += 2; 
+    }
+}
+static inline void cip8_op_jveq(Cip8* cip,Inst inst) {
+    int vx =  GET_VX(inst.oprand);
+    int vy =  GET_VY(inst.oprand);
+    if(vx == vy) {
+        cip->ip += 2; 
+    }
+}
+static inline void cip8_op_jvneq(Cip8* cip,Inst inst) {
+    int vx =  GET_VX(inst.oprand);
+    int vy =  GET_VY(inst.oprand);
+    if(vx != vy) {
+        cip->ip += 2; 
+    }
+}
+static inline void cip8_op_ass(Cip8* cip,Inst inst) { GET_VX(inst.oprand) = GET_VY(inst.oprand); }
+static inline void cip8_op_or(Cip8* cip,Inst inst)  { GET_VX(inst.oprand) |= GET_VY(inst.oprand); }
+static inline void cip8_op_and(Cip8* cip,Inst inst) { GET_VX(inst.oprand) &= GET_VY(inst.oprand); }
+static inline void cip8_op_xor(Cip8* cip,Inst inst) { GET_VX(inst.oprand) ^= GET_VY(inst.oprand); }
+static inline void cip8_op_addc(Cip8* cip,Inst inst) {
+    uint16_t r = GET_VX(inst.oprand) + GET_VY(inst.oprand);   
+    GET_VX(inst.oprand) += GET_VY(inst.oprand); 
+    SET_FLAG(cip,GET_VX(inst.oprand) != r);
+}
+static inline void cip8_op_subc(Cip8* cip,Inst inst) {
+    uint16_t r = GET_VX(inst.oprand) - GET_VY(inst.oprand);   
+    GET_VX(inst.oprand) -= GET_VY(inst.oprand); 
+    SET_FLAG(cip,GET_VX(inst.oprand) == r);
+}
+static inline void cip8_op_subr(Cip8* cip,Inst inst) {
+    uint16_t r = GET_VY(inst.oprand) - GET_VX(inst.oprand);   
+    GET_VX(inst.oprand) = GET_VY(inst.oprand) - GET_VX(inst.oprand); 
+    SET_FLAG(cip,GET_VX(inst.oprand) == r);
+}
+static inline void cip8_op_shr(Cip8* cip,Inst inst,unsigned quirks) {
+    uint8_t v = quirks & CIP8_QUIRK_SHIFT_VY ? GET_VY(inst.oprand) : GET_VX(inst.oprand);
+    GET_VX(inst.oprand) = v >> 1; 
+    cip->regs.V[0xF] = v & 0x1;
+}
+static inline void cip8_op_shl(Cip8* cip,Inst inst,unsigned quirks) {
+    uint8_t v = quirks & CIP8_QUIRK_SHIFT_VY ? GET_VY(inst.oprand) : GET_VX(inst.oprand);
+    GET_VX(inst.oprand) = v << 1; 
+    SET_FLAG(cip,v >> 7);
+}
+static inline void cip8_op_seti(Cip8* cip,Inst inst) { cip->regs.I = inst.oprand; }
+static inline void cip8_op_jmv0(Cip8* cip,Inst inst,unsigned quirks) {
+    cip->ip = (quirks & CIP8_QUIRK_JUMP_VX ? GET_VX(inst.oprand) : cip->regs.V[0]) + inst.oprand;
+}
+// top byte of xorshift64*, the low bits of the plain xorshift are the weak ones
+static inline uint8_t cip8_random(Cip8* cip) {
+    uint64_t x = cip->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    cip->rng = x;
+    return (x * 0x2545F4914F6CDD1Dull) >> 56;
+}
+static inline void cip8_op_rnd(Cip8* cip,Inst inst)  { GET_VX(inst.oprand) = cip8_random(cip) & (inst.oprand & 0x0FF); }
+static inline void cip8_op_keyd(Cip8* cip,Inst inst) {
+    if(GET_KEY(GET_VX(inst.oprand))) {
+        cip->ip += 2;
+    }       
+}
+static inline void cip8_op_keyu(Cip8* cip,Inst inst) {
+    if(!GET_KEY(GET_VX(inst.oprand))) {
+        cip->ip += 2;
+    }       
+}
+static inline void cip8_op_getk(Cip8* cip,Inst inst) {
+    cip->ip -= 2;
+    for (size_t i = 0; i < 16; i++) {
+        if(GET_KEY(i)) {
+            GET_VX(inst.oprand) = i;
+            cip->waiting_release = true;
+            break;
         }
-        break;
-
+    }
+    if(!GET_KEY(GET_VX(inst.oprand)) && cip->waiting_release) {
+        cip->ip += 2;
+        cip->waiting_release = true;
+    }
+}
+static inline void cip8_op_getdt(Cip8* cip,Inst inst) { GET_VX(inst.oprand) = (int) cip->delay_timer; }
+static inline void cip8_op_setdt(Cip8* cip,Inst inst) { cip->delay_timer =  GET_VX(inst.oprand); }
+static inline void cip8_op_setst(Cip8* cip,Inst inst) { cip->sound_timer =  GET_VX(inst.oprand); }
+static inline void cip8_op_addi(Cip8* cip,Inst inst)  { cip->regs.I +=  GET_VX(inst.oprand); }
+// true when the op would touch I .. I + len - 1 past the end of memory, and trapped on it
+static inline bool cip8_trap_range(Cip8* cip, size_t len) {
+    if(cip->regs.I + len <= MEMORY_SIZE) return false;
+    cip8_trap(cip,CIP8_TRAP_BAD_ADDRESS);
+    return true;
+}
+static inline void cip8_op_bcd(Cip8* cip,Inst inst) {
+    if(cip8_trap_range(cip,3)) return;
+    int vx =  GET_VX(inst.oprand);
+    cip8_write(cip,cip->regs.I + 0,(int) vx / 100);
+    cip8_write(cip,cip->regs.I + 1,(int) (vx % 100) / 10);
+    cip8_write(cip,cip->regs.I + 2,(int) vx % 10);
+    cip8_predecode(cip,cip->regs.I,3);
+}
+// where FX55/FX65 leave I
+static inline void cip8_load_i(Cip8* cip, uint8_t end, unsigned quirks) {
+    if(quirks & CIP8_QUIRK_LOAD_I)   cip->regs.I += end + 1;
+    if(quirks & CIP8_QUIRK_LOAD_I_X) cip->regs.I += end;
+}
+static inline void cip8_op_dump(Cip8* cip,Inst inst,unsigned quirks) {
+    uint8_t end = inst.oprand >> 8;
+    if(cip8_trap_range(cip,end + 1)) return;
+    for (size_t i = 0; i <= end; i++) {
+        cip8_write(cip,cip->regs.I + i,cip->regs.V[i]);
+    }
+    cip8_predecode(cip,cip->regs.I,end + 1);
+    cip8_load_i(cip,end,quirks);
+}
+static inline void cip8_op_load(Cip8* cip,Inst inst,unsigned quirks) {
+    uint8_t end = inst.oprand >> 8;
+    if(cip8_trap_range(cip,end + 1)) return;
+    for (size_t i = 0; i <= end; i++) {
+        cip->regs.V[i] = cip8_read(cip,cip->regs.I + i);
+    }
+    cip8_load_i(cip,end,quirks);
+}
+// the sprite starts at VX, VY taken modulo the display either way
+static inline void cip8_op_drw(Cip8* cip,Inst inst,unsigned quirks) {
+    bool clip = quirks & CIP8_QUIRK_CLIP;
+    int h = inst.oprand & 0x00F;
+    if(cip8_trap_range(cip,h)) return;
+    cip->display_changed = true;   
+    int x = cip->regs.V[inst.oprand >> 8] % CIP8_DISPLAY_WIDTH;
+    int y = GET_VY(inst.oprand) % CIP8_DISPLAY_HEIGHT;
+
+    bool hit = false;
+    for (size_t hi = 0; hi < h; hi++) {
+        int y_pos = y + hi;
+        if(y_pos >= CIP8_DISPLAY_HEIGHT) {
+            if(clip) break;
+            y_pos -= CIP8_DISPLAY_HEIGHT;
+        }
+        cip->dirty_rows |= 1u << y_pos;
+        hit |= cip8_draw_row(&cip->display[y_pos],cip8_read(cip,cip->regs.I + hi),x,clip);
+    }
+    SET_FLAG(cip,hit);
+}
+// only the low digit of VX counts, like on the VIP
+static inline void cip8_op_setispr(Cip8* cip,Inst inst) { cip8_write_char(cip,GET_VX(inst.oprand) & 0xF); }
+static inline void cip8_op_invalid(Cip8* cip,Inst inst) { cip8_trap(cip,CIP8_TRAP_BAD_OPCODE); }
+
+// fused pairs run both halves from the one dispatch, ip is already past the first and they return
+// how many insts ran. a skip that skips its goto is one
+static inline size_t cip8_op_skip_goto(Cip8* cip,Inst inst) {
+    Addr next = cip->ip;
+    switch (inst.first) {
+        case OP_JEQ:   cip8_op_jeq(cip,inst);   break;
+        case OP_JNEQ:  cip8_op_jneq(cip,inst);  break;
+        case OP_JVEQ:  cip8_op_jveq(cip,inst);  break;
+        case OP_JVNEQ: cip8_op_jvneq(cip,inst); break;
+        case OP_KEYD:  cip8_op_keyd(cip,inst);  break;
+        case OP_KEYU:  cip8_op_keyu(cip,inst);  break;
+        default:       cip8_op_invalid(cip,inst); return 1;
+    }
+    if(cip->ip != next) return 1;
+    cip->ip = GET_NNN(inst.oprand2);
+    return 2;
+}
+#define CIP8_FUSED_OP(name,a,b)                                 \
+    static inline size_t cip8_op_##name(Cip8* cip,Inst inst) {  \
+        cip8_op_##a(cip,inst);                                  \
+        cip->ip += 2;                                           \
+        cip8_op_##b(cip,cip8_fused_second(inst));               \
+        return 2;                                               \
+    }
+CIP8_FUSED_OP(add_jeq,add,jeq)
+CIP8_FUSED_OP(add_jneq,add,jneq)
+CIP8_FUSED_OP(mov_keyd,mov,keyd)
+CIP8_FUSED_OP(mov_keyu,mov,keyu)
+CIP8_FUSED_OP(seti_addi,seti,addi)
+#undef CIP8_FUSED_OP
+// the same with a second half that has quirks
+#define CIP8_FUSED_QUIRK_OP(name,a,b)                                           \
+    static inline size_t cip8_op_##name(Cip8* cip,Inst inst,unsigned quirks) {  \
+        cip8_op_##a(cip,inst);                                                  \
+        cip->ip += 2;                                                           \
+        cip8_op_##b(cip,cip8_fused_second(inst),quirks);                        \
+        return 2;                                                               \
+    }
+CIP8_FUSED_QUIRK_OP(addi_load,addi,load)
+CIP8_FUSED_QUIRK_OP(spr_drw,setispr,drw)
+#undef CIP8_FUSED_QUIRK_OP
 
-        case OP_DRW:     
-            cip->display_changed = true;   
-            int x = cip->regs.V[inst.oprand >> 8] % 64;
-            int y = GET_VY(inst.oprand);
-            int h = inst.oprand & 0x00F;
-
-
-            for (size_t hi = 0; hi < h; hi++) {
-                int y_pos = (y + hi) % 32;
-                uint8_t a = cip->memory[cip->regs.I + hi];
-                uint8_t byte = 
-                                (( a >> 7)      << 0)  | 
-                                (((a >> 6) & 1) << 1)  |
-                                (((a >> 5) & 1) << 2)  |
-                                (((a >> 4) & 1) << 3)  |
-                                (((a >> 3) & 1) << 4)  |
-                                (((a >> 2) & 1) << 5)  |
-                                (((a >> 1) & 1) << 6)  |
-                                (((a >> 0) & 1) << 7);
-
-                if(x % 8 == 0) {
-                    cip->display_refresh[y_pos * 8 + (int)(x / 8)    ] ^= byte;
-                    // if(cip->display_refresh[y_pos * 8 + (int)(x / 8)    ] != byte) {
-                        // cip->regs.V[0xF] = 1;
-                    // }
-                } else {
-                    cip->display_refresh[y_pos * 8 + (int)(x / 8)    ] ^= (byte << (x % 8));
-                    cip->display_refresh[y_pos * 8 + (int)(x / 8) + 1] ^= (byte >> (8 - x % 8));
-                    
-                    // TODO: is this even right?
-                    // if (((cip->display_refresh[y_pos * 8 + (int)(x / 8)] << (x % 8)) | 
-                    // ((cip->display_refresh[y_pos * 8 + (int)(x / 8) + 1]) >> (8 - x % 8))) != byte) {
-                    //     cip->regs.V[0xF] = 1;
-                    // }
-
-                }
-            }
-        break;
+static CIP8_ALWAYS_INLINE size_t cip8_execute_fused_quirks(Cip8* cip,Inst inst,unsigned quirks) {
+    switch (inst.op)
+    {
+        case OP_SKIP_GOTO: return cip8_op_skip_goto(cip,inst);
+        case OP_ADD_JEQ:   return cip8_op_add_jeq(cip,inst);
+        case OP_ADD_JNEQ:  return cip8_op_add_jneq(cip,inst);
+        case OP_MOV_KEYD:  return cip8_op_mov_keyd(cip,inst);
+        case OP_MOV_KEYU:  return cip8_op_mov_keyu(cip,inst);
+        case OP_SETI_ADDI: return cip8_op_seti_addi(cip,inst);
+        case OP_ADDI_LOAD: return cip8_op_addi_load(cip,inst,quirks);
+        case OP_SPR_DRW:   return cip8_op_spr_drw(cip,inst,quirks);
+        default:           cip8_op_invalid(cip,inst); return 1;
+    }
+}
+// out of line so the plain ops in cip8_execute do not pay for the fused bodies in registers,
+// one copy per profile
+#define CIP8_EXECUTE_FUSED(id,name,flags)                                       \
+    static CIP8_NOINLINE size_t cip8_execute_fused_##id(Cip8* cip,Inst inst) {  \
+        return cip8_execute_fused_quirks(cip,inst,flags);                       \
+    }
+CIP8_QUIRK_PROFILES(CIP8_EXECUTE_FUSED)
+#undef CIP8_EXECUTE_FUSED
+// cip8_execute with the quirks fixed. every profile has its own flags, so with them constant
+// this is one direct call
+static CIP8_ALWAYS_INLINE size_t cip8_execute_fused(Cip8* cip,Inst inst,unsigned quirks) {
+#define CIP8_EXECUTE_FUSED(id,name,flags) if(quirks == (flags)) return cip8_execute_fused_##id(cip,inst);
+    CIP8_QUIRK_PROFILES(CIP8_EXECUTE_FUSED)
+#undef CIP8_EXECUTE_FUSED
+    return cip8_execute_fused_quirks(cip,inst,quirks);
+}
+static CIP8_ALWAYS_INLINE size_t cip8_execute_quirks(Cip8* cip,Inst inst,unsigned quirks) {
+    switch (inst.op)
+    {
+        case OP_CLD:    cip8_op_cld(cip,inst);     break;  
+        case OP_GOTO:   cip8_op_goto(cip,inst);    break; 
+        case OP_MOV:    cip8_op_mov(cip,inst);     break;
+        case OP_ADD:    cip8_op_add(cip,inst);     break;        
+        case OP_RET:    cip8_op_ret(cip,inst);     break;  
+        case OP_CALLS:  cip8_op_calls(cip,inst);   break;     
+        case OP_JEQ:    cip8_op_jeq(cip,inst);     break;
+        case OP_JNEQ:   cip8_op_jneq(cip,inst);    break;
+        case OP_JVEQ:   cip8_op_jveq(cip,inst);    break;
+        case OP_JVNEQ:  cip8_op_jvneq(cip,inst);   break;
+        case OP_ASS:    cip8_op_ass(cip,inst);     break;
+        case OP_OR:     cip8_op_or(cip,inst);      break;
+        case OP_AND:    cip8_op_and(cip,inst);     break;
+        case OP_XOR:    cip8_op_xor(cip,inst);     break;
+        case OP_ADDC:   cip8_op_addc(cip,inst);    break;
+        case OP_SUBC:   cip8_op_subc(cip,inst);    break;
+        case OP_SUBR:   cip8_op_subr(cip,inst);    break;        
+        case OP_SHR:    cip8_op_shr(cip,inst,quirks);     break;
+        case OP_SHL:    cip8_op_shl(cip,inst,quirks);     break;    
+        case OP_SETI:   cip8_op_seti(cip,inst);    break;
+        case OP_JMV0:   cip8_op_jmv0(cip,inst,quirks);    break;
+        case OP_RND:    cip8_op_rnd(cip,inst);     break;
+        case OP_KEYD:   cip8_op_keyd(cip,inst);    break;
+        case OP_KEYU:   cip8_op_keyu(cip,inst);    break;
+        case OP_GETK:   cip8_op_getk(cip,inst);    break;
+        case OP_GETDT:  cip8_op_getdt(cip,inst);   break;
+        case OP_SETDT:  cip8_op_setdt(cip,inst);   break;
+        case OP_SETST:  cip8_op_setst(cip,inst);   break;
+        case OP_ADDI:   cip8_op_addi(cip,inst);    break;
+        case OP_BCD:    cip8_op_bcd(cip,inst);     break;
+        case OP_DUMP:   cip8_op_dump(cip,inst,quirks);    break;
+        case OP_LOAD:   cip8_op_load(cip,inst,quirks);    break;
+        case OP_DRW:    cip8_op_drw(cip,inst,quirks);     break;
+        case SETISPR:   cip8_op_setispr(cip,inst); break;  
 
-        case SETISPR: {
-            uint8_t vx = GET_VX(inst.oprand);
-            assert(0 <= vx && vx <= 0xF && "Error: setting I to wrong character sprite");
-            cip8_write_char(cip,vx);
-        }                         
-        break;  
-        
         default:
-            printf("ints: %X%X\n",inst.op,inst.oprand);
-            assert(0 && "Unreachable unknown inst");
-        break;
+            if(cip8_fused(inst.op)) return cip8_execute_fused(cip,inst,quirks);
+            cip8_op_invalid(cip,inst);
+            break;
     }
-
+    return 1;
+}
+// returns how many insts ran, more than one only for fused pairs
+size_t cip8_execute(Cip8* cip,Inst inst) {
+    switch (cip->quirks) {
+#define CIP8_QUIRKS_CASE(id,name,flags) case CIP8_QUIRKS_##id: return cip8_execute_quirks(cip,inst,flags);
+        CIP8_QUIRK_PROFILES(CIP8_QUIRKS_CASE)
+#undef CIP8_QUIRKS_CASE
+    }
+    return cip8_execute_quirks(cip,inst,0);
 }
-void cip8_step(Cip8* cip) {
-    Inst inst = cip8_compile_inst(CURR_INST(cip));
-    if(ENABLE_PRINT_DEBUG){ 
+static CIP8_ALWAYS_INLINE size_t cip8_step_inst_quirks(Cip8* cip, Inst inst, unsigned quirks) {
+    if(ENABLE_PRINT_DEBUG){
         cip8_print_inst(*cip,inst);
     }
+    CIP8_TRACE_STEP(cip);
+    CIP8_PROFILE_STEP(cip,inst);
+    cip->ip += 2;
+    return cip8_execute_quirks(cip,inst,quirks);
+}
+static inline size_t cip8_step_inst(Cip8* cip, Inst inst) {
+    if(ENABLE_PRINT_DEBUG){
+        cip8_print_inst(*cip,inst);
+    }
+    CIP8_TRACE_STEP(cip);
+    CIP8_PROFILE_STEP(cip,inst);
+    cip->ip += 2;
+    return cip8_execute(cip,inst);
+}
+// CIP8_TRAP_NONE unless the inst trapped
+Cip8Trap cip8_step(Cip8* cip) {
+    cip8_step_inst(cip,cip8_fetch(cip));
+    return cip->trap;
+}
+// the reference interpreter: decodes the op-code at ip out of memory every step and runs it through
+// the plain switch, no decoded table, fused pairs or idle loops. the other engines are checked against it
+Cip8Trap cip8_step_reference(Cip8* cip) {
+    Inst inst = cip8_decode_inst(cip8_read16(cip,cip->ip));
     cip->ip += 2;
     cip8_execute(cip,inst);
+    return cip->trap;
 }
-void  cip8_run(Cip8* cip) {
-    for (size_t i = 0; i < MAX_EXCUTED_INST; i++) {
-        cip8_step(cip);        
+
+// a tracer or profiler wants to see every step on its own
+static inline bool cip8_observed(const Cip8* cip) {
+#if ENABLE_PRINT_DEBUG
+    return true;
+#endif
+#if CIP8_TRACE
+    if(cip->trace) return true;
+#endif
+#if CIP8_PROFILE
+    if(cip->profile) return true;
+#endif
+    return false;
+}
+static inline bool cip8_idle_enabled(const Cip8* cip) {
+    return CIP8_IDLE_SKIP && !cip8_observed(cip);
+}
+static inline bool cip8_fuse_enabled(const Cip8* cip) {
+    return CIP8_FUSE && !cip8_observed(cip);
+}
+// runtime half of the idle loops. called after an idle inst at tail ran and put ip back on the
+// loop head: runs one pass for real, and if it came back to the head with the registers as they
+// were, counts as many more passes as fit in budget. returns the instructions it ran and counted,
+// never more than budget, and stops short at anything that is not a pure op
+static size_t cip8_idle_skip(Cip8* cip, Addr tail, size_t budget) {
+    Addr head = cip->ip;
+    if(budget == 0 || head > tail || tail - head > 2 * CIP8_IDLE_MAX_LOOP) return 0;
+    uint8_t V[16];
+    memcpy(V,cip->regs.V,sizeof(V));
+    Addr I = cip->regs.I;
+    bool waiting_release = cip->waiting_release;
+
+    size_t steps = 0;
+    while(steps < budget) {
+        Inst inst = cip8_fetch(cip);
+        if(!cip8_idle_pure(inst.op)) return steps;
+        cip8_step_inst(cip,inst);
+        steps++;
+        if(cip->ip == head) break;
+        if(cip->ip < head || cip->ip > tail) return steps;
+    }
+    if(cip->ip != head || I != cip->regs.I || waiting_release != cip->waiting_release ||
+       memcmp(V,cip->regs.V,sizeof(V)) != 0) {
+        return steps;
     }
+    return steps + (budget - steps) / steps * steps;
 }
-void cip8_clear_display(Cip8* cip) {
-    for(size_t y = 0; y < 32; y++) {
-        for(size_t x = 0; x < 8; x++) {
-            cip->display_refresh[x + y * 8] = 0x00;
+
+// threaded dispatch: every handler ends with its own fetch and jump to the next handler,
+// so the branch predictor sees one indirect jump per op instead of the single one in the switch.
+// needs gcc/clang labels as values, other compilers get a table of function pointers
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CIP8_NO_COMPUTED_GOTO)
+// the ops with quirks have a handler per way of doing them, named after the quirk, and each
+// profile a table that picks its ways
+size_t cip8_run_threaded(Cip8* cip, size_t count) {
+#define CIP8_HANDLERS(shr,shl,jmv0,drw,dump,load,addi_load,spr_drw) {                                    \
+        [OP_CALL]  = &&do_invalid,   [OP_CLD]   = &&do_cld,   [OP_RET]   = &&do_ret,   [OP_GOTO]  = &&do_goto, \
+        [OP_CALLS] = &&do_calls, [OP_JVEQ]  = &&do_jveq,  [OP_JVNEQ] = &&do_jvneq, [OP_JEQ]   = &&do_jeq,   \
+        [OP_MOV]   = &&do_mov,   [OP_ADD]   = &&do_add,   [OP_ASS]   = &&do_ass,   [OP_OR]    = &&do_or,    \
+        [OP_XOR]   = &&do_xor,   [OP_AND]   = &&do_and,   [OP_ADDC]  = &&do_addc,  [OP_SUBC]  = &&do_subc,  \
+        [OP_SHR]   = &&do_##shr, [OP_SUBR]  = &&do_subr,  [OP_SHL]   = &&do_##shl, [OP_JNEQ]  = &&do_jneq,  \
+        [OP_SETI]  = &&do_seti,  [OP_JMV0]  = &&do_##jmv0, [OP_RND]  = &&do_rnd,   [OP_DRW]   = &&do_##drw, \
+        [OP_KEYD]  = &&do_keyd,  [OP_KEYU]  = &&do_keyu,  [OP_GETDT] = &&do_getdt, [OP_GETK]  = &&do_getk,  \
+        [OP_SETDT] = &&do_setdt, [OP_SETST] = &&do_setst, [OP_ADDI]  = &&do_addi,  [SETISPR]   = &&do_setispr, \
+        [OP_BCD]   = &&do_bcd,   [OP_DUMP]  = &&do_##dump, [OP_LOAD] = &&do_##load, [OP_INVALID] = &&do_invalid, \
+        [OP_SKIP_GOTO] = &&do_skip_goto, [OP_ADD_JEQ]   = &&do_add_jeq,   [OP_ADD_JNEQ] = &&do_add_jneq,    \
+        [OP_MOV_KEYD]  = &&do_mov_keyd,  [OP_MOV_KEYU]  = &&do_mov_keyu,                                    \
+        [OP_SETI_ADDI] = &&do_seti_addi, [OP_ADDI_LOAD] = &&do_##addi_load, [OP_SPR_DRW] = &&do_##spr_drw,  \
+    }
+    static void* const tables[CIP8_QUIRKS_COUNT][OP_INVALID + 1] = {
+        [CIP8_QUIRKS_LEGACY] = CIP8_HANDLERS(shr,shl,jmv0,drw,dump,load,addi_load,spr_drw),
+        [CIP8_QUIRKS_VIP]    = CIP8_HANDLERS(shr_vy,shl_vy,jmv0,drw_clip,dump_i,load_i,addi_load_i,spr_drw_clip),
+        [CIP8_QUIRKS_CHIP48] = CIP8_HANDLERS(shr,shl,jmv0_vx,drw_clip,dump_i_x,load_i_x,addi_load_i_x,spr_drw_clip),
+        [CIP8_QUIRKS_SCHIP]  = CIP8_HANDLERS(shr,shl,jmv0_vx,drw_clip,dump,load,addi_load,spr_drw_clip),
+        [CIP8_QUIRKS_XOCHIP] = CIP8_HANDLERS(shr_vy,shl_vy,jmv0,drw,dump_i,load_i,addi_load_i,spr_drw),
+    };
+#undef CIP8_HANDLERS
+    void* const* handlers = tables[cip->quirks < CIP8_QUIRKS_COUNT ? cip->quirks : CIP8_QUIRKS_LEGACY];
+    size_t n = 0;
+    Inst inst;
+    bool idle = cip8_idle_enabled(cip);
+    bool fuse = cip8_fuse_enabled(cip);
+
+#define DISPATCH()                                          \
+    do {                                                    \
+        if(n == count || cip->halted) return n;             \
+        inst = cip8_fetch_fused(cip,fuse ? count - n : 1);  \
+        if(ENABLE_PRINT_DEBUG) cip8_print_inst(*cip,inst);  \
+        CIP8_TRACE_STEP(cip);                               \
+        CIP8_PROFILE_STEP(cip,inst);                        \
+        cip->ip += 2;                                       \
+        n++;                                                \
+        goto *handlers[inst.op];                            \
+    } while(0)
+#define HANDLER(name) do_##name: cip8_op_##name(cip,inst); DISPATCH();
+#define QUIRK_HANDLER(label,name,quirks) do_##label: cip8_op_##name(cip,inst,quirks); DISPATCH();
+// goto and getk can close an idle loop
+#define IDLE_HANDLER(name)                                              \
+    do_##name: {                                                        \
+        Addr tail = cip->ip - 2;                                        \
+        cip8_op_##name(cip,inst);                                       \
+        if(inst.idle && idle) n += cip8_idle_skip(cip,tail,count - n);  \
+    } DISPATCH();
+// the fetch left room for the second half. a skip then goto can close an idle loop at the goto
+#define FUSED_HANDLER(name)                                                         \
+    do_##name: {                                                                    \
+        Addr head = cip->ip - 2;                                                    \
+        size_t ran = cip8_op_##name(cip,inst);                                      \
+        n += ran - 1;                                                               \
+        if(inst.idle && idle) n += cip8_idle_skip(cip,head + 2 * (ran - 1),count - n); \
+    } DISPATCH();
+#define FUSED_QUIRK_HANDLER(label,name,quirks)                                      \
+    do_##label: {                                                                   \
+        Addr head = cip->ip - 2;                                                    \
+        size_t ran = cip8_op_##name(cip,inst,quirks);                               \
+        n += ran - 1;                                                               \
+        if(inst.idle && idle) n += cip8_idle_skip(cip,head + 2 * (ran - 1),count - n); \
+    } DISPATCH();
+
+    DISPATCH();
+    HANDLER(cld)   HANDLER(ret)   IDLE_HANDLER(goto) HANDLER(calls)
+    HANDLER(jveq)  HANDLER(jvneq) HANDLER(jeq)   HANDLER(jneq)
+    HANDLER(mov)   HANDLER(add)   HANDLER(ass)   HANDLER(or)
+    HANDLER(xor)   HANDLER(and)   HANDLER(addc)  HANDLER(subc)
+    HANDLER(subr)  HANDLER(seti)  HANDLER(rnd)   HANDLER(keyd)
+    HANDLER(keyu)  HANDLER(getdt) IDLE_HANDLER(getk) HANDLER(setdt)
+    HANDLER(setst) HANDLER(addi)  HANDLER(setispr) HANDLER(bcd)
+    HANDLER(invalid)
+    QUIRK_HANDLER(shr,shr,0)   QUIRK_HANDLER(shr_vy,shr,CIP8_QUIRK_SHIFT_VY)
+    QUIRK_HANDLER(shl,shl,0)   QUIRK_HANDLER(shl_vy,shl,CIP8_QUIRK_SHIFT_VY)
+    QUIRK_HANDLER(jmv0,jmv0,0) QUIRK_HANDLER(jmv0_vx,jmv0,CIP8_QUIRK_JUMP_VX)
+    QUIRK_HANDLER(drw,drw,0)   QUIRK_HANDLER(drw_clip,drw,CIP8_QUIRK_CLIP)
+    QUIRK_HANDLER(dump,dump,0) QUIRK_HANDLER(dump_i,dump,CIP8_QUIRK_LOAD_I) QUIRK_HANDLER(dump_i_x,dump,CIP8_QUIRK_LOAD_I_X)
+    QUIRK_HANDLER(load,load,0) QUIRK_HANDLER(load_i,load,CIP8_QUIRK_LOAD_I) QUIRK_HANDLER(load_i_x,load,CIP8_QUIRK_LOAD_I_X)
+    FUSED_HANDLER(skip_goto) FUSED_HANDLER(add_jeq)   FUSED_HANDLER(add_jneq)
+    FUSED_HANDLER(mov_keyd)  FUSED_HANDLER(mov_keyu)  FUSED_HANDLER(seti_addi)
+    FUSED_QUIRK_HANDLER(addi_load,addi_load,0)
+    FUSED_QUIRK_HANDLER(addi_load_i,addi_load,CIP8_QUIRK_LOAD_I)
+    FUSED_QUIRK_HANDLER(addi_load_i_x,addi_load,CIP8_QUIRK_LOAD_I_X)
+    FUSED_QUIRK_HANDLER(spr_drw,spr_drw,0)
+    FUSED_QUIRK_HANDLER(spr_drw_clip,spr_drw,CIP8_QUIRK_CLIP)
+
+#undef FUSED_QUIRK_HANDLER
+#undef FUSED_HANDLER
+#undef QUIRK_HANDLER
+#undef IDLE_HANDLER
+#undef HANDLER
+#undef DISPATCH
+}
+#else
+typedef void (*Cip8Handler)(Cip8* cip,Inst inst);
+static const Cip8Handler cip8_handlers[OP_INVALID + 1] = {
+    [OP_CALL]  = cip8_op_invalid,   [OP_CLD]   = cip8_op_cld,   [OP_RET]   = cip8_op_ret,   [OP_GOTO]  = cip8_op_goto,
+    [OP_CALLS] = cip8_op_calls, [OP_JVEQ]  = cip8_op_jveq,  [OP_JVNEQ] = cip8_op_jvneq, [OP_JEQ]   = cip8_op_jeq,
+    [OP_MOV]   = cip8_op_mov,   [OP_ADD]   = cip8_op_add,   [OP_ASS]   = cip8_op_ass,   [OP_OR]    = cip8_op_or,
+    [OP_XOR]   = cip8_op_xor,   [OP_AND]   = cip8_op_and,   [OP_ADDC]  = cip8_op_addc,  [OP_SUBC]  = cip8_op_subc,
+    [OP_SUBR]  = cip8_op_subr,  [OP_JNEQ]  = cip8_op_jneq,  [OP_SETI]  = cip8_op_seti,  [OP_RND]   = cip8_op_rnd,
+    [OP_KEYD]  = cip8_op_keyd,  [OP_KEYU]  = cip8_op_keyu,  [OP_GETDT] = cip8_op_getdt, [OP_GETK]  = cip8_op_getk,
+    [OP_SETDT] = cip8_op_setdt, [OP_SETST] = cip8_op_setst, [OP_ADDI]  = cip8_op_addi,  [SETISPR]   = cip8_op_setispr,
+    [OP_BCD]   = cip8_op_bcd,   [OP_INVALID] = cip8_op_invalid,
+};
+// fused pairs and the ops with quirks are not in the table, they go through cip8_execute
+size_t cip8_run_threaded(Cip8* cip, size_t count) {
+    size_t n = 0;
+    bool idle = cip8_idle_enabled(cip);
+    bool fuse = cip8_fuse_enabled(cip);
+    while(n < count && !cip->halted) {
+        Inst inst = cip8_fetch_fused(cip,fuse ? count - n : 1);
+        if(ENABLE_PRINT_DEBUG){
+            cip8_print_inst(*cip,inst);
         }
+        CIP8_TRACE_STEP(cip);
+        CIP8_PROFILE_STEP(cip,inst);
+        Addr head = cip->ip;
+        size_t ran = 1;
+        cip->ip += 2;
+        if(!cip8_handlers[inst.op]) {
+            ran = cip8_execute(cip,inst);
+        } else {
+            cip8_handlers[inst.op](cip,inst);
+        }
+        n += ran;
+        if(inst.idle && idle) n += cip8_idle_skip(cip,head + 2 * (ran - 1),count - n);
+    }
+    return n;
+}
+#endif
+
+// the switch loop with the quirks fixed, cip8_run has a copy of it per profile
+static CIP8_ALWAYS_INLINE size_t cip8_run_quirks(Cip8* cip, size_t count, unsigned quirks) {
+    size_t n = 0;
+    bool idle = cip8_idle_enabled(cip);
+    bool fuse = cip8_fuse_enabled(cip);
+    while(n < count && !cip->halted) {
+        Addr head = cip->ip;
+        Inst inst = cip8_fetch_fused(cip,fuse ? count - n : 1);
+        size_t ran = cip8_step_inst_quirks(cip,inst,quirks);
+        n += ran;
+        // the goto of a fused skip then goto is the inst after head
+        if(inst.idle && idle) n += cip8_idle_skip(cip,head + 2 * (ran - 1),count - n);
+    }
+    return n;
+}
+// runs up to count instructions with the engine picked at build time, returns how many ran
+size_t cip8_run(Cip8* cip, size_t count) {
+#if CIP8_THREADED_DISPATCH
+    return cip8_run_threaded(cip,count);
+#else
+    switch (cip->quirks) {
+#define CIP8_QUIRKS_CASE(id,name,flags) case CIP8_QUIRKS_##id: return cip8_run_quirks(cip,count,flags);
+        CIP8_QUIRK_PROFILES(CIP8_QUIRKS_CASE)
+#undef CIP8_QUIRKS_CASE
+    }
+    return cip8_run_quirks(cip,count,0);
+#endif
+}
+void cip8_clear_display(Cip8* cip) {
+    cip->dirty_rows = 0xFFFFFFFF;
+    for(size_t y = 0; y < CIP8_DISPLAY_HEIGHT; y++) {
+        cip->display[y] = 0;
     }
 }
 
 
-void cip8_sdl_from_mem_to_texture(const Cip8 cip,SDL_Surface* surface,SDL_Texture* texture) {
-    SDL_Rect rect = {0,0,1,1};
-    SDL_FillRect(surface,0,BACKGROUND);
-    for (size_t y = 0; y < 32; y++) {
-        for (size_t x = 0; x < 8; x++) {
-            uint8_t byte = cip.display_refresh[x + y * 8];  
+#ifndef CIP8_NO_SDL
+// uploads the rows of display set in dirty_rows into a SDL_TEXTUREACCESS_STREAMING ARGB8888
+// texture of 64x32. every display byte becomes 8 pixels with one lookup, and the texture is
+// locked once over the span from the first to the last dirty row
+void cip8_sdl_stream_rows(const uint64_t display[CIP8_DISPLAY_HEIGHT],uint32_t dirty_rows,SDL_Texture* texture) {
+    static uint32_t lut[256][8];
+    static bool lut_ready = false;
+    if(!lut_ready) {
+        for (size_t byte = 0; byte < 256; byte++) {
             for (size_t b = 0; b < 8; b++) {
-                if(byte & (1 << b)) { 
-                    rect.x = x * 8 + b;
-                    rect.y = y;
-                    SDL_FillRect(surface,&rect,FOREGROUND);
-                }
+                lut[byte][b] = 0xFF000000 | ((byte & (1 << b)) ? FOREGROUND : BACKGROUND);
             }
         }
+        lut_ready = true;
     }
 
-    SDL_UpdateTexture(texture,0,surface->pixels,surface->pitch);
-}
-void cip8_from_mem_to_terminal(const Cip8 cip) { 
-    printf("\033[2J\033[H");
-    for (size_t y = 0; y < 32; y++) {
+    if(dirty_rows == 0) return;
+    int first = __builtin_ctz(dirty_rows);
+    int last  = 31 - __builtin_clz(dirty_rows);
+
+    // the locked pixels are write only and start out undefined, so every row in the span gets written
+    SDL_Rect rect = {0,first,64,last - first + 1};
+    void* pixels;
+    int pitch;
+    if(SDL_LockTexture(texture,&rect,&pixels,&pitch) != 0) return;
+    for (int y = first; y <= last; y++) {
+        uint32_t* row = (uint32_t*)((uint8_t*)pixels + (y - first) * pitch);
         for (size_t x = 0; x < 8; x++) {
-            uint8_t byte = cip.display_refresh[x + y * 8];  
-            for (size_t b = 0; b < 8; b++) {
-                if(byte & (1 << b)) {
-                    printf("#");
-                } else {
-                    printf(".");
-                }
+            memcpy(row + x * 8,lut[(display[y] >> (x * 8)) & 0xFF],sizeof(lut[0]));
+        }
+    }
+    SDL_UnlockTexture(texture);
+}
+// the rows drawn to since the last call
+void cip8_sdl_stream_to_texture(Cip8* cip,SDL_Texture* texture) {
+    cip8_sdl_stream_rows(cip->display,cip->dirty_rows,texture);
+    cip->dirty_rows = 0;
+}
+#endif
+void cip8_terminal_init(Cip8Term* term) {
+    term->drawn = false;
+}
+// writes only the cells that changed since the last call, each run of changed cells behind one
+// cursor move, and the whole frame goes out in a single write
+void cip8_from_mem_to_terminal(Cip8Term* term,const Cip8* cip) { 
+    static const char* glyphs[4] = {" ", "\xE2\x96\x80", "\xE2\x96\x84", "\xE2\x96\x88"}; // space ▀ ▄ █
+    size_t len = 0;
+    if(!term->drawn) {
+        len += sprintf(term->out + len,"\033[?25l\033[2J"); // hide the cursor, clear once
+    }
+
+    for (size_t line = 0; line < CIP8_TERM_LINES; line++) {
+        bool in_run = false;
+        for (size_t x = 0; x < CIP8_TERM_COLS; x++) {
+            uint8_t top    = (cip->display[line * 2]     >> x) & 1;
+            uint8_t bottom = (cip->display[line * 2 + 1] >> x) & 1;
+            uint8_t cell = top | (bottom << 1);
+            if(term->drawn && term->cells[line][x] == cell) {
+                in_run = false;
+                continue;
+            }
+            term->cells[line][x] = cell;
+            if(!in_run) {
+                len += sprintf(term->out + len,"\033[%zu;%zuH",line + 1,x + 1);
+                in_run = true;
             }
+            size_t g = strlen(glyphs[cell]);
+            memcpy(term->out + len,glyphs[cell],g);
+            len += g;
         }
-        printf("\n");
     }
+    term->drawn = true;
+    if(len == 0) return;
+
+#if defined(__unix__) || defined(__APPLE__)
+    const char* p = term->out;
+    while(len > 0) {
+        ssize_t w = write(STDOUT_FILENO,p,len);
+        if(w <= 0) break;
+        p += w;
+        len -= w;
+    }
+#else
+    fwrite(term->out,1,len,stdout);
+    fflush(stdout);
+#endif
 }
 
-OpCode* cip8_load_from_file(const char* file_name,int* size) {
+// false with an [ERROR] when the file can not be read or does not fit in memory
+bool cip8_rom_open(Cip8Rom* rom, const char* file_name) {
+    rom->bytes = NULL;
+    rom->size = 0;
+    rom->mapped = false;
+#if CIP8_MMAP
+    int fd = open(file_name,O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd,&st) == -1) {
+        if(fd != -1) close(fd);
+        printf("[ERROR]: Could not read file %s\n",file_name);
+        return false;
+    }
+    size_t size = st.st_size;
+#else
     FILE* f = fopen(file_name,"rb");
-
-    if(fseek(f,0,SEEK_END) == -1) {
-        fclose(f);
-        printf("[ERROR]: Could not read file\n");
-        exit(-1);
+    long fs = -1;
+    if(f && fseek(f,0,SEEK_END) == 0) fs = ftell(f);
+    if(fs < 0 || fseek(f,0,SEEK_SET) != 0) {
+        if(f) fclose(f);
+        printf("[ERROR]: Could not read file %s\n",file_name);
+        return false;
+    }
+    size_t size = fs;
+#endif
+    bool ok = size > 0 && size <= CIP8_ROM_MAX_SIZE;
+    if(!ok) {
+        printf("[ERROR]: %s is %zu bytes, a rom has to be 1 to %d\n",file_name,size,CIP8_ROM_MAX_SIZE);
     }
+#if CIP8_MMAP
+    if(ok) {
+        void* map = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+        ok = map != MAP_FAILED;
+        if(ok) {
+            rom->bytes = map;
+            rom->mapped = true;
+        } else {
+            printf("[ERROR]: Could not map file %s\n",file_name);
+        }
+    }
+    close(fd);
+#else
+    if(ok) {
+        uint8_t* buffer = malloc(size);
+        assert(buffer && "out of memory for a rom");
+        ok = fread(buffer,1,size,f) == size;
+        if(ok) {
+            rom->bytes = buffer;
+        } else {
+            free(buffer);
+            printf("[ERROR]: Could not read file %s\n",file_name);
+        }
+    }
+    fclose(f);
+#endif
+    if(ok) rom->size = size;
+    return ok;
+}
+void cip8_rom_close(Cip8Rom* rom) {
+#if CIP8_MMAP
+    if(rom->mapped) munmap((void*)rom->bytes,rom->size);
+#endif
+    if(!rom->mapped) free((void*)rom->bytes);
+    rom->bytes = NULL;
+    rom->size = 0;
+    rom->mapped = false;
+}
+// cip8_rom_open, cip8_load_program and cip8_rom_close in one go
+bool cip8_load_file(Cip8* cip, const char* file_name) {
+    Cip8Rom rom;
+    if(!cip8_rom_open(&rom,file_name)) return false;
+    bool ok = cip8_load_program(cip,rom.bytes,rom.size);
+    cip8_rom_close(&rom);
+    return ok;
+}
 
-    long fs = ftell(f);
-    int s = fs / 2;
-    
-    if(fseek(f,0,SEEK_SET) == -1) {
-        fclose(f);
-        
-        printf("[ERROR]: Could not read file\n");
-        exit(-2);
+// FNV-1a over the architectural state, for comparing runs
+#define CIP8_FNV_OFFSET 1469598103934665603ull
+#define CIP8_FNV_PRIME  1099511628211ull
+static inline uint64_t cip8_fnv(uint64_t h, const void* data, size_t size) {
+    const uint8_t* p = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= CIP8_FNV_PRIME;
     }
+    return h;
+}
+uint64_t cip8_state_hash(const Cip8* cip) {
+    uint64_t h = CIP8_FNV_OFFSET;
+    for (size_t p = 0; p < CIP8_PAGES; p++) {
+        h = cip8_fnv(h,cip->pages[p]->bytes,CIP8_PAGE_SIZE);
+    }
+    h = cip8_fnv(h,cip->regs.V,sizeof(cip->regs.V));
+    h = cip8_fnv(h,&cip->regs.I,sizeof(cip->regs.I));
+    h = cip8_fnv(h,&cip->ip,sizeof(cip->ip));
+    h = cip8_fnv(h,&cip->sp,sizeof(cip->sp));
+    h = cip8_fnv(h,&cip->delay_timer,sizeof(cip->delay_timer));
+    h = cip8_fnv(h,&cip->sound_timer,sizeof(cip->sound_timer));
+    h = cip8_fnv(h,&cip->rng,sizeof(cip->rng));
+    return h;
+}
+// hash for telling machine states apart that costs the same for any amount of memory: memory is
+// the zobrist hash cip8_write keeps up, the registers, timers, rng and display are a few words
+// folded in here. keys, halted and the trap are left out like in cip8_state_hash
+uint64_t cip8_zobrist(const Cip8* cip) {
+    uint64_t words[5];
+    memcpy(words,cip->regs.V,sizeof(cip->regs.V));
+    words[2] = cip->regs.I | (uint64_t)cip->ip << 16 | (uint64_t)cip->sp << 32 |
+               (uint64_t)cip->delay_timer << 48 | (uint64_t)cip->sound_timer << 56;
+    words[3] = cip->waiting_release;
+    words[4] = cip->rng;
+    uint64_t h = cip->mem_hash;
+    for (size_t i = 0; i < 5; i++) {
+        h ^= cip8_mix64(words[i] + (MEMORY_SIZE + i) * 0x9E3779B97F4A7C15ull);
+    }
+    for (size_t y = 0; y < CIP8_DISPLAY_HEIGHT; y++) {
+        h ^= cip8_mix64(cip->display[y] + (MEMORY_SIZE + 5 + y) * 0x9E3779B97F4A7C15ull);
+    }
+    return h;
+}
+uint64_t cip8_display_hash(const Cip8* cip) {
+    return cip8_fnv(CIP8_FNV_OFFSET,cip->display,sizeof(cip->display));
+}
 
-    
-    uint16_t* buffer = malloc(s * sizeof(uint16_t));
-    if(fread(buffer,s,sizeof(uint16_t),f) == -1) {
-        fclose(f);
-        free(buffer);
-        exit(-3);
+void cip8_snapshot(const Cip8* cip, Cip8Snapshot* snap) {
+    memset(snap,0,sizeof(*snap)); // padding too, snapshots get compared and xored as bytes
+    memcpy(snap->magic,CIP8_SNAPSHOT_MAGIC,8);
+    snap->version = CIP8_SNAPSHOT_VERSION;
+    snap->size = sizeof(Cip8Snapshot);
+    for (size_t p = 0; p < CIP8_PAGES; p++) {
+        memcpy(snap->memory + p * CIP8_PAGE_SIZE,cip->pages[p]->bytes,CIP8_PAGE_SIZE);
     }
-    if(size != NULL) {
-        *size = s;
+    memcpy(snap->display,cip->display,sizeof(snap->display));
+    memcpy(snap->V,cip->regs.V,sizeof(snap->V));
+    snap->I = cip->regs.I;
+    snap->ip = cip->ip;
+    snap->sp = cip->sp;
+    snap->keys = cip->keys;
+    snap->delay_timer = cip->delay_timer;
+    snap->sound_timer = cip->sound_timer;
+    snap->halted = cip->halted;
+    snap->trap = cip->trap;
+    snap->waiting_release = cip->waiting_release;
+    snap->rng = cip->rng;
+}
+// false and cip untouched when snap is from another version. pages that did not change stay
+// as they are, still shared if they were
+bool cip8_restore(Cip8* cip, const Cip8Snapshot* snap) {
+    if(memcmp(snap->magic,CIP8_SNAPSHOT_MAGIC,8) != 0 || snap->version != CIP8_SNAPSHOT_VERSION ||
+       snap->size != sizeof(Cip8Snapshot)) {
+        printf("[ERROR]: snapshot is not a version %d cip8 snapshot\n",CIP8_SNAPSHOT_VERSION);
+        return false;
     }
-    
-    fclose(f);
-    return buffer;
+    for (size_t p = 0; p < CIP8_PAGES; p++) {
+        const uint8_t* bytes = snap->memory + p * CIP8_PAGE_SIZE;
+        if(memcmp(cip->pages[p]->bytes,bytes,CIP8_PAGE_SIZE) == 0) continue;
+        cip8_write_bytes(cip,p * CIP8_PAGE_SIZE,bytes,CIP8_PAGE_SIZE);
+        cip8_predecode(cip,p * CIP8_PAGE_SIZE,CIP8_PAGE_SIZE);
+    }
+    memcpy(cip->display,snap->display,sizeof(cip->display));
+    memcpy(cip->regs.V,snap->V,sizeof(cip->regs.V));
+    cip->regs.I = snap->I;
+    cip->ip = snap->ip;
+    cip->sp = snap->sp;
+    cip->keys = snap->keys;
+    cip->delay_timer = snap->delay_timer;
+    cip->sound_timer = snap->sound_timer;
+    cip->halted = snap->halted;
+    cip->trap = snap->trap;
+    cip->waiting_release = snap->waiting_release;
+    cip->rng = snap->rng;
+    cip->display_changed = true;
+    cip->dirty_rows = 0xFFFFFFFF;
+    return true;
 }
 
 #endif
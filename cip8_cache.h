@@ -0,0 +1,116 @@
+#ifndef CIP8_CACHE_H_
+#define CIP8_CACHE_H_
+#include <pthread.h>
+#include "cip8.h"
+
+// content addressed rom cache: FNV-1a of the rom bytes to a loaded and predecoded image, so a rom
+// handed over a thousand times (or under two names) is loaded once. images are never written
+// after loading, instances cip8_init_shared them and copy the pages they write.
+// the table is open addressed and guarded by one mutex, a miss loads while holding it so two
+// threads asking for the same new rom do not both load it.
+
+typedef struct {
+    uint64_t hash;
+    size_t size;
+    Cip8* image; // NULL for an empty slot
+} Cip8CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Cip8CacheEntry* entries;
+    size_t count, cap; // cap is a power of two
+    uint64_t hits, misses;
+} Cip8Cache;
+
+void cip8_cache_init(Cip8Cache* cache);
+void cip8_cache_free(Cip8Cache* cache);
+const Cip8* cip8_cache_get(Cip8Cache* cache, const uint8_t* rom, size_t size);
+const Cip8* cip8_cache_load(Cip8Cache* cache, const char* file_name);
+
+
+// the hash only picks the slot, the bytes decide
+static bool cip8_cache_match(const Cip8CacheEntry* e, uint64_t hash, const uint8_t* rom, size_t size) {
+    if(e->hash != hash || e->size != size) return false;
+    for (size_t i = 0; i < size; i++) {
+        if(cip8_read(e->image,PROGRAM_START + i) != rom[i]) return false;
+    }
+    return true;
+}
+static void cip8_cache_grow(Cip8Cache* cache) {
+    size_t cap = cache->cap ? cache->cap * 2 : 16;
+    Cip8CacheEntry* entries = calloc(cap,sizeof(Cip8CacheEntry));
+    assert(entries && "out of memory for the rom cache");
+    for (size_t i = 0; i < cache->cap; i++) {
+        Cip8CacheEntry* e = &cache->entries[i];
+        if(!e->image) continue;
+        size_t s = e->hash & (cap - 1);
+        while(entries[s].image) s = (s + 1) & (cap - 1);
+        entries[s] = *e;
+    }
+    free(cache->entries);
+    cache->entries = entries;
+    cache->cap = cap;
+}
+
+void cip8_cache_init(Cip8Cache* cache) {
+    pthread_mutex_init(&cache->lock,NULL);
+    cache->entries = NULL;
+    cache->count = cache->cap = 0;
+    cache->hits = cache->misses = 0;
+}
+// every image handed out goes with it
+void cip8_cache_free(Cip8Cache* cache) {
+    for (size_t i = 0; i < cache->cap; i++) {
+        if(!cache->entries[i].image) continue;
+        cip8_free(cache->entries[i].image);
+        free(cache->entries[i].image);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->count = cache->cap = 0;
+    pthread_mutex_destroy(&cache->lock);
+}
+// the image of rom, loading it on a miss. NULL when the rom does not fit in memory
+const Cip8* cip8_cache_get(Cip8Cache* cache, const uint8_t* rom, size_t size) {
+    uint64_t hash = cip8_fnv(CIP8_FNV_OFFSET,rom,size);
+    pthread_mutex_lock(&cache->lock);
+    if(cache->count * 2 >= cache->cap) cip8_cache_grow(cache);
+    size_t s = hash & (cache->cap - 1);
+    Cip8CacheEntry* e = &cache->entries[s];
+    while(e->image && !cip8_cache_match(e,hash,rom,size)) {
+        s = (s + 1) & (cache->cap - 1);
+        e = &cache->entries[s];
+    }
+    if(e->image) {
+        cache->hits++;
+    } else {
+        Cip8* image = malloc(sizeof(Cip8));
+        assert(image && "out of memory for a rom image");
+        cip8_init(image);
+        if(cip8_load_program(image,rom,size)) {
+            // shared copies start out clean, the tables already match the memory
+            image->dirty_start = image->dirty_end = 0;
+            e->hash = hash;
+            e->size = size;
+            e->image = image;
+            cache->count++;
+            cache->misses++;
+        } else {
+            cip8_free(image);
+            free(image);
+        }
+    }
+    const Cip8* image = e->image;
+    pthread_mutex_unlock(&cache->lock);
+    return image;
+}
+// maps the file only long enough to hash it, and copy it on a miss
+const Cip8* cip8_cache_load(Cip8Cache* cache, const char* file_name) {
+    Cip8Rom rom;
+    if(!cip8_rom_open(&rom,file_name)) return NULL;
+    const Cip8* image = cip8_cache_get(cache,rom.bytes,rom.size);
+    cip8_rom_close(&rom);
+    return image;
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef CIP8_EXPLORE_H_
+#define CIP8_EXPLORE_H_
+#include <stdatomic.h>
+#include "cip8.h"
+#include "cip8_sched.h"
+#include "cip8_pool.h"
+
+// breadth first search over the keypad input of a rom. a state is a machine stopped on an OP_KEYD,
+// OP_KEYU or OP_GETK (a decision point), its children are that machine run with every input that
+// can change the outcome held for that one inst (nothing or key VX for the skips, nothing or any
+// key for getk) up to its next decision point. states are told apart by cip8_zobrist and how far
+// the machine is to the next timer tick, and go into one lock free set every worker inserts into,
+// so a state reached over many paths is expanded once. each level of the search is cut into tasks
+// on a cip8_pool.h pool, workers that run dry steal from the others.
+// the timers tick every ips / 60 instructions. a path that halts, or runs CIP8_EXPLORE_SEGMENT
+// instructions without reaching a decision point, ends there.
+
+#ifndef CIP8_EXPLORE_SEGMENT
+#define CIP8_EXPLORE_SEGMENT 100000
+#endif
+#define CIP8_EXPLORE_CHUNK 8    // frontier states per task
+#define CIP8_EXPLORE_NO_KEY 16  // the input with nothing held
+
+// open addressing set of 64 bit hashes, an insert is a CAS on one slot. it never grows, the
+// slots are twice the states it takes
+typedef struct {
+    _Atomic uint64_t* slots;
+    size_t mask;
+    size_t capacity;
+    atomic_size_t count;
+} Cip8StateSet;
+
+typedef struct {
+    Cip8Snapshot snap;
+    uint64_t cycle;
+} Cip8ExploreState;
+
+typedef struct {
+    Cip8 cip;
+    Cip8ExploreState* found; // new states of the level being expanded
+    size_t found_count, found_cap;
+    uint64_t pcs[MEMORY_SIZE / 64]; // bit per address an inst ran from
+    uint64_t instructions;
+    uint64_t ends;           // paths that halted or ran out of instructions
+} Cip8ExploreWorker;
+
+typedef struct {
+    uint32_t period;         // instructions per timer tick
+    Cip8StateSet seen;
+    Cip8Pool pool;
+    Cip8ExploreWorker* workers;
+    Cip8ExploreState* frontier; // the states the next level expands
+    size_t frontier_count;
+    size_t depth;            // levels expanded so far
+} Cip8Explorer;
+
+void cip8_state_set_init(Cip8StateSet* set, size_t capacity);
+void cip8_state_set_free(Cip8StateSet* set);
+bool cip8_state_set_insert(Cip8StateSet* set, uint64_t hash);
+void cip8_explore_init(Cip8Explorer* ex, const Cip8* image, uint32_t ips, size_t max_states, size_t threads);
+size_t cip8_explore_level(Cip8Explorer* ex);
+size_t cip8_explore_coverage(const Cip8Explorer* ex, uint64_t pcs[MEMORY_SIZE / 64]);
+uint64_t cip8_explore_instructions(const Cip8Explorer* ex);
+uint64_t cip8_explore_ends(const Cip8Explorer* ex);
+void cip8_explore_free(Cip8Explorer* ex);
+
+
+void cip8_state_set_init(Cip8StateSet* set, size_t capacity) {
+    size_t slots = 64;
+    while(slots < 2 * capacity) slots *= 2;
+    set->slots = calloc(slots,sizeof(*set->slots));
+    assert(set->slots && "out of memory for the state set");
+    set->mask = slots - 1;
+    set->capacity = capacity;
+    atomic_init(&set->count,0);
+}
+void cip8_state_set_free(Cip8StateSet* set) {
+    free((void*)set->slots);
+    set->slots = NULL;
+}
+// true when hash was not in the set and is now, false when it was or the set is full.
+// 0 marks an empty slot, a hash of 0 is stored as 1
+bool cip8_state_set_insert(Cip8StateSet* set, uint64_t hash) {
+    if(!hash) hash = 1;
+    for (size_t i = hash & set->mask;; i = (i + 1) & set->mask) {
+        uint64_t slot = atomic_load_explicit(&set->slots[i],memory_order_relaxed);
+        if(slot == hash) return false;
+        if(slot) continue;
+        if(atomic_fetch_add_explicit(&set->count,1,memory_order_relaxed) >= set->capacity) {
+            atomic_fetch_sub_explicit(&set->count,1,memory_order_relaxed);
+            return false;
+        }
+        if(atomic_compare_exchange_strong_explicit(&set->slots[i],&slot,hash,memory_order_relaxed,memory_order_relaxed)) {
+            return true;
+        }
+        // someone else took the slot, it may have been for the same hash
+        atomic_fetch_sub_explicit(&set->count,1,memory_order_relaxed);
+        if(slot == hash) return false;
+    }
+}
+
+static bool cip8_explore_decision(Cip8* cip) {
+    Operation op = cip8_inst_at(cip,cip->ip).op;
+    return op == OP_KEYD || op == OP_KEYU || op == OP_GETK;
+}
+// runs w's machine up to the next decision point with keys held for the first inst only, false
+// when the path ends on the way. a path from a decision point always runs that one first
+static bool cip8_explore_run(Cip8Explorer* ex, Cip8ExploreWorker* w, uint64_t* cycle, uint16_t keys, bool from_decision) {
+    Cip8* cip = &w->cip;
+    cip->keys = keys;
+    for (size_t n = 0; n < CIP8_EXPLORE_SEGMENT; n++) {
+        if((n > 0 || !from_decision) && cip8_explore_decision(cip)) return true;
+        w->pcs[cip->ip % MEMORY_SIZE / 64] |= 1ull << (cip->ip % 64);
+        cip8_step(cip);
+        cip->keys = 0;
+        w->instructions++;
+        if(++*cycle % ex->period == 0) cip8_tick_timers(cip);
+        if(cip->halted) return false;
+    }
+    return false;
+}
+// two machines that are alike but a different distance from the next tick are not the same state
+static inline uint64_t cip8_explore_hash(const Cip8Explorer* ex, const Cip8* cip, uint64_t cycle) {
+    return cip8_zobrist(cip) ^ cip8_mix64(cycle % ex->period + 1);
+}
+static void cip8_explore_found(Cip8ExploreWorker* w, uint64_t cycle) {
+    if(w->found_count == w->found_cap) {
+        w->found_cap = w->found_cap ? w->found_cap * 2 : 64;
+        w->found = realloc(w->found,w->found_cap * sizeof(Cip8ExploreState));
+        assert(w->found && "out of memory for explored states");
+    }
+    Cip8ExploreState* state = &w->found[w->found_count++];
+    cip8_snapshot(&w->cip,&state->snap);
+    state->cycle = cycle;
+}
+
+typedef struct {
+    Cip8Explorer* ex;
+    size_t start, end; // frontier range
+} Cip8ExploreChunk;
+
+static void cip8_explore_task(void* arg, size_t worker) {
+    Cip8ExploreChunk* chunk = arg;
+    Cip8Explorer* ex = chunk->ex;
+    Cip8ExploreWorker* w = &ex->workers[worker];
+    Cip8* cip = &w->cip;
+    for (size_t i = chunk->start; i < chunk->end; i++) {
+        const Cip8ExploreState* state = &ex->frontier[i];
+        cip8_restore(cip,&state->snap);
+        // nothing held, then the keys that make a difference to the inst ip is on
+        uint8_t inputs[17];
+        size_t count = 0;
+        inputs[count++] = CIP8_EXPLORE_NO_KEY;
+        if(cip8_inst_at(cip,cip->ip).op == OP_GETK) {
+            for (uint8_t key = 0; key < 16; key++) inputs[count++] = key;
+        } else {
+            inputs[count++] = GET_VX(cip8_inst_at(cip,cip->ip).oprand) & 0xF;
+        }
+        for (size_t k = 0; k < count; k++) {
+            if(k > 0) cip8_restore(cip,&state->snap);
+            uint64_t cycle = state->cycle;
+            uint16_t keys = inputs[k] == CIP8_EXPLORE_NO_KEY ? 0 : 1u << inputs[k];
+            if(!cip8_explore_run(ex,w,&cycle,keys,true)) {
+                w->ends++;
+                continue;
+            }
+            if(cip8_state_set_insert(&ex->seen,cip8_explore_hash(ex,cip,cycle))) {
+                cip8_explore_found(w,cycle);
+            }
+        }
+    }
+}
+
+// the first level is the image run up to its first decision point. threads 0 is one per cpu
+void cip8_explore_init(Cip8Explorer* ex, const Cip8* image, uint32_t ips, size_t max_states, size_t threads) {
+    ex->period = ips / CIP8_TIMER_HZ > 0 ? ips / CIP8_TIMER_HZ : 1;
+    ex->depth = 0;
+    cip8_state_set_init(&ex->seen,max_states);
+    cip8_pool_init(&ex->pool,threads);
+    ex->workers = calloc(ex->pool.workers,sizeof(Cip8ExploreWorker));
+    assert(ex->workers && "out of memory for explore workers");
+    for (size_t i = 0; i < ex->pool.workers; i++) {
+        cip8_init_shared(&ex->workers[i].cip,image);
+    }
+
+    Cip8ExploreWorker* w = &ex->workers[0];
+    uint64_t cycle = 0;
+    if(cip8_explore_run(ex,w,&cycle,0,false)) {
+        cip8_state_set_insert(&ex->seen,cip8_explore_hash(ex,&w->cip,cycle));
+        cip8_explore_found(w,cycle);
+    } else {
+        w->ends++;
+    }
+    ex->frontier = w->found;
+    ex->frontier_count = w->found_count;
+    w->found = NULL;
+    w->found_count = w->found_cap = 0;
+}
+// expands every state of the frontier, the new ones become the next frontier. returns how many,
+// 0 when the search is over or the set is full
+size_t cip8_explore_level(Cip8Explorer* ex) {
+    size_t tasks = (ex->frontier_count + CIP8_EXPLORE_CHUNK - 1) / CIP8_EXPLORE_CHUNK;
+    Cip8ExploreChunk* chunks = malloc(tasks * sizeof(Cip8ExploreChunk) + 1);
+    assert(chunks && "out of memory for explore tasks");
+    for (size_t t = 0; t < tasks; t++) {
+        size_t end = (t + 1) * CIP8_EXPLORE_CHUNK;
+        chunks[t] = (Cip8ExploreChunk){ex,t * CIP8_EXPLORE_CHUNK,end < ex->frontier_count ? end : ex->frontier_count};
+        cip8_pool_submit(&ex->pool,t,(Cip8Task){cip8_explore_task,&chunks[t]});
+    }
+    cip8_pool_wait(&ex->pool);
+    free(chunks);
+
+    size_t count = 0;
+    for (size_t i = 0; i < ex->pool.workers; i++) count += ex->workers[i].found_count;
+    free(ex->frontier);
+    ex->frontier = malloc(count * sizeof(Cip8ExploreState) + 1);
+    assert(ex->frontier && "out of memory for the frontier");
+    ex->frontier_count = 0;
+    for (size_t i = 0; i < ex->pool.workers; i++) {
+        Cip8ExploreWorker* w = &ex->workers[i];
+        memcpy(ex->frontier + ex->frontier_count,w->found,w->found_count * sizeof(Cip8ExploreState));
+        ex->frontier_count += w->found_count;
+        w->found_count = 0;
+    }
+    if(tasks) ex->depth++;
+    return ex->frontier_count;
+}
+// every address any path ran an inst from into pcs, returns how many
+size_t cip8_explore_coverage(const Cip8Explorer* ex, uint64_t pcs[MEMORY_SIZE / 64]) {
+    size_t count = 0;
+    for (size_t i = 0; i < MEMORY_SIZE / 64; i++) {
+        pcs[i] = 0;
+        for (size_t w = 0; w < ex->pool.workers; w++) pcs[i] |= ex->workers[w].pcs[i];
+        count += __builtin_popcountll(pcs[i]);
+    }
+    return count;
+}
+uint64_t cip8_explore_instructions(const Cip8Explorer* ex) {
+    uint64_t n = 0;
+    for (size_t w = 0; w < ex->pool.workers; w++) n += ex->workers[w].instructions;
+    return n;
+}
+uint64_t cip8_explore_ends(const Cip8Explorer* ex) {
+    uint64_t n = 0;
+    for (size_t w = 0; w < ex->pool.workers; w++) n += ex->workers[w].ends;
+    return n;
+}
+void cip8_explore_free(Cip8Explorer* ex) {
+    cip8_pool_free(&ex->pool);
+    for (size_t i = 0; i < ex->pool.workers; i++) {
+        cip8_free(&ex->workers[i].cip);
+        free(ex->workers[i].found);
+    }
+    free(ex->workers);
+    free(ex->frontier);
+    cip8_state_set_free(&ex->seen);
+}
+
+#endif
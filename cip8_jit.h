@@ -0,0 +1,754 @@
+#ifndef CIP8_JIT_H_
+#define CIP8_JIT_H_
+#include "cip8.h"
+
+// x86-64 block compiler on top of the interpreter.
+// addresses that run often get their code translated to native code. a block runs on through
+// skips, which branch inside it to the inst after the skipped one, and ends at a goto, call, ret,
+// jmv0 or getk. a goto or call jumps straight into the block at its target, through a jmp that is
+// patched once that block gets compiled, and ret and jmv0 look theirs up in block[], so a program
+// only comes back to cip8_jit_run at the end of the budget, at an idle loop (for cip8_idle_skip)
+// and after an op that trapped or wrote over compiled code.
+// the V a block uses most and I stay in host registers while it runs (rbx = cip, r15 the budget),
+// the ones written since the last store go back before a helper call or a way out, and after a
+// helper only the ones it can write (and the caller saved ones) are read again. ops without an
+// inline translation become a call into their cip8_op_ (cip8_execute for the rare ones), so every
+// op is supported. a goto on itself uses up the budget in place.
+// every straight run of insts first checks the budget covers all of it and leaves when not, the
+// few insts up to the next event are left to cip8_run.
+// quirks are resolved as a block is translated, blocks are for the profile of the machine that
+// compiled them and a machine with another one flushes the cache first.
+
+#define CIP8_JIT_THRESHOLD 16         // interpreted runs of an address before it gets compiled
+#define CIP8_JIT_CACHE_SIZE (1 << 20) // bytes of executable memory, flushed all at once when full
+#define CIP8_JIT_MAX_BLOCK 64         // instructions per block
+#define CIP8_JIT_MAX_LINKS 4096       // jumps between blocks that get patched, the rest always leave
+#define CIP8_JIT_NO_TAIL 0xFFFF
+#define CIP8_JIT_SHORT   0xFFFE // as the tail: the budget did not cover the next run of insts
+
+// a jmp from one block to the start of another, or out until that one is compiled
+typedef struct {
+    uint32_t site; // offset of the jmp's rel32 in code
+    Addr target;
+} Cip8JitLink;
+
+typedef struct {
+    uint8_t* code;
+    size_t used;
+    bool failed; // no executable memory, everything goes to the interpreter
+    uint8_t quirks; // the Cip8Quirks every block in the cache was compiled for
+    size_t exit, exit_none; // offsets of the way back to cip8_jit_run, with an idle tail in edx and without
+
+    uint8_t* block[MEMORY_SIZE]; // entry of the compiled block starting at an address
+    uint8_t len[MEMORY_SIZE];    // instructions in that block
+    uint16_t hits[MEMORY_SIZE];
+    bool covered[MEMORY_SIZE];   // some block was compiled from this byte since the last flush
+    Cip8JitLink links[CIP8_JIT_MAX_LINKS];
+    size_t link_count;
+} Cip8Jit;
+
+// what the code at offset 0 returns: budget left, and the goto or getk of the idle loop it stopped at
+typedef struct {
+    uint64_t left;
+    uint64_t tail; // CIP8_JIT_NO_TAIL when it did not stop at one, CIP8_JIT_SHORT at the budget's end
+} Cip8JitExit;
+typedef Cip8JitExit (*Cip8JitEnter)(Cip8* cip, uint8_t* block, uint64_t budget);
+
+void cip8_jit_init(Cip8Jit* jit);
+void cip8_jit_free(Cip8Jit* jit);
+void cip8_jit_flush(Cip8Jit* jit);
+bool cip8_jit_invalidate(Cip8Jit* jit, Cip8* cip);
+size_t cip8_jit_run(Cip8Jit* jit, Cip8* cip, size_t count);
+
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define CIP8_JIT_SUPPORTED 1
+#include <stddef.h>
+#include <sys/mman.h>
+#else
+#define CIP8_JIT_SUPPORTED 0
+#endif
+
+// an invalidated entry gets this as its budget check, nothing passes it (cip8_jit_run never hands
+// out more), so whatever still jumps there goes back to cip8_jit_run as a short exit
+#define CIP8_JIT_MAX_BUDGET (1 << 30)
+#define CIP8_JIT_DEAD 0x7FFFFFFF
+
+static void cip8_jit_prologue(Cip8Jit* jit);
+
+void cip8_jit_init(Cip8Jit* jit) {
+    jit->code = NULL;
+    jit->used = 0;
+    jit->failed = true;
+    jit->quirks = CIP8_QUIRKS_LEGACY;
+#if CIP8_JIT_SUPPORTED
+    void* mem = mmap(NULL,CIP8_JIT_CACHE_SIZE,PROT_READ | PROT_WRITE | PROT_EXEC,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(mem != MAP_FAILED) {
+        jit->code = mem;
+        jit->failed = false;
+    }
+#endif
+    cip8_jit_flush(jit);
+}
+void cip8_jit_free(Cip8Jit* jit) {
+#if CIP8_JIT_SUPPORTED
+    if(jit->code) munmap(jit->code,CIP8_JIT_CACHE_SIZE);
+#endif
+    jit->code = NULL;
+    jit->failed = true;
+}
+void cip8_jit_flush(Cip8Jit* jit) {
+    jit->used = 0;
+    jit->link_count = 0;
+    for (size_t i = 0; i < MEMORY_SIZE; i++) {
+        jit->block[i] = NULL;
+        jit->len[i] = 0;
+        jit->hits[i] = 0;
+        jit->covered[i] = false;
+    }
+    if(!jit->failed) cip8_jit_prologue(jit);
+}
+
+// drops every block overlapping the memory cip8_predecode touched since the last call, true when
+// there was one. its code is only reclaimed by the next flush, the jumps linked into it go back
+// to their way out (and get linked again when the address is compiled again), and the entry
+// gets the dead budget check for anything already on its way in.
+// a block is at most CIP8_JIT_MAX_BLOCK insts, nothing starting further back can reach the range
+bool cip8_jit_invalidate(Cip8Jit* jit, Cip8* cip) {
+    bool dropped = false;
+    // writes to data, the usual case, end here without looking at the blocks
+    size_t hit = cip->dirty_start;
+    while(hit < cip->dirty_end && hit < MEMORY_SIZE && !jit->covered[hit]) hit++;
+    if(hit == cip->dirty_end || hit == MEMORY_SIZE) {
+        cip->dirty_start = cip->dirty_end = 0;
+        return false;
+    }
+    size_t from = cip->dirty_start > 2 * CIP8_JIT_MAX_BLOCK ? cip->dirty_start - 2 * CIP8_JIT_MAX_BLOCK : 0;
+    size_t to = cip->dirty_end < MEMORY_SIZE ? cip->dirty_end : MEMORY_SIZE;
+    for (size_t a = from; a < to; a++) {
+        if(!jit->block[a]) continue;
+        size_t end = a + 2 * jit->len[a];
+        if(a < cip->dirty_end && cip->dirty_start < end) {
+            uint32_t dead = CIP8_JIT_DEAD, unlinked = 0;
+            memcpy(jit->block[a] + 3,&dead,sizeof(dead)); // the imm32 of cmp r15, imm32
+            for (size_t l = 0; l < jit->link_count; l++) {
+                if(jit->links[l].target == a) memcpy(jit->code + jit->links[l].site,&unlinked,sizeof(unlinked));
+            }
+            jit->block[a] = NULL;
+            jit->len[a] = 0;
+            jit->hits[a] = 0;
+            dropped = true;
+        }
+    }
+    cip->dirty_start = cip->dirty_end = 0;
+    return dropped;
+}
+
+#if CIP8_JIT_SUPPORTED
+// called from compiled code for ops without an inline translation, the inst is packed as op << 16 | oprand.
+// nonzero when the block has to go back to cip8_jit_run: the op trapped or wrote over a block
+static uint32_t cip8_jit_helper(Cip8* cip, uint32_t packed, Cip8Jit* jit) {
+    Inst inst = {0};
+    inst.op = inst.first = packed >> 16;
+    inst.oprand = packed & 0xFFFF;
+    cip8_execute(cip,inst);
+    if(cip->dirty_start != cip->dirty_end && cip8_jit_invalidate(jit,cip)) return 1;
+    return cip->halted;
+}
+// the common helper ops called straight, without the two switches in cip8_execute. packed is
+// quirks << 16 | oprand for these
+#define CIP8_JIT_HELPER(name,opcode,args)                                                  \
+static uint32_t cip8_jit_helper_##name(Cip8* cip, uint32_t packed, Cip8Jit* jit) {       \
+    Inst inst = {0};                                                                     \
+    inst.op = inst.first = opcode;                                                       \
+    inst.oprand = packed & 0xFFFF;                                                       \
+    cip8_op_##name args;                                                                 \
+    if(cip->dirty_start != cip->dirty_end && cip8_jit_invalidate(jit,cip)) return 1;      \
+    return cip->halted;                                                                  \
+}
+CIP8_JIT_HELPER(cld,OP_CLD,(cip,inst))         CIP8_JIT_HELPER(rnd,OP_RND,(cip,inst))
+CIP8_JIT_HELPER(bcd,OP_BCD,(cip,inst))         CIP8_JIT_HELPER(setispr,SETISPR,(cip,inst))
+CIP8_JIT_HELPER(ret,OP_RET,(cip,inst))         CIP8_JIT_HELPER(calls,OP_CALLS,(cip,inst))
+CIP8_JIT_HELPER(getk,OP_GETK,(cip,inst))       CIP8_JIT_HELPER(drw,OP_DRW,(cip,inst,packed >> 16))
+CIP8_JIT_HELPER(dump,OP_DUMP,(cip,inst,packed >> 16)) CIP8_JIT_HELPER(load,OP_LOAD,(cip,inst,packed >> 16))
+CIP8_JIT_HELPER(jmv0,OP_JMV0,(cip,inst,packed >> 16))
+#undef CIP8_JIT_HELPER
+
+static void cip8_jit_emit8(Cip8Jit* jit, uint8_t b)  { jit->code[jit->used++] = b; }
+static void cip8_jit_emit16(Cip8Jit* jit, uint16_t v) { cip8_jit_emit8(jit,v); cip8_jit_emit8(jit,v >> 8); }
+static void cip8_jit_emit32(Cip8Jit* jit, uint32_t v) { cip8_jit_emit16(jit,v); cip8_jit_emit16(jit,v >> 16); }
+static void cip8_jit_emit64(Cip8Jit* jit, uint64_t v) { cip8_jit_emit32(jit,v); cip8_jit_emit32(jit,v >> 32); }
+static void cip8_jit_patch32(Cip8Jit* jit, size_t at, uint32_t v) { memcpy(jit->code + at,&v,sizeof(v)); }
+
+enum { JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+       JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13, JIT_R14, JIT_R15, JIT_MEM = -1 };
+// where V can live while a block runs, the callee saved ones first. the caller saved ones are
+// loaded again after every helper call, the others only when the op writes them
+static const int8_t cip8_jit_pins[] = {JIT_RBP,JIT_R12,JIT_R13,JIT_R8,JIT_R9,JIT_R10,JIT_R11,JIT_RSI,JIT_RDI};
+#define CIP8_JIT_PINS (sizeof(cip8_jit_pins) / sizeof(cip8_jit_pins[0]))
+#define CIP8_JIT_I_BIT (1u << 16) // I in the use and write masks, next to the 16 V
+
+#define JIT_BYTE 1 // 8 bit operands, spl..dil and r8b..r15b need a REX
+#define JIT_WORD 2 // 66 prefix
+#define JIT_WIDE 4 // REX.W
+#define JIT_0F   8 // two byte opcode
+// <op> reg, rm with rm a host register, or [rbx + disp32] when it is JIT_MEM. reg is the modrm
+// reg field, an opcode extension for the ops that take one
+static void cip8_jit_op(Cip8Jit* jit, unsigned flags, uint8_t opcode, int reg, int rm, size_t disp) {
+    uint8_t rex = 0x40 | (flags & JIT_WIDE ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+    if(flags & JIT_WORD) cip8_jit_emit8(jit,0x66);
+    if(rex != 0x40 || ((flags & JIT_BYTE) && (reg >= 4 || rm >= 4))) cip8_jit_emit8(jit,rex);
+    if(flags & JIT_0F) cip8_jit_emit8(jit,0x0F);
+    cip8_jit_emit8(jit,opcode);
+    if(rm == JIT_MEM) {
+        cip8_jit_emit8(jit,0x80 | (reg & 7) << 3 | JIT_RBX);
+        cip8_jit_emit32(jit,disp);
+    } else {
+        cip8_jit_emit8(jit,0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+}
+static void cip8_jit_jmp(Cip8Jit* jit, size_t to) {
+    cip8_jit_emit8(jit,0xE9);
+    cip8_jit_emit32(jit,to - (jit->used + 4));
+}
+#define JIT_JB  0x2
+#define JIT_JAE 0x3
+#define JIT_JE  0x4
+#define JIT_JNE 0x5
+#define JIT_JL  0xC
+// jcc rel32 to to, or a placeholder to patch when to is 0. returns the offset of the rel32
+static size_t cip8_jit_jcc(Cip8Jit* jit, uint8_t cc, size_t to) {
+    cip8_jit_emit8(jit,0x0F);
+    cip8_jit_emit8(jit,0x80 | cc);
+    size_t site = jit->used;
+    cip8_jit_emit32(jit,to ? to - (site + 4) : 0);
+    return site;
+}
+// points the rel32 at site to where code is emitted next
+static void cip8_jit_land(Cip8Jit* jit, size_t site) {
+    cip8_jit_patch32(jit,site,jit->used - (site + 4));
+}
+
+// enter(rdi = cip, rsi = block, rdx = budget) saves what the blocks use of the callee saved
+// registers and jumps into the block, every way out ends at exit with the budget left in r15
+static void cip8_jit_prologue(Cip8Jit* jit) {
+    static const uint8_t enter[] = {
+        0x53, 0x55, 0x41,0x54, 0x41,0x55, 0x41,0x56, 0x41,0x57, // push rbx, rbp, r12..r15
+        0x48,0x83,0xEC,0x08,                                   // sub rsp, 8: calls from blocks are aligned
+        0x48,0x89,0xFB,                                        // mov rbx, rdi
+        0x49,0x89,0xD7,                                        // mov r15, rdx
+        0xFF,0xE6,                                             // jmp rsi
+    };
+    static const uint8_t leave[] = {
+        0x4C,0x89,0xF8,                                        // mov rax, r15
+        0x48,0x83,0xC4,0x08,                                   // add rsp, 8
+        0x41,0x5F, 0x41,0x5E, 0x41,0x5D, 0x41,0x5C, 0x5D, 0x5B, // pop r15..r12, rbp, rbx
+        0xC3,                                                  // ret
+    };
+    for (size_t i = 0; i < sizeof(enter); i++) cip8_jit_emit8(jit,enter[i]);
+    jit->exit_none = jit->used;
+    cip8_jit_emit8(jit,0xBA); cip8_jit_emit32(jit,CIP8_JIT_NO_TAIL); // mov edx, no tail
+    jit->exit = jit->used;
+    for (size_t i = 0; i < sizeof(leave); i++) cip8_jit_emit8(jit,leave[i]);
+}
+
+#define V_OFF(x)  (offsetof(Cip8,regs.V) + (x))
+#define I_OFF     offsetof(Cip8,regs.I)
+#define IP_OFF    offsetof(Cip8,ip)
+#define KEYS_OFF  offsetof(Cip8,keys)
+#define DT_OFF    offsetof(Cip8,delay_timer)
+#define ST_OFF    offsetof(Cip8,sound_timer)
+
+// one block being translated
+typedef struct {
+    Cip8Jit* jit;
+    Addr pc;
+    int8_t host[16];   // register V is pinned in, JIT_MEM when it is used from cip
+    bool pin_i;        // I in r14
+    uint32_t dirty;    // pins (V bits and CIP8_JIT_I_BIT) written since they were last stored
+    bool live;         // code here runs with the pins loaded, false after a way out and inside a helper call
+    size_t body;       // past the entry's budget check and loads, where a loop on pc goes back to
+    size_t first;      // insts the entry's budget check is for
+    size_t label_count;
+    struct { size_t site; Addr target; uint32_t dirty; } labels[CIP8_JIT_MAX_BLOCK]; // skips, to the inst after the next
+    size_t short_count;
+    struct { size_t site; Addr ip; uint32_t dirty; } shorts[CIP8_JIT_MAX_BLOCK];     // budget checks that failed
+} Cip8JitState;
+
+static void cip8_jit_load_al(Cip8JitState* st, uint8_t x) {
+    cip8_jit_op(st->jit,JIT_BYTE,0x8A,JIT_RAX,st->host[x],V_OFF(x)); // mov al, Vx
+}
+static void cip8_jit_store_al(Cip8JitState* st, uint8_t x) {
+    cip8_jit_op(st->jit,JIT_BYTE,0x88,JIT_RAX,st->host[x],V_OFF(x)); // mov Vx, al
+}
+static int cip8_jit_i(Cip8JitState* st) {
+    return st->pin_i ? JIT_R14 : JIT_MEM;
+}
+// VF = carry (setc) or VF = !carry (setnc)
+static void cip8_jit_flag_from_carry(Cip8JitState* st, bool inverted) {
+    cip8_jit_emit8(st->jit,0x0F); cip8_jit_emit8(st->jit,inverted ? 0x93 : 0x92); cip8_jit_emit8(st->jit,0xC0);
+    cip8_jit_store_al(st,0xF);
+}
+static void cip8_jit_set_ip(Cip8Jit* jit, Addr ip) {
+    cip8_jit_op(jit,JIT_WORD,0xC7,0,JIT_MEM,IP_OFF); cip8_jit_emit16(jit,ip); // mov word [ip], imm16
+}
+// reads the pins in mask from cip
+static void cip8_jit_load_pins(Cip8JitState* st, uint32_t mask) {
+    for (size_t x = 0; x < 16; x++) {
+        if(st->host[x] != JIT_MEM && (mask >> x & 1)) cip8_jit_op(st->jit,JIT_BYTE,0x8A,st->host[x],JIT_MEM,V_OFF(x));
+    }
+    if(st->pin_i && (mask & CIP8_JIT_I_BIT)) cip8_jit_op(st->jit,JIT_WORD,0x8B,JIT_R14,JIT_MEM,I_OFF);
+    st->live = true;
+}
+// writes the pins in mask back to cip
+static void cip8_jit_store_pins(Cip8JitState* st, uint32_t mask) {
+    for (size_t x = 0; x < 16; x++) {
+        if(st->host[x] != JIT_MEM && (mask >> x & 1)) cip8_jit_op(st->jit,JIT_BYTE,0x88,st->host[x],JIT_MEM,V_OFF(x));
+    }
+    if(st->pin_i && (mask & CIP8_JIT_I_BIT)) cip8_jit_op(st->jit,JIT_WORD,0x89,JIT_R14,JIT_MEM,I_OFF);
+}
+
+// the next len insts run when the budget covers them, else ip = at and back to cip8_jit_run
+static void cip8_jit_budget(Cip8JitState* st, size_t len, Addr at) {
+    Cip8Jit* jit = st->jit;
+    cip8_jit_emit8(jit,0x49); cip8_jit_emit8(jit,0x81); cip8_jit_emit8(jit,0xFF); cip8_jit_emit32(jit,len); // cmp r15, len
+    st->shorts[st->short_count].site = cip8_jit_jcc(jit,JIT_JL,0);
+    st->shorts[st->short_count].dirty = st->dirty;
+    st->shorts[st->short_count++].ip = at;
+    cip8_jit_emit8(jit,0x49); cip8_jit_emit8(jit,0x83); cip8_jit_emit8(jit,0xEF); cip8_jit_emit8(jit,len); // sub r15, len
+}
+// leaves for cip8_jit_run with ip at ip (left alone when negative), tail the idle loop it is in
+static void cip8_jit_exit(Cip8JitState* st, int ip, Addr tail) {
+    Cip8Jit* jit = st->jit;
+    if(st->live) cip8_jit_store_pins(st,st->dirty);
+    st->live = false;
+    if(ip >= 0) cip8_jit_set_ip(jit,ip);
+    if(tail == CIP8_JIT_NO_TAIL) {
+        cip8_jit_jmp(jit,jit->exit_none);
+    } else {
+        cip8_jit_emit8(jit,0xBA); cip8_jit_emit32(jit,tail); // mov edx, tail
+        cip8_jit_jmp(jit,jit->exit);
+    }
+}
+// goes on at target: back to the top of this block, into target's block, or out through a jmp
+// that cip8_jit_compile points at target's block once there is one
+static void cip8_jit_chain(Cip8JitState* st, Addr target) {
+    Cip8Jit* jit = st->jit;
+    if(target == st->pc && st->live) {
+        // the top of the block expects every pin stored
+        cip8_jit_store_pins(st,st->dirty);
+        st->dirty = 0;
+        cip8_jit_budget(st,st->first,target);
+        cip8_jit_jmp(jit,st->body);
+        st->live = false;
+        return;
+    }
+    if(st->live) cip8_jit_store_pins(st,st->dirty);
+    st->live = false;
+    uint8_t* block = target < MEMORY_SIZE ? jit->block[target] : NULL;
+    // the jmp falls through to the way out while it is not linked, and again once the block it
+    // was linked to is dropped. one that finds the link table full always leaves
+    cip8_jit_emit8(jit,0xE9);
+    size_t site = jit->used;
+    cip8_jit_emit32(jit,0);
+    if(jit->link_count < CIP8_JIT_MAX_LINKS) {
+        jit->links[jit->link_count++] = (Cip8JitLink){site,target};
+        if(block) cip8_jit_patch32(jit,site,(size_t)(block - jit->code) - (site + 4));
+    }
+    cip8_jit_set_ip(jit,target);
+    cip8_jit_jmp(jit,jit->exit_none);
+}
+// after a ret or jmv0 put ip somewhere: into the block there, or back to cip8_jit_run
+static void cip8_jit_chain_ip(Cip8JitState* st) {
+    Cip8Jit* jit = st->jit;
+    cip8_jit_op(jit,JIT_0F,0xB7,JIT_RAX,JIT_MEM,IP_OFF);                         // movzx eax, word [ip]
+    cip8_jit_emit8(jit,0x3D); cip8_jit_emit32(jit,MEMORY_SIZE);                  // cmp eax, MEMORY_SIZE
+    cip8_jit_jcc(jit,JIT_JAE,jit->exit_none);
+    cip8_jit_emit8(jit,0x48); cip8_jit_emit8(jit,0xB9); cip8_jit_emit64(jit,(uint64_t)(uintptr_t)jit->block); // mov rcx, block
+    cip8_jit_emit8(jit,0x48); cip8_jit_emit8(jit,0x8B); cip8_jit_emit8(jit,0x04); cip8_jit_emit8(jit,0xC1); // mov rax, [rcx + rax * 8]
+    cip8_jit_emit8(jit,0x48); cip8_jit_emit8(jit,0x85); cip8_jit_emit8(jit,0xC0); // test rax, rax
+    cip8_jit_jcc(jit,JIT_JE,jit->exit_none);
+    cip8_jit_emit8(jit,0xFF); cip8_jit_emit8(jit,0xE0);                          // jmp rax
+}
+// runs inst through cip8_jit_helper with ip at next like the interpreter has it, the pins written
+// since they were last stored are stored first. the ones it may write have to be loaded again
+static void cip8_jit_call(Cip8JitState* st, Inst inst, Addr next) {
+    Cip8Jit* jit = st->jit;
+    cip8_jit_store_pins(st,st->dirty);
+    st->dirty = 0;
+    st->live = false;
+    cip8_jit_set_ip(jit,next);
+    uint32_t (*helper)(Cip8*,uint32_t,Cip8Jit*) = cip8_jit_helper;
+    uint32_t packed = cip8_quirk_flags(jit->quirks) << 16 | inst.oprand;
+    switch (inst.op) {
+        case OP_CLD:   helper = cip8_jit_helper_cld;     break;
+        case OP_RND:   helper = cip8_jit_helper_rnd;     break;
+        case OP_BCD:   helper = cip8_jit_helper_bcd;     break;
+        case SETISPR:  helper = cip8_jit_helper_setispr; break;
+        case OP_RET:   helper = cip8_jit_helper_ret;     break;
+        case OP_CALLS: helper = cip8_jit_helper_calls;   break;
+        case OP_GETK:  helper = cip8_jit_helper_getk;    break;
+        case OP_DRW:   helper = cip8_jit_helper_drw;     break;
+        case OP_DUMP:  helper = cip8_jit_helper_dump;    break;
+        case OP_LOAD:  helper = cip8_jit_helper_load;    break;
+        case OP_JMV0:  helper = cip8_jit_helper_jmv0;    break;
+        default:       packed = (uint32_t)inst.op << 16 | inst.oprand; break;
+    }
+    cip8_jit_emit8(jit,0x48); cip8_jit_emit8(jit,0x89); cip8_jit_emit8(jit,0xDF);           // mov rdi, rbx
+    cip8_jit_emit8(jit,0xBE); cip8_jit_emit32(jit,packed);                                  // mov esi, packed
+    cip8_jit_emit8(jit,0x48); cip8_jit_emit8(jit,0xBA); cip8_jit_emit64(jit,(uint64_t)(uintptr_t)jit);    // mov rdx, jit
+    cip8_jit_emit8(jit,0x48); cip8_jit_emit8(jit,0xB8); cip8_jit_emit64(jit,(uint64_t)(uintptr_t)helper); // mov rax, helper
+    cip8_jit_emit8(jit,0xFF); cip8_jit_emit8(jit,0xD0);                                     // call rax
+    cip8_jit_emit8(jit,0x85); cip8_jit_emit8(jit,0xC0);                                     // test eax, eax
+    cip8_jit_jcc(jit,JIT_JNE,jit->exit_none);
+}
+
+static bool cip8_jit_skips(Operation op) {
+    switch (op) {
+        case OP_JEQ: case OP_JNEQ: case OP_JVEQ: case OP_JVNEQ: case OP_KEYD: case OP_KEYU:
+            return true;
+        default: return false;
+    }
+}
+// nothing after these runs unless a skip right before jumped over them
+static bool cip8_jit_ends(Operation op) {
+    switch (op) {
+        case OP_GOTO: case OP_CALLS: case OP_RET: case OP_JMV0: case OP_GETK:
+            return true;
+        default: return false;
+    }
+}
+// the V (bit x) and I (CIP8_JIT_I_BIT) an inline op reads or writes, and the ones it writes.
+// false for ops that go through the helper
+static bool cip8_jit_uses(Inst inst, unsigned quirks, uint32_t* uses, uint32_t* writes) {
+    uint32_t x = 1u << (GET_X(inst.oprand)), y = 1u << (GET_Y(inst.oprand)), f = 1u << 0xF;
+    switch (inst.op) {
+        case OP_MOV: case OP_GETDT:              *uses = x;     *writes = x; break;
+        case OP_ADD:                             *uses = x;     *writes = x; break;
+        case OP_ASS: case OP_OR: case OP_AND: case OP_XOR:
+                                                 *uses = x | y; *writes = x; break;
+        case OP_ADDC: case OP_SUBC: case OP_SUBR: *uses = x | y | f; *writes = x | f; break;
+        case OP_SHR: case OP_SHL:
+            *uses = (quirks & CIP8_QUIRK_SHIFT_VY ? y : x) | x | f;
+            *writes = x | f;
+        break;
+        case OP_SETI:                            *uses = CIP8_JIT_I_BIT;     *writes = CIP8_JIT_I_BIT; break;
+        case OP_ADDI:                            *uses = x | CIP8_JIT_I_BIT; *writes = CIP8_JIT_I_BIT; break;
+        case OP_SETDT: case OP_SETST: case OP_JEQ: case OP_JNEQ: case OP_KEYD: case OP_KEYU:
+                                                 *uses = x;     *writes = 0; break;
+        case OP_JVEQ: case OP_JVNEQ:             *uses = x | y; *writes = 0; break;
+        default: return false;
+    }
+    return true;
+}
+// the pins in registers a call does not preserve
+static uint32_t cip8_jit_clobbered(Cip8JitState* st) {
+    uint32_t mask = 0;
+    for (size_t x = 0; x < 16; x++) {
+        int r = st->host[x];
+        if(r != JIT_MEM && r != JIT_RBP && r != JIT_R12 && r != JIT_R13) mask |= 1u << x;
+    }
+    return mask;
+}
+// the V and I a helper op may write
+static uint32_t cip8_jit_helper_writes(Inst inst, unsigned quirks) {
+    uint32_t i = quirks & (CIP8_QUIRK_LOAD_I | CIP8_QUIRK_LOAD_I_X) ? CIP8_JIT_I_BIT : 0;
+    switch (inst.op) {
+        case OP_RND:  return 1u << (GET_X(inst.oprand));
+        case OP_DRW:  return 1u << 0xF;
+        case OP_LOAD: return ((2u << (GET_X(inst.oprand))) - 1) | i;
+        case OP_BCD:  return 0;
+        case OP_DUMP: return i;
+        case SETISPR: return CIP8_JIT_I_BIT;
+        case OP_CLD:  return 0;
+        default:      return 0xFFFF | CIP8_JIT_I_BIT;
+    }
+}
+
+// emits native code for an inline op, skips branch to their label
+static void cip8_jit_emit_inline(Cip8JitState* st, Inst inst, unsigned quirks, Addr at) {
+    Cip8Jit* jit = st->jit;
+    uint8_t x  = GET_X(inst.oprand);
+    uint8_t y  = GET_Y(inst.oprand);
+    uint8_t nn = GET_NN(inst.oprand);
+    uint8_t cc = 0;
+    switch (inst.op)
+    {
+        case OP_MOV: cip8_jit_op(jit,JIT_BYTE,0xC6,0,st->host[x],V_OFF(x)); cip8_jit_emit8(jit,nn); break; // mov Vx, nn
+        case OP_ADD: cip8_jit_op(jit,JIT_BYTE,0x80,0,st->host[x],V_OFF(x)); cip8_jit_emit8(jit,nn); break; // add Vx, nn
+        case OP_ASS: cip8_jit_load_al(st,y); cip8_jit_store_al(st,x); break;
+        case OP_OR:  cip8_jit_load_al(st,y); cip8_jit_op(jit,JIT_BYTE,0x08,JIT_RAX,st->host[x],V_OFF(x)); break; // or  Vx, al
+        case OP_AND: cip8_jit_load_al(st,y); cip8_jit_op(jit,JIT_BYTE,0x20,JIT_RAX,st->host[x],V_OFF(x)); break; // and Vx, al
+        case OP_XOR: cip8_jit_load_al(st,y); cip8_jit_op(jit,JIT_BYTE,0x30,JIT_RAX,st->host[x],V_OFF(x)); break; // xor Vx, al
+        case OP_ADDC: // VF is written after Vx like the interpreter does
+            cip8_jit_load_al(st,x);
+            cip8_jit_op(jit,JIT_BYTE,0x02,JIT_RAX,st->host[y],V_OFF(y)); // add al, Vy
+            cip8_jit_store_al(st,x);
+            cip8_jit_flag_from_carry(st,false);
+        break;
+        case OP_SUBC:
+            cip8_jit_load_al(st,x);
+            cip8_jit_op(jit,JIT_BYTE,0x2A,JIT_RAX,st->host[y],V_OFF(y)); // sub al, Vy
+            cip8_jit_store_al(st,x);
+            cip8_jit_flag_from_carry(st,true);
+        break;
+        case OP_SUBR:
+            cip8_jit_load_al(st,y);
+            cip8_jit_op(jit,JIT_BYTE,0x2A,JIT_RAX,st->host[x],V_OFF(x)); // sub al, Vx
+            cip8_jit_store_al(st,x);
+            cip8_jit_flag_from_carry(st,true);
+        break;
+        case OP_SHR:
+        case OP_SHL:
+            cip8_jit_load_al(st,quirks & CIP8_QUIRK_SHIFT_VY ? y : x);
+            cip8_jit_emit8(jit,0xD0); cip8_jit_emit8(jit,inst.op == OP_SHR ? 0xE8 : 0xE0); // shr/shl al, 1
+            cip8_jit_store_al(st,x);
+            cip8_jit_flag_from_carry(st,false);
+        break;
+        case OP_SETI: cip8_jit_op(jit,JIT_WORD,0xC7,0,cip8_jit_i(st),I_OFF); cip8_jit_emit16(jit,inst.oprand); break; // mov I, nnn
+        case OP_ADDI:
+            cip8_jit_op(jit,JIT_BYTE | JIT_0F,0xB6,JIT_RAX,st->host[x],V_OFF(x)); // movzx eax, Vx
+            cip8_jit_op(jit,JIT_WORD,0x01,JIT_RAX,cip8_jit_i(st),I_OFF);         // add I, ax
+        break;
+        case OP_GETDT: cip8_jit_op(jit,JIT_BYTE,0x8A,JIT_RAX,JIT_MEM,DT_OFF); cip8_jit_store_al(st,x); break;
+        case OP_SETDT: cip8_jit_load_al(st,x); cip8_jit_op(jit,JIT_BYTE,0x88,JIT_RAX,JIT_MEM,DT_OFF); break;
+        case OP_SETST: cip8_jit_load_al(st,x); cip8_jit_op(jit,JIT_BYTE,0x88,JIT_RAX,JIT_MEM,ST_OFF); break;
+        case OP_JEQ:
+        case OP_JNEQ:
+            cip8_jit_op(jit,JIT_BYTE,0x80,7,st->host[x],V_OFF(x)); cip8_jit_emit8(jit,nn); // cmp Vx, nn
+            cc = inst.op == OP_JEQ ? JIT_JE : JIT_JNE;
+        break;
+        case OP_JVEQ:
+        case OP_JVNEQ:
+            cip8_jit_load_al(st,y);
+            cip8_jit_op(jit,JIT_BYTE,0x38,JIT_RAX,st->host[x],V_OFF(x)); // cmp Vx, al
+            cc = inst.op == OP_JVEQ ? JIT_JE : JIT_JNE;
+        break;
+        case OP_KEYD:
+        case OP_KEYU:
+            cip8_jit_op(jit,JIT_BYTE | JIT_0F,0xB6,JIT_RCX,st->host[x],V_OFF(x)); // movzx ecx, Vx
+            cip8_jit_emit8(jit,0x83); cip8_jit_emit8(jit,0xE1); cip8_jit_emit8(jit,0x0F); // and ecx, 15
+            cip8_jit_op(jit,JIT_0F,0xB7,JIT_RAX,JIT_MEM,KEYS_OFF);              // movzx eax, word [keys]
+            cip8_jit_emit8(jit,0x0F); cip8_jit_emit8(jit,0xA3); cip8_jit_emit8(jit,0xC8); // bt eax, ecx
+            cc = inst.op == OP_KEYD ? JIT_JB : JIT_JAE;
+        break;
+        default: break;
+    }
+    if(cc) {
+        st->labels[st->label_count].site = cip8_jit_jcc(jit,cc,0);
+        st->labels[st->label_count].dirty = st->dirty;
+        st->labels[st->label_count++].target = at + 4;
+    }
+}
+
+// points the skips to target here, the pins are loaded on every way in and dirty on any of them
+// is dirty from here
+static void cip8_jit_bind(Cip8JitState* st, Addr target) {
+    for (size_t l = 0; l < st->label_count; l++) {
+        if(st->labels[l].target == target && st->labels[l].site) {
+            cip8_jit_land(st->jit,st->labels[l].site);
+            st->labels[l].site = 0;
+            if(!st->live) st->dirty = 0;
+            st->dirty |= st->labels[l].dirty;
+            st->live = true;
+        }
+    }
+}
+
+// translates the code at pc, leaves it uncompiled when it would start with an undecodable op
+static void cip8_jit_compile(Cip8Jit* jit, Cip8* cip, Addr pc) {
+    // worst case per inst is a helper call with every pin written back and read again, plus a
+    // budget check that failed and a skip's way out, all with their own write backs
+    const size_t worst = CIP8_JIT_MAX_BLOCK * 448 + 256;
+    if(jit->used + worst > CIP8_JIT_CACHE_SIZE) {
+        cip8_jit_flush(jit);
+    }
+    unsigned quirks = cip8_quirk_flags(cip->quirks);
+
+    // what the block covers: straight on from pc, past a goto, call, ret, jmv0 or getk only when
+    // a skip right before it can jump over it
+    Inst insts[CIP8_JIT_MAX_BLOCK];
+    size_t n = 0;
+    Addr a = pc;
+    while(n < CIP8_JIT_MAX_BLOCK && a + 1 < MEMORY_SIZE) {
+        Inst inst = cip8_inst_at(cip,a);
+        if(inst.op == OP_INVALID || inst.op == OP_CALL) break;
+        if(n > 0 && cip8_jit_ends(insts[n - 1].op) && !(n > 1 && cip8_jit_skips(insts[n - 2].op))) break;
+        insts[n++] = inst;
+        a += 2;
+    }
+    if(n == 0) {
+        jit->hits[pc] = 0;
+        return;
+    }
+
+    Cip8JitState st = {.jit = jit, .pc = pc};
+    // straight runs: a new one after a skip or a helper op and at the inst a skip jumps to
+    bool starts[CIP8_JIT_MAX_BLOCK + 1];
+    uint8_t runs[CIP8_JIT_MAX_BLOCK];
+    unsigned count[17] = {0};
+    for (size_t i = 0; i < n; i++) {
+        uint32_t uses = 0, writes = 0;
+        bool inline_op = cip8_jit_uses(insts[i],quirks,&uses,&writes);
+        for (size_t r = 0; r < 17; r++) count[r] += uses >> r & 1;
+        starts[i + 1] = !inline_op || cip8_jit_skips(insts[i].op) || (i > 0 && cip8_jit_skips(insts[i - 1].op));
+    }
+    starts[0] = true;
+    for (size_t i = n; i-- > 0;) {
+        runs[i] = i + 1 < n && !starts[i + 1] ? runs[i + 1] + 1 : 1;
+    }
+    // the V used most get the pins, one used once is as cheap left in memory
+    for (size_t x = 0; x < 16; x++) st.host[x] = JIT_MEM;
+    for (size_t p = 0; p < CIP8_JIT_PINS; p++) {
+        int best = -1;
+        for (size_t x = 0; x < 16; x++) {
+            if(st.host[x] == JIT_MEM && count[x] >= 2 && (best < 0 || count[x] > count[best])) best = x;
+        }
+        if(best < 0) break;
+        st.host[best] = cip8_jit_pins[p];
+    }
+    st.pin_i = count[16] >= 2;
+    st.first = runs[0];
+
+    // too little budget at the entry leaves before anything is loaded
+    size_t bail = jit->used;
+    cip8_jit_set_ip(jit,pc);
+    cip8_jit_emit8(jit,0xBA); cip8_jit_emit32(jit,CIP8_JIT_SHORT); // mov edx, short
+    cip8_jit_jmp(jit,jit->exit);
+    size_t entry = jit->used;
+    cip8_jit_emit8(jit,0x49); cip8_jit_emit8(jit,0x81); cip8_jit_emit8(jit,0xFF); cip8_jit_emit32(jit,st.first); // cmp r15, first
+    cip8_jit_jcc(jit,JIT_JL,bail);
+    cip8_jit_load_pins(&st,0xFFFF | CIP8_JIT_I_BIT);
+    cip8_jit_emit8(jit,0x49); cip8_jit_emit8(jit,0x83); cip8_jit_emit8(jit,0xEF); cip8_jit_emit8(jit,st.first); // sub r15, first
+    st.body = jit->used;
+
+    for (size_t i = 0; i < n; i++) {
+        Inst inst = insts[i];
+        a = pc + 2 * i;
+        cip8_jit_bind(&st,a);
+        if(i > 0 && starts[i]) cip8_jit_budget(&st,runs[i],a);
+        uint32_t uses, writes;
+        if(cip8_jit_uses(inst,quirks,&uses,&writes)) {
+            cip8_jit_emit_inline(&st,inst,quirks,a);
+            st.dirty |= writes;
+            continue;
+        }
+        switch (inst.op) {
+            case OP_GOTO: {
+                Inst mark = inst;
+                cip8_idle_mark(cip,&mark,a);
+                if(GET_NNN(inst.oprand) == a && cip8_idle_enabled(cip)) {
+                    // a goto on itself runs out the budget, what cip8_idle_skip would count
+                    cip8_jit_emit8(jit,0x45); cip8_jit_emit8(jit,0x31); cip8_jit_emit8(jit,0xFF); // xor r15d, r15d
+                    cip8_jit_exit(&st,a,CIP8_JIT_NO_TAIL);
+                } else if(mark.idle && cip8_idle_enabled(cip)) {
+                    cip8_jit_exit(&st,GET_NNN(inst.oprand),a);
+                } else {
+                    cip8_jit_chain(&st,GET_NNN(inst.oprand));
+                }
+            } break;
+            case OP_CALLS:
+                cip8_jit_call(&st,inst,a + 2);
+                cip8_jit_chain(&st,GET_NNN(inst.oprand));
+            break;
+            case OP_RET:
+            case OP_JMV0:
+                cip8_jit_call(&st,inst,a + 2);
+                cip8_jit_chain_ip(&st);
+            break;
+            case OP_GETK: // waiting leaves ip on it, an idle loop of one
+                cip8_jit_call(&st,inst,a + 2);
+                cip8_jit_exit(&st,-1,a);
+            break;
+            default:
+                cip8_jit_call(&st,inst,a + 2);
+                cip8_jit_load_pins(&st,cip8_jit_helper_writes(inst,quirks) | cip8_jit_clobbered(&st));
+            break;
+        }
+    }
+    // the block ran off its end, or a skip jumps past it
+    a = pc + 2 * n;
+    if(!cip8_jit_ends(insts[n - 1].op)) {
+        cip8_jit_bind(&st,a);
+        cip8_jit_chain(&st,a);
+    }
+    for (size_t l = 0; l < st.label_count; l++) {
+        if(!st.labels[l].site) continue;
+        Addr target = st.labels[l].target;
+        cip8_jit_bind(&st,target);
+        cip8_jit_chain(&st,target);
+    }
+    // budget checks that failed, the pins are live at every one
+    for (size_t s = 0; s < st.short_count; s++) {
+        cip8_jit_land(jit,st.shorts[s].site);
+        st.live = true;
+        st.dirty = st.shorts[s].dirty;
+        cip8_jit_exit(&st,st.shorts[s].ip,CIP8_JIT_SHORT);
+    }
+
+    jit->block[pc] = jit->code + entry;
+    jit->len[pc] = n;
+    for (size_t i = 0; i < 2 * n; i++) jit->covered[pc + i] = true;
+    for (size_t l = 0; l < jit->link_count; l++) {
+        if(jit->links[l].target == pc) cip8_jit_patch32(jit,jit->links[l].site,entry - (jit->links[l].site + 4));
+    }
+}
+#undef V_OFF
+#undef I_OFF
+#undef IP_OFF
+#undef KEYS_OFF
+#undef DT_OFF
+#undef ST_OFF
+#endif
+
+// runs up to count instructions, through compiled blocks where it can and cip8_step elsewhere
+size_t cip8_jit_run(Cip8Jit* jit, Cip8* cip, size_t count) {
+    if(jit->failed) {
+        return cip8_run(cip,count);
+    }
+    // compiled blocks skip the step hooks, a traced, printed or profiled machine stays in the interpreter
+    if(cip8_observed(cip)) {
+        return cip8_run(cip,count);
+    }
+#if CIP8_JIT_SUPPORTED
+    if(jit->quirks != cip->quirks) {
+        cip8_jit_flush(jit);
+        jit->quirks = cip->quirks;
+    }
+    Cip8JitEnter enter = (Cip8JitEnter)(void*)jit->code;
+    bool idle = cip8_idle_enabled(cip);
+    size_t n = 0;
+    while(n < count && !cip->halted) {
+        if(cip->dirty_start != cip->dirty_end) {
+            cip8_jit_invalidate(jit,cip);
+        }
+        Addr pc = cip->ip;
+        uint8_t* block = pc < MEMORY_SIZE ? jit->block[pc] : NULL;
+        if(!block && pc < MEMORY_SIZE && !(pc & 1) && ++jit->hits[pc] >= CIP8_JIT_THRESHOLD) {
+            cip8_jit_compile(jit,cip,pc);
+            block = jit->block[pc];
+        }
+        if(!block) {
+            cip8_step(cip);
+            n++;
+            continue;
+        }
+        uint64_t budget = count - n < CIP8_JIT_MAX_BUDGET ? count - n : CIP8_JIT_MAX_BUDGET;
+        Cip8JitExit out = enter(cip,block,budget);
+        n += budget - out.left;
+        if(cip->halted) break;
+        if(out.tail == CIP8_JIT_SHORT) {
+            // fewer insts left than the next straight run, at most a block's worth. a dead entry
+            // leaves the same way with any budget, only a block's worth goes to the interpreter then
+            n += cip8_run(cip,count - n < CIP8_JIT_MAX_BLOCK ? count - n : CIP8_JIT_MAX_BLOCK);
+        } else if(out.tail != CIP8_JIT_NO_TAIL && idle) {
+            n += cip8_idle_skip(cip,out.tail,count - n);
+        }
+    }
+    return n;
+#else
+    return cip8_run(cip,count);
+#endif
+}
+
+#endif
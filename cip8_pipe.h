@@ -0,0 +1,98 @@
+#ifndef CIP8_PIPE_H_
+#define CIP8_PIPE_H_
+#include <stdatomic.h>
+#include "cip8.h"
+
+// the two hand-offs of the threaded front end, each lock free with exactly one producer and one consumer.
+// key events go from the input thread to the emulation thread through a ring, stamped with the host
+// time they happened so the emulation thread can apply each one at the instruction that time falls on.
+// finished frames go from the emulation thread to the render thread through a triple buffer: the
+// writer always has a buffer of its own to fill and the reader always gets the newest complete frame,
+// neither ever waits on the other. frames the reader is too slow for are dropped, never queued.
+
+#define CIP8_KEY_QUEUE_SIZE 256 // power of two
+
+typedef struct {
+    uint64_t time; // host clock, in whatever ticks the front end counts
+    uint8_t key;   // 0-15 for the keypad, the front end can use the rest
+    bool down;
+} Cip8KeyEvent;
+
+typedef struct {
+    Cip8KeyEvent events[CIP8_KEY_QUEUE_SIZE];
+    // own cache lines, or every push and pop would bounce the other side's index between cores
+    _Alignas(64) atomic_size_t head; // next slot to push, only the producer writes it
+    _Alignas(64) atomic_size_t tail; // next slot to pop, only the consumer writes it
+} Cip8KeyQueue;
+
+typedef struct {
+    uint64_t display[CIP8_DISPLAY_HEIGHT];
+    uint64_t frame; // scheduler frame it was taken at
+    uint64_t input; // time of the newest key event applied before it, 0 for none
+} Cip8Frame;
+
+#define CIP8_FRAME_FRESH 4u // in Cip8Frames.middle, published and not yet taken
+typedef struct {
+    Cip8Frame frames[3];
+    atomic_uint middle; // the buffer between the two sides, | CIP8_FRAME_FRESH
+    unsigned back;      // the writer's
+    unsigned front;     // the reader's
+} Cip8Frames;
+
+void cip8_key_queue_init(Cip8KeyQueue* q);
+bool cip8_key_queue_push(Cip8KeyQueue* q, Cip8KeyEvent event);
+bool cip8_key_queue_pop(Cip8KeyQueue* q, Cip8KeyEvent* event);
+void cip8_frames_init(Cip8Frames* f);
+Cip8Frame* cip8_frames_back(Cip8Frames* f);
+void cip8_frames_publish(Cip8Frames* f);
+const Cip8Frame* cip8_frames_take(Cip8Frames* f);
+
+
+void cip8_key_queue_init(Cip8KeyQueue* q) {
+    atomic_init(&q->head,0);
+    atomic_init(&q->tail,0);
+}
+// producer side, false when the queue is full
+bool cip8_key_queue_push(Cip8KeyQueue* q, Cip8KeyEvent event) {
+    size_t head = atomic_load_explicit(&q->head,memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail,memory_order_acquire);
+    if(head - tail == CIP8_KEY_QUEUE_SIZE) return false;
+    q->events[head & (CIP8_KEY_QUEUE_SIZE - 1)] = event;
+    atomic_store_explicit(&q->head,head + 1,memory_order_release);
+    return true;
+}
+// consumer side, false when the queue is empty
+bool cip8_key_queue_pop(Cip8KeyQueue* q, Cip8KeyEvent* event) {
+    size_t tail = atomic_load_explicit(&q->tail,memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head,memory_order_acquire);
+    if(head == tail) return false;
+    *event = q->events[tail & (CIP8_KEY_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->tail,tail + 1,memory_order_release);
+    return true;
+}
+
+void cip8_frames_init(Cip8Frames* f) {
+    memset(f->frames,0,sizeof(f->frames));
+    f->back = 0;
+    f->front = 1;
+    atomic_init(&f->middle,2);
+}
+// the writer's buffer, fill it and cip8_frames_publish it
+Cip8Frame* cip8_frames_back(Cip8Frames* f) {
+    return &f->frames[f->back];
+}
+// hands the back buffer over and takes the spare one in its place
+void cip8_frames_publish(Cip8Frames* f) {
+    unsigned old = atomic_exchange_explicit(&f->middle,f->back | CIP8_FRAME_FRESH,memory_order_acq_rel);
+    f->back = old & 3;
+}
+// the newest published frame, NULL when nothing was published since the last take.
+// it stays the reader's until the next take
+const Cip8Frame* cip8_frames_take(Cip8Frames* f) {
+    if(!(atomic_load_explicit(&f->middle,memory_order_relaxed) & CIP8_FRAME_FRESH)) return NULL;
+    unsigned old = atomic_exchange_explicit(&f->middle,f->front,memory_order_acq_rel);
+    f->front = old & 3;
+    return &f->frames[f->front];
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef CIP8_POOL_H_
+#define CIP8_POOL_H_
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// work stealing thread pool. every worker owns a deque, it pushes and pops its own tasks at the
+// tail and when it runs dry steals the oldest task from the head of another worker's deque.
+// tasks may submit more tasks from inside a worker, they land in that worker's deque.
+// the deques are guarded by a mutex each, contention only happens when someone steals.
+// a worker that finds nothing sleeps on a condvar until a submit, cip8_pool_wait sleeps on
+// another until the last task finishes, nobody spins while the pool is idle.
+
+typedef void (*Cip8TaskFn)(void* arg, size_t worker);
+
+typedef struct {
+    Cip8TaskFn fn;
+    void* arg;
+} Cip8Task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Cip8Task* tasks;
+    size_t head, tail, cap; // ring of cap entries, head is the oldest
+} Cip8Deque;
+
+typedef struct Cip8Pool {
+    Cip8Deque* deques;
+    pthread_t* threads;
+    size_t workers;
+    atomic_size_t pending; // submitted and not yet finished
+    atomic_size_t queued;  // submitted and not yet taken by a worker
+    atomic_bool stop;
+    pthread_mutex_t idle;  // taken to sleep on and to wake either condvar
+    pthread_cond_t work;   // a task was queued or the pool stops
+    pthread_cond_t done;   // pending went to 0
+} Cip8Pool;
+
+typedef struct {
+    Cip8Pool* pool;
+    size_t worker;
+} Cip8PoolWorker;
+
+void cip8_pool_init(Cip8Pool* pool, size_t workers);
+void cip8_pool_submit(Cip8Pool* pool, size_t worker, Cip8Task task);
+void cip8_pool_wait(Cip8Pool* pool);
+void cip8_pool_free(Cip8Pool* pool);
+size_t cip8_cpu_count(void);
+
+
+size_t cip8_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+static void cip8_deque_push(Cip8Deque* d, Cip8Task task) {
+    pthread_mutex_lock(&d->lock);
+    if(d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        Cip8Task* tasks = malloc(cap * sizeof(Cip8Task));
+        assert(tasks && "out of memory for pool tasks");
+        for (size_t i = d->head; i < d->tail; i++) tasks[i - d->head] = d->tasks[i % d->cap];
+        free(d->tasks);
+        d->tail -= d->head;
+        d->head = 0;
+        d->tasks = tasks;
+        d->cap = cap;
+    }
+    d->tasks[d->tail++ % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+}
+static bool cip8_deque_pop(Cip8Deque* d, Cip8Task* task, bool steal) {
+    bool ok = false;
+    pthread_mutex_lock(&d->lock);
+    if(d->tail > d->head) {
+        *task = steal ? d->tasks[d->head++ % d->cap] : d->tasks[--d->tail % d->cap];
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static void* cip8_pool_worker(void* arg) {
+    Cip8PoolWorker* self = arg;
+    Cip8Pool* pool = self->pool;
+    size_t me = self->worker;
+    free(self);
+
+    size_t victim = me;
+    while(!atomic_load(&pool->stop)) {
+        Cip8Task task;
+        bool found = cip8_deque_pop(&pool->deques[me],&task,false);
+        for (size_t i = 1; !found && i < pool->workers; i++) {
+            victim = (victim + 1) % pool->workers;
+            if(victim != me) found = cip8_deque_pop(&pool->deques[victim],&task,true);
+        }
+        if(!found) {
+            // queued is raised before a submit signals under the lock, checking it under the lock
+            // cannot miss a wake up
+            pthread_mutex_lock(&pool->idle);
+            while(atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stop)) {
+                pthread_cond_wait(&pool->work,&pool->idle);
+            }
+            pthread_mutex_unlock(&pool->idle);
+            continue;
+        }
+        atomic_fetch_sub(&pool->queued,1);
+        task.fn(task.arg,me);
+        if(atomic_fetch_sub(&pool->pending,1) == 1) {
+            pthread_mutex_lock(&pool->idle);
+            pthread_cond_broadcast(&pool->done);
+            pthread_mutex_unlock(&pool->idle);
+        }
+    }
+    return NULL;
+}
+
+void cip8_pool_init(Cip8Pool* pool, size_t workers) {
+    pool->workers = workers > 0 ? workers : cip8_cpu_count();
+    pool->deques  = calloc(pool->workers,sizeof(Cip8Deque));
+    pool->threads = calloc(pool->workers,sizeof(pthread_t));
+    assert(pool->deques && pool->threads && "out of memory for the pool");
+    atomic_init(&pool->pending,0);
+    atomic_init(&pool->queued,0);
+    atomic_init(&pool->stop,false);
+    pthread_mutex_init(&pool->idle,NULL);
+    pthread_cond_init(&pool->work,NULL);
+    pthread_cond_init(&pool->done,NULL);
+    for (size_t i = 0; i < pool->workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock,NULL);
+    }
+    for (size_t i = 0; i < pool->workers; i++) {
+        Cip8PoolWorker* w = malloc(sizeof(Cip8PoolWorker));
+        w->pool = pool;
+        w->worker = i;
+        pthread_create(&pool->threads[i],NULL,cip8_pool_worker,w);
+    }
+}
+// worker is the deque the task goes to, a task pass its own worker index to keep its children local
+void cip8_pool_submit(Cip8Pool* pool, size_t worker, Cip8Task task) {
+    atomic_fetch_add(&pool->pending,1);
+    atomic_fetch_add(&pool->queued,1);
+    cip8_deque_push(&pool->deques[worker % pool->workers],task);
+    pthread_mutex_lock(&pool->idle);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->idle);
+}
+// blocks until every submitted task, and everything they submitted, has finished
+void cip8_pool_wait(Cip8Pool* pool) {
+    pthread_mutex_lock(&pool->idle);
+    while(atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->done,&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->idle);
+}
+void cip8_pool_free(Cip8Pool* pool) {
+    pthread_mutex_lock(&pool->idle);
+    atomic_store(&pool->stop,true);
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->idle);
+    for (size_t i = 0; i < pool->workers; i++) {
+        pthread_join(pool->threads[i],NULL);
+    }
+    for (size_t i = 0; i < pool->workers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->idle);
+    free(pool->deques);
+    free(pool->threads);
+}
+
+#endif
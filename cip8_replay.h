@@ -0,0 +1,161 @@
+#ifndef CIP8_REPLAY_H_
+#define CIP8_REPLAY_H_
+#include "cip8.h"
+#include "cip8_sched.h"
+
+// input log: the OP_RND seed and a record per change of the keypad, the cycle it changed at and
+// every key held from then on. input and rng are all a run takes from outside, so playing a log
+// back over the same rom at the same ips gives the same machine, instruction for instruction.
+// on disk it is the magic, version, seed and count, then per record the cycles since the previous
+// one as a LEB128 varint and the 16 key bits, all little endian. a few bytes per key press.
+
+#define CIP8_INPUT_LOG_MAGIC "CIP8KEYS"
+#define CIP8_INPUT_LOG_VERSION 1
+
+typedef struct {
+    uint64_t cycle; // scheduler cycle the keys changed at
+    uint16_t keys;
+} Cip8InputRecord;
+
+typedef struct {
+    uint64_t seed;
+    Cip8InputRecord* records;
+    size_t count, cap;
+    size_t next; // the first record playback has not applied yet
+} Cip8InputLog;
+
+void cip8_input_log_init(Cip8InputLog* log, uint64_t seed);
+void cip8_input_log_free(Cip8InputLog* log);
+void cip8_input_log_record(Cip8InputLog* log, uint64_t cycle, uint16_t keys);
+bool cip8_input_log_save(const Cip8InputLog* log, const char* file_name);
+bool cip8_input_log_load(Cip8InputLog* log, const char* file_name);
+uint64_t cip8_replay_next(const Cip8InputLog* log);
+void cip8_replay_apply(Cip8InputLog* log, Cip8* cip, uint64_t cycle);
+bool cip8_replay_run_until(Cip8Sched* sched, Cip8InputLog* log, uint64_t cycle);
+
+
+void cip8_input_log_init(Cip8InputLog* log, uint64_t seed) {
+    log->seed = seed;
+    log->records = NULL;
+    log->count = log->cap = 0;
+    log->next = 0;
+}
+void cip8_input_log_free(Cip8InputLog* log) {
+    free(log->records);
+    log->records = NULL;
+    log->count = log->cap = 0;
+    log->next = 0;
+}
+// keys is the whole keypad after the change, records that change nothing are dropped
+void cip8_input_log_record(Cip8InputLog* log, uint64_t cycle, uint16_t keys) {
+    uint16_t last = log->count ? log->records[log->count - 1].keys : 0;
+    if(keys == last) return;
+    if(log->count && log->records[log->count - 1].cycle == cycle) {
+        log->records[log->count - 1].keys = keys; // two changes on one cycle only need the second
+        return;
+    }
+    if(log->count == log->cap) {
+        log->cap = log->cap ? log->cap * 2 : 256;
+        log->records = realloc(log->records,log->cap * sizeof(Cip8InputRecord));
+        assert(log->records && "out of memory for the input log");
+    }
+    log->records[log->count++] = (Cip8InputRecord){.cycle = cycle, .keys = keys};
+}
+
+static void cip8_put_le(FILE* f, uint64_t v, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) fputc((v >> (8 * i)) & 0xFF,f);
+}
+static bool cip8_get_le(FILE* f, uint64_t* v, size_t bytes) {
+    *v = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        int c = fgetc(f);
+        if(c == EOF) return false;
+        *v |= (uint64_t)c << (8 * i);
+    }
+    return true;
+}
+bool cip8_input_log_save(const Cip8InputLog* log, const char* file_name) {
+    FILE* f = fopen(file_name,"wb");
+    if(!f) {
+        printf("[ERROR]: Could not write %s\n",file_name);
+        return false;
+    }
+    fwrite(CIP8_INPUT_LOG_MAGIC,1,8,f);
+    cip8_put_le(f,CIP8_INPUT_LOG_VERSION,4);
+    cip8_put_le(f,log->seed,8);
+    cip8_put_le(f,log->count,8);
+    uint64_t cycle = 0;
+    for (size_t i = 0; i < log->count; i++) {
+        uint64_t delta = log->records[i].cycle - cycle;
+        cycle = log->records[i].cycle;
+        do {
+            fputc((delta & 0x7F) | (delta > 0x7F ? 0x80 : 0),f);
+            delta >>= 7;
+        } while(delta);
+        cip8_put_le(f,log->records[i].keys,2);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+// replaces whatever log held, playback starts from the first record
+bool cip8_input_log_load(Cip8InputLog* log, const char* file_name) {
+    FILE* f = fopen(file_name,"rb");
+    if(!f) {
+        printf("[ERROR]: Could not open %s\n",file_name);
+        return false;
+    }
+    char magic[8];
+    uint64_t version, seed, count;
+    if(fread(magic,1,8,f) != 8 || memcmp(magic,CIP8_INPUT_LOG_MAGIC,8) != 0 ||
+       !cip8_get_le(f,&version,4) || version != CIP8_INPUT_LOG_VERSION ||
+       !cip8_get_le(f,&seed,8) || !cip8_get_le(f,&count,8)) {
+        printf("[ERROR]: %s is not a version %d cip8 input log\n",file_name,CIP8_INPUT_LOG_VERSION);
+        fclose(f);
+        return false;
+    }
+    cip8_input_log_free(log);
+    cip8_input_log_init(log,seed);
+    uint64_t cycle = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t delta = 0, keys;
+        int c = 0;
+        for (size_t shift = 0; shift < 64; shift += 7) {
+            if((c = fgetc(f)) == EOF) break;
+            delta |= (uint64_t)(c & 0x7F) << shift;
+            if(!(c & 0x80)) break;
+        }
+        if(c == EOF || !cip8_get_le(f,&keys,2)) {
+            printf("[ERROR]: %s ends after %llu of its %llu records\n",file_name,
+                   (unsigned long long)i,(unsigned long long)count);
+            fclose(f);
+            return false;
+        }
+        cycle += delta;
+        cip8_input_log_record(log,cycle,keys);
+    }
+    fclose(f);
+    return true;
+}
+
+// cycle of the next record to play back, UINT64_MAX when there are none left
+uint64_t cip8_replay_next(const Cip8InputLog* log) {
+    return log->next < log->count ? log->records[log->next].cycle : UINT64_MAX;
+}
+// sets the keys of every record up to cycle, the machine should be at cycle already
+void cip8_replay_apply(Cip8InputLog* log, Cip8* cip, uint64_t cycle) {
+    while(log->next < log->count && log->records[log->next].cycle <= cycle) {
+        cip->keys = log->records[log->next++].keys;
+    }
+}
+// cip8_sched_run_until with the keys changing at the cycles they were recorded at
+bool cip8_replay_run_until(Cip8Sched* sched, Cip8InputLog* log, uint64_t cycle) {
+    for (;;) {
+        uint64_t stop = cip8_replay_next(log) < cycle ? cip8_replay_next(log) : cycle;
+        if(!cip8_sched_run_until(sched,stop)) return false;
+        cip8_replay_apply(log,sched->cip,stop);
+        if(stop == cycle) return true;
+    }
+}
+
+#endif
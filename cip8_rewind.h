@@ -0,0 +1,149 @@
+#ifndef CIP8_REWIND_H_
+#define CIP8_REWIND_H_
+#include "cip8.h"
+
+// rewind buffer: a snapshot per frame in a ring. every CIP8_REWIND_KEY_INTERVAL frames one is a
+// keyframe, the frames after it only keep their xor against it. a frame barely changes anything
+// so the xor is nearly all zeros and gets run length encoded, a frame is a few hundred bytes.
+// going back decodes the keyframe and one delta, there is no chain to walk.
+// when the ring is full the oldest keyframe goes together with every frame that needs it.
+
+#define CIP8_REWIND_KEY_INTERVAL 120
+#define CIP8_REWIND_BUF_SIZE (2 * sizeof(Cip8Snapshot) + 16) // worst case encoding of a snapshot
+
+typedef struct {
+    uint8_t* data;  // encoded xor against the keyframe, against zeros for a keyframe
+    uint32_t size;
+    bool key;
+} Cip8RewindFrame;
+
+typedef struct {
+    Cip8RewindFrame* frames; // ring of capacity frames, tail is the oldest
+    size_t capacity;
+    size_t tail;
+    size_t count;
+    size_t bytes;            // encoded bytes held
+
+    Cip8Snapshot key;        // the newest keyframe decoded, new deltas are taken against it
+    size_t since_key;        // frames pushed since it
+    Cip8Snapshot scratch;
+    uint8_t buf[CIP8_REWIND_BUF_SIZE];
+} Cip8Rewind;
+
+void cip8_rewind_init(Cip8Rewind* rw, size_t capacity);
+void cip8_rewind_free(Cip8Rewind* rw);
+void cip8_rewind_push(Cip8Rewind* rw, const Cip8* cip);
+bool cip8_rewind_back(Cip8Rewind* rw, size_t frames, Cip8* cip);
+
+
+// zero runs and literal runs, each up to 255 long: [zeros][literals][literal bytes...]
+static size_t cip8_rle_encode(const uint8_t* in, size_t n, uint8_t* out) {
+    size_t o = 0, i = 0;
+    while(i < n) {
+        size_t zeros = 0, lit = 0;
+        while(i < n && in[i] == 0 && zeros < 255) {
+            zeros++;
+            i++;
+        }
+        while(i + lit < n && in[i + lit] != 0 && lit < 255) lit++;
+        out[o++] = zeros;
+        out[o++] = lit;
+        memcpy(out + o,in + i,lit);
+        o += lit;
+        i += lit;
+    }
+    return o;
+}
+// xors the decoded bytes onto out, so decoding a delta onto its keyframe gives back the frame
+static void cip8_rle_xor(const uint8_t* in, size_t n, uint8_t* out) {
+    size_t o = 0;
+    for (size_t i = 0; i + 1 < n;) {
+        o += in[i];
+        size_t lit = in[i + 1];
+        i += 2;
+        for (size_t j = 0; j < lit; j++) out[o + j] ^= in[i + j];
+        o += lit;
+        i += lit;
+    }
+}
+
+void cip8_rewind_init(Cip8Rewind* rw, size_t capacity) {
+    assert(capacity > CIP8_REWIND_KEY_INTERVAL && "rewind buffer shorter than a keyframe interval");
+    rw->frames = calloc(capacity,sizeof(Cip8RewindFrame));
+    assert(rw->frames && "out of memory for the rewind buffer");
+    rw->capacity = capacity;
+    rw->tail = 0;
+    rw->count = 0;
+    rw->bytes = 0;
+    rw->since_key = 0;
+}
+void cip8_rewind_free(Cip8Rewind* rw) {
+    for (size_t i = 0; i < rw->count; i++) free(rw->frames[(rw->tail + i) % rw->capacity].data);
+    free(rw->frames);
+    rw->frames = NULL;
+    rw->count = 0;
+}
+static void cip8_rewind_drop(Cip8Rewind* rw, Cip8RewindFrame* frame) {
+    rw->bytes -= frame->size;
+    free(frame->data);
+    frame->data = NULL;
+    frame->size = 0;
+}
+
+// call once per frame
+void cip8_rewind_push(Cip8Rewind* rw, const Cip8* cip) {
+    if(rw->count == rw->capacity) {
+        do {
+            cip8_rewind_drop(rw,&rw->frames[rw->tail]);
+            rw->tail = (rw->tail + 1) % rw->capacity;
+            rw->count--;
+        } while(rw->count > 0 && !rw->frames[rw->tail].key);
+    }
+
+    bool key = rw->since_key == 0;
+    uint8_t* snap = (uint8_t*)&rw->scratch;
+    cip8_snapshot(cip,&rw->scratch);
+    if(key) {
+        rw->key = rw->scratch;
+    } else {
+        const uint8_t* base = (const uint8_t*)&rw->key;
+        for (size_t i = 0; i < sizeof(Cip8Snapshot); i++) snap[i] ^= base[i];
+    }
+    size_t size = cip8_rle_encode(snap,sizeof(Cip8Snapshot),rw->buf);
+
+    Cip8RewindFrame* frame = &rw->frames[(rw->tail + rw->count) % rw->capacity];
+    frame->data = malloc(size);
+    assert(frame->data && "out of memory for a rewind frame");
+    memcpy(frame->data,rw->buf,size);
+    frame->size = size;
+    frame->key = key;
+    rw->count++;
+    rw->bytes += size;
+    rw->since_key = (rw->since_key + 1) % CIP8_REWIND_KEY_INTERVAL;
+}
+
+// throws away the newest frames and restores cip to the one before them, pushing goes on from
+// there. false when there is nothing to go back to
+bool cip8_rewind_back(Cip8Rewind* rw, size_t frames, Cip8* cip) {
+    if(rw->count == 0) return false;
+    if(frames > rw->count - 1) frames = rw->count - 1;
+    for (size_t i = 0; i < frames; i++) {
+        rw->count--;
+        cip8_rewind_drop(rw,&rw->frames[(rw->tail + rw->count) % rw->capacity]);
+    }
+
+    size_t newest = rw->count - 1;
+    size_t k = newest;
+    while(!rw->frames[(rw->tail + k) % rw->capacity].key) k--;
+    const Cip8RewindFrame* key = &rw->frames[(rw->tail + k) % rw->capacity];
+    const Cip8RewindFrame* frame = &rw->frames[(rw->tail + newest) % rw->capacity];
+
+    memset(&rw->key,0,sizeof(Cip8Snapshot));
+    cip8_rle_xor(key->data,key->size,(uint8_t*)&rw->key);
+    rw->scratch = rw->key;
+    if(frame != key) cip8_rle_xor(frame->data,frame->size,(uint8_t*)&rw->scratch);
+    rw->since_key = (newest - k + 1) % CIP8_REWIND_KEY_INTERVAL;
+    return cip8_restore(cip,&rw->scratch);
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef CIP8_SCHED_H_
+#define CIP8_SCHED_H_
+#include "cip8.h"
+
+// emulated time is counted in executed instructions (cycles). events are kept in a small
+// queue ordered by the cycle they are due at, and everything between two events runs as one
+// cip8_run batch. a timer tick k is due at k * ips / 60 so the 60 Hz never drifts, frames the same with fps.
+
+#define CIP8_DEFAULT_IPS 700
+#define CIP8_TIMER_HZ 60
+#define CIP8_MAX_EVENTS 8
+
+typedef enum {
+    CIP8_EVENT_TIMER,   // delay and sound timers count down
+    CIP8_EVENT_FRAME,   // time to present the display
+    CIP8_EVENT_HALTED,  // not queued, returned when the machine stopped in a batch
+} Cip8EventKind;
+
+typedef struct {
+    uint64_t at;
+    Cip8EventKind kind;
+} Cip8Event;
+
+typedef struct {
+    Cip8* cip;
+    uint64_t cycle;      // instructions executed since cip8_sched_init
+    uint32_t ips;        // emulated instructions per second
+    uint32_t fps;
+    uint64_t timer_ticks;
+    uint64_t frames;
+
+    Cip8Event queue[CIP8_MAX_EVENTS]; // sorted, queue[0] is the next one
+    size_t queue_count;
+} Cip8Sched;
+
+void cip8_sched_init(Cip8Sched* sched, Cip8* cip, uint32_t ips, uint32_t fps);
+void cip8_sched_push(Cip8Sched* sched, Cip8Event event);
+Cip8EventKind cip8_sched_next(Cip8Sched* sched);
+Cip8EventKind cip8_sched_run_frame(Cip8Sched* sched);
+bool cip8_sched_run_until(Cip8Sched* sched, uint64_t cycle);
+void cip8_tick_timers(Cip8* cip);
+
+
+void cip8_sched_init(Cip8Sched* sched, Cip8* cip, uint32_t ips, uint32_t fps) {
+    sched->cip = cip;
+    sched->cycle = 0;
+    sched->ips = ips > 0 ? ips : CIP8_DEFAULT_IPS;
+    sched->fps = fps > 0 ? fps : CIP8_TIMER_HZ;
+    sched->timer_ticks = 0;
+    sched->frames = 0;
+    sched->queue_count = 0;
+
+    cip8_sched_push(sched,(Cip8Event){.at = (uint64_t)sched->ips / CIP8_TIMER_HZ, .kind = CIP8_EVENT_TIMER});
+    cip8_sched_push(sched,(Cip8Event){.at = (uint64_t)sched->ips / sched->fps,   .kind = CIP8_EVENT_FRAME});
+}
+
+// insertion into the sorted queue, there are only ever a handful of events.
+// events due at the same cycle keep the order they were pushed in
+void cip8_sched_push(Cip8Sched* sched, Cip8Event event) {
+    assert(sched->queue_count < CIP8_MAX_EVENTS && "too many scheduled events");
+    size_t i = sched->queue_count++;
+    while(i > 0 && sched->queue[i - 1].at > event.at) {
+        sched->queue[i] = sched->queue[i - 1];
+        i--;
+    }
+    sched->queue[i] = event;
+}
+
+void cip8_tick_timers(Cip8* cip) {
+    if(cip->delay_timer > 0) cip->delay_timer--;
+    if(cip->sound_timer > 0) cip->sound_timer--;
+}
+
+// runs the machine up to the next event, handles it and says which one it was
+Cip8EventKind cip8_sched_next(Cip8Sched* sched) {
+    Cip8Event event = sched->queue[0];
+    for (size_t i = 1; i < sched->queue_count; i++) {
+        sched->queue[i - 1] = sched->queue[i];
+    }
+    sched->queue_count--;
+
+    if(event.at > sched->cycle) {
+        uint64_t want = event.at - sched->cycle;
+        uint64_t ran = cip8_run(sched->cip,want);
+        sched->cycle += ran;
+        if(ran < want) {
+            cip8_sched_push(sched,event); // still due, the machine just can't get there
+            return CIP8_EVENT_HALTED;
+        }
+    }
+
+    switch (event.kind)
+    {
+        case CIP8_EVENT_TIMER:
+            cip8_tick_timers(sched->cip);
+            sched->timer_ticks++;
+            event.at = (sched->timer_ticks + 1) * sched->ips / CIP8_TIMER_HZ;
+            cip8_sched_push(sched,event);
+        break;
+        case CIP8_EVENT_FRAME:
+            sched->frames++;
+            event.at = (sched->frames + 1) * sched->ips / sched->fps;
+            cip8_sched_push(sched,event);
+        break;
+        default: break;
+    }
+    return event.kind;
+}
+
+// everything up to and including the next frame event
+Cip8EventKind cip8_sched_run_frame(Cip8Sched* sched) {
+    Cip8EventKind kind;
+    do {
+        kind = cip8_sched_next(sched);
+    } while(kind != CIP8_EVENT_FRAME && kind != CIP8_EVENT_HALTED);
+    return kind;
+}
+
+// handles every event due up to cycle and runs the machine to exactly that cycle,
+// false when it halted on the way
+bool cip8_sched_run_until(Cip8Sched* sched, uint64_t cycle) {
+    while(sched->queue[0].at <= cycle) {
+        if(cip8_sched_next(sched) == CIP8_EVENT_HALTED) return false;
+    }
+    if(cycle > sched->cycle) {
+        uint64_t want = cycle - sched->cycle;
+        uint64_t ran = cip8_run(sched->cip,want);
+        sched->cycle += ran;
+        if(ran < want) return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef CIP8_SOA_H_
+#define CIP8_SOA_H_
+#include "cip8.h"
+#include "cip8_sched.h"
+
+// lockstep engine for many copies of one rom. the registers of CIP8_LANES machines are kept as
+// structure of arrays (V[x] of every lane next to each other), so when lanes sit on the same
+// address one decoded inst runs over all of them as plain loops the compiler turns into SIMD
+// (build with -O3 -march=native for AVX2/AVX-512). memory, display and the stack stay in a
+// Cip8 per lane, sharing the pages of the rom image until it writes them. ops that need them
+// and lanes that went their own way run through cip8_step with the registers copied out and back.
+//
+// every step picks the lane that is furthest behind and runs everything sitting at its address,
+// so lanes that split on a skip meet again at the join and go back to running together.
+// the lanes run the quirk profile of the image, its kernels are picked once per inst.
+
+#ifndef CIP8_LANES
+#define CIP8_LANES 32
+#endif
+
+typedef struct {
+    uint8_t  V[16][CIP8_LANES];
+    Addr     I[CIP8_LANES];
+    Addr     ip[CIP8_LANES];
+    Addr     sp[CIP8_LANES];
+    Timer    delay_timer[CIP8_LANES];
+    Timer    sound_timer[CIP8_LANES];
+    uint16_t keys[CIP8_LANES]; // bit per key held down
+    uint8_t  waiting_release[CIP8_LANES];
+
+    size_t count;            // lanes in use, the rest are masked off
+    Cip8* body[CIP8_LANES];  // memory, display and stack of each lane
+    const Cip8* image;       // the rom as loaded, its decoded table is what runs in lockstep
+    unsigned quirks;         // CIP8_QUIRK_* flags of the image's profile
+    uint64_t code_diverged[MEMORY_SIZE / 2 / 64]; // bit per word some lane rewrote into another inst
+
+    uint32_t ips;
+    uint64_t cycle;
+    uint64_t timer_ticks;
+    uint64_t vector_steps, scalar_steps; // instructions run per lane in lockstep and on their own
+    uint64_t executed[CIP8_LANES];       // instructions each lane ran, a halted lane stops counting at its last
+} Cip8Lanes;
+
+void cip8_lanes_init(Cip8Lanes* lanes, size_t count, const Cip8* image, uint32_t ips);
+void cip8_lanes_free(Cip8Lanes* lanes);
+void cip8_lanes_set_key(Cip8Lanes* lanes, size_t lane, uint8_t key, bool down);
+void cip8_lanes_set_quirks(Cip8Lanes* lanes, Cip8Quirks quirks);
+void cip8_lanes_tick_timers(Cip8Lanes* lanes);
+Cip8* cip8_lanes_sync(Cip8Lanes* lanes, size_t lane);
+size_t cip8_lanes_run(Cip8Lanes* lanes, size_t count);
+void cip8_lanes_run_until(Cip8Lanes* lanes, uint64_t cycle);
+
+
+// image is a loaded rom (cip8_cache_get) the lanes share, it has to outlive them
+void cip8_lanes_init(Cip8Lanes* lanes, size_t count, const Cip8* image, uint32_t ips) {
+    assert(count <= CIP8_LANES && "more lanes than CIP8_LANES");
+    memset(lanes,0,sizeof(*lanes));
+    lanes->count = count;
+    lanes->ips = ips > 0 ? ips : CIP8_DEFAULT_IPS;
+
+    lanes->image = image;
+    lanes->quirks = cip8_quirk_flags(image->quirks);
+
+    for (size_t l = 0; l < count; l++) {
+        lanes->body[l] = malloc(sizeof(Cip8));
+        assert(lanes->body[l] && "out of memory for a lane");
+        cip8_init_shared(lanes->body[l],lanes->image);
+        lanes->ip[l] = image->ip;
+        lanes->sp[l] = image->sp;
+        lanes->I[l]  = image->regs.I;
+        for (size_t x = 0; x < 16; x++) lanes->V[x][l] = image->regs.V[x];
+    }
+}
+void cip8_lanes_free(Cip8Lanes* lanes) {
+    for (size_t l = 0; l < lanes->count; l++) {
+        cip8_free(lanes->body[l]);
+        free(lanes->body[l]);
+    }
+}
+void cip8_lanes_set_key(Cip8Lanes* lanes, size_t lane, uint8_t key, bool down) {
+    uint16_t bit = 1u << (key & 0xF);
+    lanes->keys[lane] = down ? lanes->keys[lane] | bit : lanes->keys[lane] & ~bit;
+    cip8_set_key(lanes->body[lane],key,down);
+}
+// every lane runs another profile than the image's, before the lanes run
+void cip8_lanes_set_quirks(Cip8Lanes* lanes, Cip8Quirks quirks) {
+    lanes->quirks = cip8_quirk_flags(quirks);
+    for (size_t l = 0; l < lanes->count; l++) lanes->body[l]->quirks = quirks;
+}
+void cip8_lanes_tick_timers(Cip8Lanes* lanes) {
+    for (size_t l = 0; l < CIP8_LANES; l++) {
+        lanes->delay_timer[l] -= lanes->delay_timer[l] > 0;
+        lanes->sound_timer[l] -= lanes->sound_timer[l] > 0;
+    }
+}
+
+static inline void cip8_lanes_store(Cip8Lanes* lanes, size_t l) {
+    Cip8* cip = lanes->body[l];
+    for (size_t x = 0; x < 16; x++) cip->regs.V[x] = lanes->V[x][l];
+    cip->regs.I = lanes->I[l];
+    cip->ip = lanes->ip[l];
+    cip->sp = lanes->sp[l];
+    cip->delay_timer = lanes->delay_timer[l];
+    cip->sound_timer = lanes->sound_timer[l];
+    cip->waiting_release = lanes->waiting_release[l];
+}
+static inline void cip8_lanes_load(Cip8Lanes* lanes, size_t l) {
+    Cip8* cip = lanes->body[l];
+    for (size_t x = 0; x < 16; x++) lanes->V[x][l] = cip->regs.V[x];
+    lanes->I[l] = cip->regs.I;
+    lanes->ip[l] = cip->ip;
+    lanes->sp[l] = cip->sp;
+    lanes->delay_timer[l] = cip->delay_timer;
+    lanes->sound_timer[l] = cip->sound_timer;
+    lanes->waiting_release[l] = cip->waiting_release;
+}
+// the body of a lane with its registers written back, for hashing or inspecting it
+Cip8* cip8_lanes_sync(Cip8Lanes* lanes, size_t lane) {
+    cip8_lanes_store(lanes,lane);
+    return lanes->body[lane];
+}
+
+// runs lane l on its own Cip8 for up to limit instructions, stopping early once it reaches an
+// address in meet (another lane is waiting there). a word it rewrote to something other than
+// what the image holds takes that word out of lockstep for every lane
+static size_t cip8_lanes_run_alone(Cip8Lanes* lanes, size_t l, size_t limit, const uint64_t* meet) {
+    Cip8* cip = lanes->body[l];
+    cip8_lanes_store(lanes,l);
+    size_t n = 0;
+    do {
+        cip8_step(cip);
+        n++;
+    } while(n < limit && !cip->halted && !(meet && ((meet[cip->ip / 64 % 64] >> (cip->ip % 64)) & 1)));
+    cip8_lanes_load(lanes,l);
+    if(cip->dirty_start != cip->dirty_end) {
+        for (size_t a = cip->dirty_start & ~1; a < cip->dirty_end; a += 2) {
+            if(cip8_read16(cip,a) != cip8_read16(lanes->image,a)) {
+                lanes->code_diverged[a / 128] |= 1ull << (a / 2 % 64);
+            }
+        }
+        cip->dirty_start = cip->dirty_end = 0;
+    }
+    return n;
+}
+
+// m8/m16 are 0xFF../0 per lane, every kernel blends its result in under them
+#define CIP8_LANES_FOR(l) for (size_t l = 0; l < CIP8_LANES; l++)
+#define CIP8_BLEND(m,old,new) (((old) & ~(m)) | ((new) & (m)))
+
+// the ops that only touch registers, ip and timers. false when inst has to go through cip8_step
+static bool cip8_lanes_step_vector(Cip8Lanes* lanes, Inst inst, const uint8_t* m8, const uint16_t* m16) {
+    uint8_t (*V)[CIP8_LANES] = lanes->V;
+    uint8_t x = GET_X(inst.oprand);
+    uint8_t y = GET_Y(inst.oprand);
+    uint8_t nn = GET_NN(inst.oprand);
+    uint16_t nnn = inst.oprand;
+
+// ALU ops read vx and vy before writing anything, then write VX and after it VF, like the handlers
+#define CIP8_LANES_ALU(result,flag)                                 \
+    CIP8_LANES_FOR(l) {                                             \
+        uint8_t vx = V[x][l], vy = V[y][l];                         \
+        uint8_t r = (result), f = (flag);                           \
+        (void)vy; (void)f;                                          \
+        V[x][l] = CIP8_BLEND(m8[l],vx,r);                           \
+        V[0xF][l] = CIP8_BLEND(m8[l],V[0xF][l],f);                  \
+    }
+#define CIP8_LANES_SKIP(cond)                                       \
+    CIP8_LANES_FOR(l) {                                             \
+        uint8_t vx = V[x][l], vy = V[y][l];                         \
+        (void)vy;                                                   \
+        uint16_t c = -(uint16_t)(cond);                             \
+        lanes->ip[l] += m16[l] & c & 2;                             \
+    }
+
+    switch (inst.op)
+    {
+        case OP_MOV: CIP8_LANES_FOR(l) V[x][l] = CIP8_BLEND(m8[l],V[x][l],nn);                  break;
+        case OP_ADD: CIP8_LANES_FOR(l) V[x][l] = CIP8_BLEND(m8[l],V[x][l],(uint8_t)(V[x][l] + nn)); break;
+        case OP_ASS: CIP8_LANES_FOR(l) V[x][l] = CIP8_BLEND(m8[l],V[x][l],V[y][l]);             break;
+        case OP_OR:  CIP8_LANES_FOR(l) V[x][l] = CIP8_BLEND(m8[l],V[x][l],V[x][l] | V[y][l]);   break;
+        case OP_AND: CIP8_LANES_FOR(l) V[x][l] = CIP8_BLEND(m8[l],V[x][l],V[x][l] & V[y][l]);   break;
+        case OP_XOR: CIP8_LANES_FOR(l) V[x][l] = CIP8_BLEND(m8[l],V[x][l],V[x][l] ^ V[y][l]);   break;
+        case OP_ADDC: CIP8_LANES_ALU(vx + vy, (vx + vy) > 0xFF) break;
+        case OP_SUBC: CIP8_LANES_ALU(vx - vy, vx >= vy)         break;
+        case OP_SUBR: CIP8_LANES_ALU(vy - vx, vy >= vx)         break;
+        case OP_SHR:
+            if(lanes->quirks & CIP8_QUIRK_SHIFT_VY) CIP8_LANES_ALU(vy >> 1, vy & 1)
+            else                                    CIP8_LANES_ALU(vx >> 1, vx & 1)
+        break;
+        case OP_SHL:
+            if(lanes->quirks & CIP8_QUIRK_SHIFT_VY) CIP8_LANES_ALU(vy << 1, vy >> 7)
+            else                                    CIP8_LANES_ALU(vx << 1, vx >> 7)
+        break;
+
+        case OP_JEQ:   CIP8_LANES_SKIP(vx == nn) break;
+        case OP_JNEQ:  CIP8_LANES_SKIP(vx != nn) break;
+        case OP_JVEQ:  CIP8_LANES_SKIP(vx == vy) break;
+        case OP_JVNEQ: CIP8_LANES_SKIP(vx != vy) break;
+        case OP_KEYD:  CIP8_LANES_SKIP((lanes->keys[l] >> (vx & 0xF)) & 1)   break;
+        case OP_KEYU:  CIP8_LANES_SKIP(!((lanes->keys[l] >> (vx & 0xF)) & 1)) break;
+
+        case OP_GOTO: CIP8_LANES_FOR(l) lanes->ip[l] = CIP8_BLEND(m16[l],lanes->ip[l],nnn);                     break;
+        case OP_JMV0: {
+            uint8_t j = lanes->quirks & CIP8_QUIRK_JUMP_VX ? x : 0;
+            CIP8_LANES_FOR(l) lanes->ip[l] = CIP8_BLEND(m16[l],lanes->ip[l],(Addr)(V[j][l] + nnn));
+        } break;
+        case OP_SETI: CIP8_LANES_FOR(l) lanes->I[l]  = CIP8_BLEND(m16[l],lanes->I[l],nnn);                      break;
+        case OP_ADDI: CIP8_LANES_FOR(l) lanes->I[l]  = CIP8_BLEND(m16[l],lanes->I[l],(Addr)(lanes->I[l] + V[x][l])); break;
+
+        case OP_GETDT: CIP8_LANES_FOR(l) V[x][l] = CIP8_BLEND(m8[l],V[x][l],lanes->delay_timer[l]);                  break;
+        case OP_SETDT: CIP8_LANES_FOR(l) lanes->delay_timer[l] = CIP8_BLEND(m8[l],lanes->delay_timer[l],V[x][l]);    break;
+        case OP_SETST: CIP8_LANES_FOR(l) lanes->sound_timer[l] = CIP8_BLEND(m8[l],lanes->sound_timer[l],V[x][l]);    break;
+        case OP_GETK:
+            // cip8_op_getk: the lowest key down goes to VX, ip only moves on once it is let go
+            CIP8_LANES_FOR(l) {
+                uint8_t vx = V[x][l], wait = lanes->waiting_release[l];
+                uint16_t low = lanes->keys[l] & -lanes->keys[l];
+                uint8_t key = ((low & 0xAAAA) != 0) | ((low & 0xCCCC) != 0) << 1 | ((low & 0xF0F0) != 0) << 2 | ((low & 0xFF00) != 0) << 3;
+                if(low) {
+                    vx = key;
+                    wait = 1;
+                }
+                bool down = (lanes->keys[l] >> (vx & 0xF)) & 1;
+                uint16_t stay = -(uint16_t)(down || !wait);
+                V[x][l] = CIP8_BLEND(m8[l],V[x][l],vx);
+                lanes->waiting_release[l] = CIP8_BLEND(m8[l],lanes->waiting_release[l],wait);
+                lanes->ip[l] -= m16[l] & stay & 2;
+            }
+        break;
+        default: return false;
+    }
+#undef CIP8_LANES_ALU
+#undef CIP8_LANES_SKIP
+    return true;
+}
+
+// runs count instructions on every lane, returns how many ran over all lanes
+size_t cip8_lanes_run(Cip8Lanes* lanes, size_t count) {
+    uint32_t remaining[CIP8_LANES];
+    uint8_t m8[CIP8_LANES];
+    uint16_t m16[CIP8_LANES];
+    uint64_t meet[MEMORY_SIZE / 64];
+    CIP8_LANES_FOR(l) {
+        remaining[l] = l < lanes->count && !lanes->body[l]->halted ? count : 0;
+    }
+
+    size_t total = 0;
+    for (;;) {
+        // furthest behind goes first, on a tie the lowest address so a lane that skipped waits
+        // for the one that did not at the join. one max over a packed key keeps it branch free
+        uint64_t best = 0;
+        CIP8_LANES_FOR(l) {
+            uint64_t key = (uint64_t)remaining[l] << 16 | (uint16_t)~lanes->ip[l];
+            best = key > best ? key : best;
+        }
+        if((best >> 16) == 0) break;
+
+        Addr ip = (uint16_t)~best;
+        size_t active = 0;
+        CIP8_LANES_FOR(l) {
+            bool on = lanes->ip[l] == ip && remaining[l] > 0;
+            m8[l] = -(uint8_t)on;
+            m16[l] = -(uint16_t)on;
+            active += on;
+        }
+
+        // a lane on its own would pay for the whole width every instruction, it runs by itself
+        // until it gets to where another lane is
+        if(active == 1) {
+            size_t lead = 0;
+            while(!m8[lead]) lead++;
+            memset(meet,0,sizeof(meet));
+            for (size_t l = 0; l < lanes->count; l++) {
+                if(l != lead && remaining[l] > 0) meet[lanes->ip[l] / 64 % 64] |= 1ull << (lanes->ip[l] % 64);
+            }
+            size_t n = cip8_lanes_run_alone(lanes,lead,remaining[lead],meet);
+            remaining[lead] = lanes->body[lead]->halted ? 0 : remaining[lead] - n;
+            lanes->executed[lead] += n;
+            lanes->scalar_steps += n;
+            total += n;
+            continue;
+        }
+        CIP8_LANES_FOR(l) {
+            remaining[l] -= m8[l] & 1;
+            lanes->executed[l] += m8[l] & 1;
+        }
+        total += active;
+
+        // odd addresses are not in the table and rewritten code differs between lanes
+        bool shared = !(ip & 1) && ip < MEMORY_SIZE && !((lanes->code_diverged[ip / 128] >> (ip / 2 % 64)) & 1);
+        if(shared) {
+            Inst inst = cip8_inst_peek(lanes->image,ip);
+            CIP8_LANES_FOR(l) lanes->ip[l] += m16[l] & 2;
+            if(cip8_lanes_step_vector(lanes,inst,m8,m16)) {
+                lanes->vector_steps += active;
+                continue;
+            }
+            CIP8_LANES_FOR(l) lanes->ip[l] -= m16[l] & 2;
+        }
+        for (size_t l = 0; l < lanes->count; l++) {
+            if(m8[l]) {
+                cip8_lanes_run_alone(lanes,l,1,NULL);
+                if(lanes->body[l]->halted) remaining[l] = 0;
+            }
+        }
+        lanes->scalar_steps += active;
+    }
+    return total;
+}
+
+// cip8_sched_run_until for lanes: the 60 Hz timers tick at the same cycles the scheduler ticks them
+void cip8_lanes_run_until(Cip8Lanes* lanes, uint64_t cycle) {
+    for (;;) {
+        uint64_t tick = (lanes->timer_ticks + 1) * lanes->ips / CIP8_TIMER_HZ;
+        uint64_t to = tick <= cycle ? tick : cycle;
+        if(to > lanes->cycle) {
+            cip8_lanes_run(lanes,to - lanes->cycle);
+            lanes->cycle = to;
+        }
+        if(tick > cycle) break;
+        cip8_lanes_tick_timers(lanes);
+        lanes->timer_ticks++;
+    }
+}
+
+#undef CIP8_LANES_FOR
+#undef CIP8_BLEND
+
+#endif
@@ -0,0 +1,109 @@
+// cip8-explore: breadth first search over every keypad input a rom can see, for finding the input
+// that gets a test into code plain runs never reach.
+//
+//   $ gcc -O2 explore.c -o cip8-explore -lpthread
+//   $ ./cip8-explore [-j threads] [-d depth] [-m states] [-s ips] [-q profile] rom.ch8
+//
+// each level forks every state at its next OP_KEYD/OP_KEYU/OP_GETK on the inputs that matter there
+// (cip8_explore.h), over -j workers. it stops after -d levels, at -m distinct states or when no
+// input leads anywhere new, then prints the distinct states explored per second and which
+// addresses of the rom any path ran an instruction from.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define CIP8_NO_SDL
+#include "cip8.h"
+#include "cip8_sched.h"
+#include "cip8_explore.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,"usage: %s [-j threads] [-d depth] [-m states] [-s ips] [-q profile] rom.ch8\n",name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    size_t threads = 0;
+    size_t max_depth = 1000;
+    size_t max_states = 100000;
+    uint32_t ips = CIP8_DEFAULT_IPS;
+    const char* rom = NULL;
+    Cip8Quirks quirks = CIP8_QUIRKS_LEGACY;
+    for (int i = 1; i < argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            switch (argv[i][1]) {
+                case 'j': threads    = strtoull(argv[++i],NULL,10); break;
+                case 'd': max_depth  = strtoull(argv[++i],NULL,10); break;
+                case 'm': max_states = strtoull(argv[++i],NULL,10); break;
+                case 's': ips        = strtoul(argv[++i],NULL,10);  break;
+                case 'q': if(!cip8_quirks_from_name(argv[++i],&quirks)) usage(argv[0]); break;
+                default: usage(argv[0]);
+            }
+        } else {
+            rom = argv[i];
+        }
+    }
+    if(!rom || max_states == 0) usage(argv[0]);
+
+    static Cip8 image;
+    cip8_init(&image);
+    if(!cip8_load_file(&image,rom)) return 1;
+    image.quirks = quirks;
+    size_t rom_size = 0;
+    for (size_t a = PROGRAM_START; a < MEMORY_SIZE; a++) {
+        if(cip8_read(&image,a)) rom_size = a + 1 - PROGRAM_START;
+    }
+
+    static Cip8Explorer ex;
+    double start = now_seconds();
+    cip8_explore_init(&ex,&image,ips,max_states,threads);
+    uint64_t states = ex.frontier_count;
+    while(ex.frontier_count > 0 && ex.depth < max_depth) {
+        size_t found = cip8_explore_level(&ex);
+        states += found;
+        printf("depth %4zu  %8zu new states  %10llu total\n",ex.depth,found,(unsigned long long)states);
+        fflush(stdout);
+    }
+    double seconds = now_seconds() - start;
+
+    const char* why = ex.frontier_count == 0 ? "no new states" : "depth limit";
+    if(atomic_load(&ex.seen.count) >= max_states) why = "state limit";
+    printf("[INFO]: %llu distinct states, %zu levels (%s), %llu paths ended, %llu instructions in %.3f s on %zu threads\n",
+           (unsigned long long)states,ex.depth,why,(unsigned long long)cip8_explore_ends(&ex),
+           (unsigned long long)cip8_explore_instructions(&ex),seconds,ex.pool.workers);
+    printf("[INFO]: %.0f states/sec\n",seconds > 0 ? states / seconds : 0.0);
+
+    // coverage of the rom's own addresses, the font and anything a path jumped out into is listed too
+    uint64_t pcs[MEMORY_SIZE / 64];
+    size_t covered = cip8_explore_coverage(&ex,pcs);
+    size_t in_rom = 0;
+    for (size_t a = PROGRAM_START; a < PROGRAM_START + rom_size; a++) in_rom += (pcs[a / 64] >> (a % 64)) & 1;
+    printf("[INFO]: ran insts from %zu addresses, %zu of the %zu in the rom (%.1f%% of its words)\n",
+           covered,in_rom,(rom_size + 1) / 2,rom_size ? 100.0 * in_rom / ((rom_size + 1) / 2) : 0.0);
+    printf("covered:");
+    for (size_t a = 0; a < MEMORY_SIZE;) {
+        if(!((pcs[a / 64] >> (a % 64)) & 1)) {
+            a++;
+            continue;
+        }
+        size_t end = a;
+        // insts are two bytes apart, a run of them is one range
+        while(end + 2 < MEMORY_SIZE && ((pcs[(end + 2) / 64] >> ((end + 2) % 64)) & 1)) end += 2;
+        if(end == a) printf(" 0x%03zX",a); else printf(" 0x%03zX-0x%03zX",a,end);
+        a = end + 1;
+    }
+    printf("\n");
+
+    cip8_explore_free(&ex);
+    cip8_free(&image);
+    return 0;
+}
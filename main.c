@@ -3,8 +3,15 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <SDL2/SDL.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <time.h>
+#endif
 
 #include "cip8.h"
+#include "cip8_sched.h"
+#include "cip8_rewind.h"
+#include "cip8_pipe.h"
+#include "cip8_replay.h"
 
 #define PRO_SIZE 7
 
@@ -12,155 +19,375 @@
 #define RENDER_SDL 1
 #define RENDER_TERMINAL 0
 #define FPS 60.f
+#define IPS CIP8_DEFAULT_IPS
+#define UNTHROTTLED 0 // run as fast as the host allows instead of at IPS
+#define VSYNC 0       // let SDL_RenderPresent wait for the display instead of sleeping
+#define REWIND_FRAMES (60 * 60 * 5) // five minutes at 60 fps, hold backspace to go back
+
 
+// sleeps until the next frame is due on the performance counter, and keeps track of how far
+// the frames actually landed from where they should have (jitter)
+typedef struct {
+    Uint64 freq;
+    Uint64 period;   // counter ticks per frame
+    Uint64 next;     // when the next frame is due
+    Uint64 last;     // when the last frame ended
+    bool vsync;
 
-bool limit_fps(int fps,Uint32 end,double* dt) {
-    Uint32 start = SDL_GetTicks();
-    *dt = start - end; 
-    // *dt /= 1000;
-    return *dt <= (1/(double)fps);
+    size_t frames;
+    double jitter_sum_ms;
+    double jitter_max_ms;
+} FramePacer;
+
+void frame_pacer_init(FramePacer* pacer,double fps,bool vsync) {
+    pacer->freq   = SDL_GetPerformanceFrequency();
+    pacer->period = pacer->freq / fps;
+    pacer->last   = SDL_GetPerformanceCounter();
+    pacer->next   = pacer->last + pacer->period;
+    pacer->vsync  = vsync;
+    pacer->frames = 0;
+    pacer->jitter_sum_ms = 0;
+    pacer->jitter_max_ms = 0;
 }
+// ticks of a counter running at freq
+static void sleep_ticks(Uint64 ticks,Uint64 freq) {
+#if defined(__unix__) || defined(__APPLE__)
+    Uint64 ns = ticks * 1000000000ull / freq;
+    struct timespec ts = {.tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull};
+    while(nanosleep(&ts,&ts) == -1) {} // restart with what is left after a signal
+#else
+    SDL_Delay(ticks * 1000 / freq);
+#endif
+}
+// call once per frame after presenting
+void frame_pacer_wait(FramePacer* pacer) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    if(!pacer->vsync && now < pacer->next) {
+        sleep_ticks(pacer->next - now,pacer->freq);
+        now = SDL_GetPerformanceCounter();
+    }
 
+    double frame_ms = (double)(now - pacer->last) * 1000 / pacer->freq;
+    double jitter_ms = SDL_fabs(frame_ms - (double)pacer->period * 1000 / pacer->freq);
+    pacer->jitter_sum_ms += jitter_ms;
+    if(jitter_ms > pacer->jitter_max_ms) pacer->jitter_max_ms = jitter_ms;
+    pacer->frames++;
+    pacer->last = now;
 
-void renderer_sdl(Cip8* cip) {
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_Event event;
-    SDL_Renderer* renderer;
+    pacer->next += pacer->period;
+    if(now > pacer->next) {
+        pacer->next = now + pacer->period; // fell more than a frame behind, don't try to catch up
+    }
+}
+void frame_pacer_report(const FramePacer* pacer) {
+    if(pacer->frames == 0) return;
+    fprintf(stderr,"[INFO]: %zu frames, jitter avg %.3f ms, max %.3f ms\n",
+            pacer->frames,pacer->jitter_sum_ms / pacer->frames,pacer->jitter_max_ms);
+}
+
+
+// keypad 0-9 and A-F on the keyboard, -1 for anything else
+static int key_from_scancode(SDL_Scancode code) {
+    switch (code) {
+        case SDL_SCANCODE_KP_0: return 0;
+        case SDL_SCANCODE_KP_1: return 1;
+        case SDL_SCANCODE_KP_2: return 2;
+        case SDL_SCANCODE_KP_3: return 3;
+        case SDL_SCANCODE_KP_4: return 4;
+        case SDL_SCANCODE_KP_5: return 5;
+        case SDL_SCANCODE_KP_6: return 6;
+        case SDL_SCANCODE_KP_7: return 7;
+        case SDL_SCANCODE_KP_8: return 8;
+        case SDL_SCANCODE_KP_9: return 9;
+        case SDL_SCANCODE_A:    return 10;
+        case SDL_SCANCODE_B:    return 11;
+        case SDL_SCANCODE_C:    return 12;
+        case SDL_SCANCODE_D:    return 13;
+        case SDL_SCANCODE_E:    return 14;
+        case SDL_SCANCODE_F:    return 15;
+        default: return -1;
+    }
+}
+
+// the sdl front end runs on three threads. the main thread only waits for SDL events (SDL wants
+// them pumped where the window was made) and stamps every key with the performance counter into
+// a Cip8KeyQueue. the emulation thread keeps the machine at IPS against that same counter and
+// applies each key at the instruction its time falls on, and hands every changed display to the
+// render thread through a Cip8Frames. the render thread owns the renderer and is the only one
+// that waits on the display, so a slow present or vsync never holds back the emulation
+#define KEY_REWIND 16 // backspace, in the key queue next to the keypad
+
+typedef struct {
+    Cip8* cip;
+    Cip8KeyQueue keys;
+    Cip8Frames frames;
+    SDL_sem* frame_ready;  // posted on every publish so the render thread can sleep without vsync
     SDL_Window* window;
+    atomic_bool quit;
+    Uint64 freq;
 
-    window = SDL_CreateWindow("Cip8 Emulator",SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED,64 * 10,32*10,0);
-    renderer = SDL_CreateRenderer(window,0,0);
-    
-    SDL_Surface* display_surface = SDL_CreateRGBSurface(0,64,32,32,0,0,0,0);
-    SDL_Texture* display_texture = SDL_CreateTextureFromSurface(renderer,display_surface);
+    // emulation thread only
+    Cip8Sched sched;
+    Cip8Rewind rewind;
+    uint64_t input;        // time of the newest key event applied
+    Cip8InputLog* record;  // gets every change of the keypad, NULL when not recording
+    Cip8InputLog* replay;  // where the keypad comes from instead of the keyboard, NULL for live input
+} Frontend;
 
-    bool done = false; 
-    SDL_Rect rect = (SDL_Rect){.x = 0,.y = 0, .w = 64 * 10, .h = 32 * 10};
-    Uint32 end = SDL_GetTicks();
-    double dt = 0;  
-    while (!done) {
+static void emulation_publish(Frontend* fe) {
+    Cip8* cip = fe->cip;
+    if(!cip->display_changed) return;
+    cip->display_changed = false;
+    Cip8Frame* frame = cip8_frames_back(&fe->frames);
+    memcpy(frame->display,cip->display,sizeof(frame->display));
+    frame->frame = fe->sched.frames;
+    frame->input = fe->input;
+    cip8_frames_publish(&fe->frames);
+    SDL_SemPost(fe->frame_ready);
+}
+// runs to cycle, every frame on the way is saved for rewinding and goes to the render thread
+static bool emulation_run_until(Frontend* fe,uint64_t cycle) {
+    for (;;) {
+        // replayed keys change at the cycle they were recorded at
+        uint64_t stop = fe->replay ? SDL_min(cycle,cip8_replay_next(fe->replay)) : cycle;
+        while(fe->sched.queue[0].at <= stop) {
+            Cip8EventKind kind = cip8_sched_next(&fe->sched);
+            if(kind == CIP8_EVENT_HALTED) return false;
+            if(kind == CIP8_EVENT_FRAME) {
+                cip8_rewind_push(&fe->rewind,fe->cip);
+                emulation_publish(fe);
+            }
+        }
+        if(!cip8_sched_run_until(&fe->sched,stop)) return false;
+        if(fe->replay) cip8_replay_apply(fe->replay,fe->cip,stop);
+        if(stop == cycle) return true;
+    }
+}
+static int emulation_thread(void* data) {
+    Frontend* fe = data;
+    Cip8* cip = fe->cip;
+    Uint64 freq = fe->freq;
+    // never sleep for less than a millisecond, at a high IPS that would be every instruction
+    Uint64 step = SDL_max(freq / IPS,freq / 1000);
+    Uint64 origin = SDL_GetPerformanceCounter(); // host time of cycle 0
+    Uint64 rewind_next = 0;
+    bool rewinding = false;
+    cip8_rewind_push(&fe->rewind,cip);
+    emulation_publish(fe);
 
-       while(SDL_PollEvent(&event)) {
-            if(event.type == SDL_QUIT) {
-                done = true;
+    while(!atomic_load(&fe->quit)) {
+        // keys only change between cip8_run calls (the idle loop skipping counts on it), so the
+        // machine is run up to each key's cycle first and the key applied in between
+        Cip8KeyEvent event;
+        while(cip8_key_queue_pop(&fe->keys,&event)) {
+            if(!rewinding && !UNTHROTTLED && event.time > origin &&
+               !emulation_run_until(fe,(event.time - origin) * IPS / freq)) {
+                goto halted;
             }
-            if(event.type == SDL_KEYDOWN) {
-                if(event.key.keysym.scancode == SDL_SCANCODE_ESCAPE) {
-                    done = true;
-                }
-
-                switch (event.key.keysym.scancode) {
-                    case SDL_SCANCODE_KP_0:cip->keyboard[0] = 1;  break;
-                    case SDL_SCANCODE_KP_1:cip->keyboard[1] = 1;  break;
-                    case SDL_SCANCODE_KP_2:cip->keyboard[2] = 1;  break;
-                    case SDL_SCANCODE_KP_3:cip->keyboard[3] = 1;  break;
-                    case SDL_SCANCODE_KP_4:cip->keyboard[4] = 1;  break;
-                    case SDL_SCANCODE_KP_5:cip->keyboard[5] = 1;  break;
-                    case SDL_SCANCODE_KP_6:cip->keyboard[6] = 1;  break;
-                    case SDL_SCANCODE_KP_7:cip->keyboard[7] = 1;  break;
-                    case SDL_SCANCODE_KP_8:cip->keyboard[8] = 1;  break;
-                    case SDL_SCANCODE_KP_9:cip->keyboard[9] = 1;  break;
-                    case SDL_SCANCODE_A:cip->keyboard[10] =   1; break;
-                    case SDL_SCANCODE_B:cip->keyboard[11] =   1; break;
-                    case SDL_SCANCODE_C:cip->keyboard[12] =   1; break;
-                    case SDL_SCANCODE_D:cip->keyboard[13] =   1; break;
-                    case SDL_SCANCODE_E:cip->keyboard[14] =   1; break;
-                    case SDL_SCANCODE_F:cip->keyboard[15] =   1; break;
-                    default: break;
-                }
+            fe->input = event.time;
+            // a log can not say the machine went back, and replayed runs take no keys at all
+            if(fe->record || fe->replay) {
+                if(event.key == KEY_REWIND || fe->replay) continue;
             }
-            if(event.type == SDL_KEYUP) {
-                switch (event.key.keysym.scancode) {
-                    case SDL_SCANCODE_KP_0:cip->keyboard[0] = 0;  break;
-                    case SDL_SCANCODE_KP_1:cip->keyboard[1] = 0;  break;
-                    case SDL_SCANCODE_KP_2:cip->keyboard[2] = 0;  break;
-                    case SDL_SCANCODE_KP_3:cip->keyboard[3] = 0;  break;
-                    case SDL_SCANCODE_KP_4:cip->keyboard[4] = 0;  break;
-                    case SDL_SCANCODE_KP_5:cip->keyboard[5] = 0;  break;
-                    case SDL_SCANCODE_KP_6:cip->keyboard[6] = 0;  break;
-                    case SDL_SCANCODE_KP_7:cip->keyboard[7] = 0;  break;
-                    case SDL_SCANCODE_KP_8:cip->keyboard[8] = 0;  break;
-                    case SDL_SCANCODE_KP_9:cip->keyboard[9] = 0;  break;
-                    case SDL_SCANCODE_A:cip->keyboard[10] =   0; break;
-                    case SDL_SCANCODE_B:cip->keyboard[11] =   0; break;
-                    case SDL_SCANCODE_C:cip->keyboard[12] =   0; break;
-                    case SDL_SCANCODE_D:cip->keyboard[13] =   0; break;
-                    case SDL_SCANCODE_E:cip->keyboard[14] =   0; break;
-                    case SDL_SCANCODE_F:cip->keyboard[15] =   0; break;
-                    default: break;
-                }
+            if(event.key == KEY_REWIND) {
+                if(event.down && !rewinding) rewind_next = event.time;
+                // emulated time picks up where the rewinding left it
+                if(!event.down && rewinding) origin = event.time - fe->sched.cycle * freq / IPS;
+                rewinding = event.down;
+            } else {
+                cip8_set_key(cip,event.key,event.down);
+                if(fe->record) cip8_input_log_record(fe->record,fe->sched.cycle,cip->keys);
             }
+        }
 
-        }         
-        if(limit_fps(FPS,end,&dt)) {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if(rewinding) {
+            // a frame back every frame, the keys are the ones under the fingers, not the saved ones
+            while(rewind_next <= now) {
+                uint16_t held = cip->keys;
+                cip8_rewind_back(&fe->rewind,1,cip);
+                cip->keys = held;
+                rewind_next += freq / FPS;
+            }
+            emulation_publish(fe);
+        } else if(UNTHROTTLED) {
+            if(cip8_sched_run_frame(&fe->sched) == CIP8_EVENT_HALTED) goto halted;
+            cip8_rewind_push(&fe->rewind,cip);
+            emulation_publish(fe);
             continue;
+        } else if(!emulation_run_until(fe,(now - origin) * IPS / freq)) {
+            goto halted;
         }
-        end = SDL_GetTicks();
-        // printf("%f\n",dt);
+        sleep_ticks(step,freq);
+    }
+    return 0;
+halted:
+    if(cip->trap) printf("[ERROR]: %s at 0x%03X\n",cip8_trap_name(cip->trap),cip->ip);
+    emulation_publish(fe);
+    atomic_store(&fe->quit,true);
+    return 0;
+}
 
- 
+static int render_thread(void* data) {
+    Frontend* fe = data;
+    // a renderer is only ever used on the thread that made it
+    SDL_Renderer* renderer = SDL_CreateRenderer(fe->window,-1,VSYNC ? SDL_RENDERER_PRESENTVSYNC : 0);
+    SDL_Texture* display_texture = SDL_CreateTexture(renderer,SDL_PIXELFORMAT_ARGB8888,SDL_TEXTUREACCESS_STREAMING,64,32);
+    SDL_Rect rect = (SDL_Rect){.x = 0,.y = 0, .w = 64 * 10, .h = 32 * 10};
 
-        cip8_step(cip);
-        if(cip->delay_timer > 0) {
-            cip->delay_timer -= dt;
-            cip->delay_timer = SDL_max(cip->delay_timer,0);
-        }
-        if(cip->halted) {
-            done = true;
-        }        
-
-        if(cip->display_changed) {
-            cip8_sdl_from_mem_to_texture(*cip,display_surface,display_texture);
-            SDL_RenderCopyEx(renderer,display_texture,0,&rect,0,0,0);
-            cip->display_changed = false;
-            SDL_RenderPresent(renderer);
+    uint64_t shown[CIP8_DISPLAY_HEIGHT] = {0};
+    uint32_t dirty_rows = 0xFFFFFFFF;
+    uint64_t input = 0;
+    size_t presents = 0, latencies = 0;
+    double latency_sum_ms = 0, latency_max_ms = 0;
+    while(!atomic_load(&fe->quit)) {
+        // with vsync the present is what waits, so it has to happen every refresh
+        if(!VSYNC) SDL_SemWaitTimeout(fe->frame_ready,100);
+        const Cip8Frame* frame = cip8_frames_take(&fe->frames);
+        if(!frame && !VSYNC) continue;
+        if(frame) {
+            // frames in between may have been dropped, so the rows to upload come from the last one shown
+            for (size_t y = 0; y < CIP8_DISPLAY_HEIGHT; y++) {
+                if(frame->display[y] != shown[y]) dirty_rows |= 1u << y;
+            }
+            cip8_sdl_stream_rows(frame->display,dirty_rows,display_texture);
+            memcpy(shown,frame->display,sizeof(shown));
+            dirty_rows = 0;
         }
+        SDL_RenderCopyEx(renderer,display_texture,0,&rect,0,0,0);
+        SDL_RenderPresent(renderer);
+        presents++;
 
+        // from a key being stamped to the first present of a frame made after it
+        if(frame && frame->input != input) {
+            input = frame->input;
+            double ms = (double)(SDL_GetPerformanceCounter() - input) * 1000 / fe->freq;
+            latency_sum_ms += ms;
+            if(ms > latency_max_ms) latency_max_ms = ms;
+            latencies++;
+        }
     }
+    if(latencies) {
+        fprintf(stderr,"[INFO]: %zu presents, input to present avg %.3f ms, max %.3f ms\n",
+                presents,latency_sum_ms / latencies,latency_max_ms);
+    }
+    SDL_DestroyTexture(display_texture);
     SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
+    return 0;
+}
+
+void renderer_sdl(Cip8* cip,Cip8InputLog* record,Cip8InputLog* replay) {
+    SDL_Init(SDL_INIT_VIDEO);
+    static Frontend fe;
+    fe.cip = cip;
+    fe.record = record;
+    fe.replay = replay;
+    fe.freq = SDL_GetPerformanceFrequency();
+    cip8_key_queue_init(&fe.keys);
+    cip8_frames_init(&fe.frames);
+    fe.frame_ready = SDL_CreateSemaphore(0);
+    atomic_init(&fe.quit,false);
+    cip8_sched_init(&fe.sched,cip,IPS,FPS);
+    cip8_rewind_init(&fe.rewind,REWIND_FRAMES);
+    fe.input = 0;
+    fe.window = SDL_CreateWindow("Cip8 Emulator",SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED,64 * 10,32*10,0);
+
+    SDL_Thread* emulation = SDL_CreateThread(emulation_thread,"cip8 emulation",&fe);
+    SDL_Thread* render = SDL_CreateThread(render_thread,"cip8 render",&fe);
+    SDL_Event event;
+    while(!atomic_load(&fe.quit)) {
+        // the timeout is only there to notice the machine halting
+        if(!SDL_WaitEventTimeout(&event,10)) continue;
+        Uint64 now = SDL_GetPerformanceCounter();
+        if(event.type == SDL_QUIT) {
+            atomic_store(&fe.quit,true);
+        }
+        if(event.type == SDL_KEYDOWN) {
+            if(event.key.keysym.scancode == SDL_SCANCODE_ESCAPE) {
+                atomic_store(&fe.quit,true);
+            }
+        }
+        if((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && !event.key.repeat) {
+            int key = event.key.keysym.scancode == SDL_SCANCODE_BACKSPACE ? KEY_REWIND : key_from_scancode(event.key.keysym.scancode);
+            // the emulation thread drains the queue every millisecond, it does not fill up
+            if(key >= 0) cip8_key_queue_push(&fe.keys,(Cip8KeyEvent){.time = now, .key = key, .down = event.type == SDL_KEYDOWN});
+        }
+    }
+    SDL_SemPost(fe.frame_ready);
+    SDL_WaitThread(emulation,NULL);
+    SDL_WaitThread(render,NULL);
+    cip8_rewind_free(&fe.rewind);
+    SDL_DestroySemaphore(fe.frame_ready);
+    SDL_DestroyWindow(fe.window);
 }
 void renderer_terminal(Cip8* cip ) {
-    Uint32 end = SDL_GetTicks();
-    double dt = 0;    
     SDL_Init(SDL_INIT_TIMER);
+    Cip8Sched sched;
+    cip8_sched_init(&sched,cip,IPS,FPS);
+    FramePacer pacer;
+    frame_pacer_init(&pacer,FPS,false);
+    static Cip8Term term;
+    cip8_terminal_init(&term);
     while (!cip->halted) {
-        if(limit_fps(FPS,end,&dt)) {
-            continue;
+        if(cip8_sched_run_frame(&sched) == CIP8_EVENT_HALTED) {
+            break;
         }
-        end = SDL_GetTicks();
-
-        cip8_step(cip);
-        cip8_from_mem_to_terminal(*cip);
-        if(cip->delay_timer > 0) {
-            cip->delay_timer -= 1/60;
-            cip->delay_timer = SDL_max(cip->delay_timer,0);
+        cip8_from_mem_to_terminal(&term,cip);
+        if(!UNTHROTTLED) {
+            frame_pacer_wait(&pacer);
         }
     }
+    printf("\033[?25h\n"); // cursor back
+    if(cip->trap) printf("[ERROR]: %s at 0x%03X\n",cip8_trap_name(cip->trap),cip->ip);
+    frame_pacer_report(&pacer);
 }
 
 
-int main() {
-    int prog_size;
-    OpCode* program = cip8_load_from_file("tests/6-keypad.ch8",&prog_size);
-    
-    // OpCode program[] = {0x15D0, 0x0012}; 
-    // prog_size = 2;
-
-    assert(prog_size > 0);
+static void usage(const char* name) {
+    fprintf(stderr,"usage: %s [-r record.keys] [-p replay.keys] [-q profile] [rom.ch8]\n",name);
+    exit(1);
+}
 
+// -r writes the keypad and the OP_RND seed to a log on exit, -p plays one back instead of the keyboard.
+// -q picks the variant the rom was written for, see CIP8_QUIRK_PROFILES
+int main(int argc, char** argv) {
+    const char* rom = "tests/6-keypad.ch8";
+    const char* record_file = NULL;
+    const char* replay_file = NULL;
+    Cip8Quirks quirks = CIP8_QUIRKS_LEGACY;
+    for (int i = 1; i < argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            switch (argv[i][1]) {
+                case 'r': record_file = argv[++i]; break;
+                case 'p': replay_file = argv[++i]; break;
+                case 'q': if(!cip8_quirks_from_name(argv[++i],&quirks)) usage(argv[0]); break;
+                default: usage(argv[0]);
+            }
+        } else {
+            rom = argv[i];
+        }
+    }
     Cip8 cip;
     cip8_init(&cip);    
 
-    cip8_load_program(&cip,prog_size,program);
-    // free(program);
+    if(!cip8_load_file(&cip,rom)) return 1;
+    cip.quirks = quirks;
+    Cip8InputLog record, replay;
+    cip8_input_log_init(&record,CIP8_DEFAULT_SEED);
+    cip8_input_log_init(&replay,CIP8_DEFAULT_SEED);
+    if(replay_file && !cip8_input_log_load(&replay,replay_file)) return 1;
+    cip8_seed(&cip,replay_file ? replay.seed : record.seed);
 
 #if RENDER_SDL
-    renderer_sdl(&cip);
+    renderer_sdl(&cip,record_file ? &record : NULL,replay_file ? &replay : NULL);
 #elif RENDER_TERMINAL
     renderer_terminal(&cip);
 #endif
+    if(record_file && !cip8_input_log_save(&record,record_file)) return 1;
+    cip8_input_log_free(&record);
+    cip8_input_log_free(&replay);
+    cip8_free(&cip);
  
     SDL_Quit();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,69 @@
+// cip8-profile: runs a rom headless with the profiler on, prints where the time goes and writes
+// the call stacks in folded form for flamegraph.pl or speedscope.
+//
+//   $ gcc -O2 profile.c -o cip8-profile
+//   $ ./cip8-profile [-c instructions] [-s ips] [-n top] [-o out.folded] [-q profile] rom.ch8
+//   $ flamegraph.pl out.folded > out.svg
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define CIP8_NO_SDL
+#define CIP8_PROFILE 1
+#include "cip8.h"
+#include "cip8_sched.h"
+
+static void usage(const char* name) {
+    fprintf(stderr,"usage: %s [-c instructions] [-s ips] [-n top] [-o out.folded] [-q profile] rom.ch8\n",name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    uint64_t instructions = 1000000;
+    uint32_t ips = CIP8_DEFAULT_IPS;
+    size_t top = 20;
+    const char* folded = NULL;
+    const char* rom = NULL;
+    Cip8Quirks quirks = CIP8_QUIRKS_LEGACY;
+    for (int i = 1; i < argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            switch (argv[i][1]) {
+                case 'c': instructions = strtoull(argv[++i],NULL,10); break;
+                case 's': ips          = strtoul(argv[++i],NULL,10);  break;
+                case 'n': top          = strtoull(argv[++i],NULL,10); break;
+                case 'o': folded       = argv[++i];                   break;
+                case 'q': if(!cip8_quirks_from_name(argv[++i],&quirks)) usage(argv[0]); break;
+                default: usage(argv[0]);
+            }
+        } else {
+            rom = argv[i];
+        }
+    }
+    if(!rom) usage(argv[0]);
+
+    static Cip8 cip;
+    static Cip8Profile prof;
+    cip8_init(&cip);
+    if(!cip8_load_file(&cip,rom)) return 1;
+    cip.quirks = quirks;
+    cip8_profile_init(&prof);
+    cip.profile = &prof;
+
+    Cip8Sched sched;
+    cip8_sched_init(&sched,&cip,ips,CIP8_TIMER_HZ);
+    if(!cip8_sched_run_until(&sched,instructions)) {
+        printf("[INFO]: halted after %llu instructions",(unsigned long long)sched.cycle);
+        if(cip.trap) printf(", %s at 0x%03X",cip8_trap_name(cip.trap),cip.ip);
+        printf("\n");
+    }
+    cip8_profile_report(&prof,&cip,top);
+
+    if(folded && !cip8_profile_folded(&prof,folded)) {
+        printf("[ERROR]: Could not write %s\n",folded);
+        return 1;
+    }
+    cip8_free(&cip);
+    return 0;
+}
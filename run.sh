@@ -3,5 +3,5 @@
 set -e
 
 gcc main.c -Wall -o main -lSDL2 -lm
-./main
+./main "$@"
 rm main
\ No newline at end of file
@@ -0,0 +1,52 @@
+// decodes a trace written by cip8_trace_dump into the same lines ENABLE_PRINT_DEBUG prints,
+// each followed by the registers the instruction was about to read.
+//
+//   $ gcc trace.c -o trace && ./trace cip8.trace
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define CIP8_NO_SDL
+#define CIP8_TRACE 1
+#include "cip8.h"
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        fprintf(stderr,"usage: %s file.trace\n",argv[0]);
+        return 1;
+    }
+    FILE* f = fopen(argv[1],"rb");
+    if(!f) {
+        printf("[ERROR]: Could not open %s\n",argv[1]);
+        return 1;
+    }
+
+    char magic[8];
+    uint64_t count;
+    if(fread(magic,1,8,f) != 8 || memcmp(magic,CIP8_TRACE_MAGIC,8) != 0 || fread(&count,sizeof(count),1,f) != 1) {
+        printf("[ERROR]: %s is not a cip8 trace\n",argv[1]);
+        fclose(f);
+        return 1;
+    }
+
+    // cip8_print_inst reads ip and the op-code bytes out of a Cip8, so give it one
+    static Cip8 cip;
+    cip8_init(&cip);
+    Cip8TraceRecord r;
+    for (uint64_t i = 0; i < count && fread(&r,sizeof(r),1,f) == 1; i++) {
+        if(r.pc == 0xFFFF) {
+            printf("<overwritten while dumping>\n");
+            continue;
+        }
+        cip.ip = r.pc;
+        cip8_write(&cip,r.pc,r.opcode >> 8);
+        cip8_write(&cip,r.pc + 1,r.opcode & 0xFF);
+        cip8_print_inst(cip,cip8_decode_inst(r.opcode));
+        printf("          V%X=0x%02X V%X=0x%02X VF=0x%02X I=0x%03X sp=0x%03X\n",
+               GET_X(r.opcode),r.vx,GET_Y(r.opcode),r.vy,r.vf,r.I,r.sp);
+    }
+    fclose(f);
+    return 0;
+}
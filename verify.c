@@ -0,0 +1,603 @@
+// cip8-verify: runs every engine in lockstep with the reference interpreter and finds the first
+// instruction they disagree on.
+//
+//   $ gcc -O2 verify.c -o cip8-verify -lpthread
+//   $ ./cip8-verify [-j threads] [-c instructions] [-s ips] [-n interval] [-e engines] [-q profiles] [-p replay.keys] [-g random] [-r seed] [rom ...]
+//
+// each rom (tests/*.ch8 when none are given, plus -g generated ones) and engine is one task: a
+// machine on cip8_step_reference and one on the engine start from the same image and get the same
+// timer ticks and keys at the same cycles, the scripted presses of cip8-bench or an input log with
+// -p. every -n instructions both are hashed, and at the first mismatch the span since the last
+// agreeing hash is bisected down to the one instruction after which they differ, which gets printed
+// with both machines' registers. exits 1 on any mismatch.
+//
+// generated roms are random instructions seeded by -r, a main loop and the subroutines it calls
+// with jumps landing inside the rom, so most run as long as -c. a rom that fails is written to verify-<n>.ch8 to run again. a trap ends the run, the engine has to
+// trap the same way on the same instruction.
+//
+// built with -DCIP8_VERIFY_AOT='"out.c"' it also checks the output of aot.c as the aot engine.
+// that only covers the rom and profile it was generated for, anything else runs through cip8_run:
+//
+//   $ ./aot tests/selfmod.ch8 selfmod.c cip8_aot_run vip
+//   $ gcc -O2 -DCIP8_VERIFY_AOT='"selfmod.c"' verify.c -o cip8-verify -lpthread
+//   $ ./cip8-verify -e aot -q vip tests/selfmod.ch8
+//
+// -q lists the quirk profiles to check every rom and engine under, the same way -e lists engines,
+// "all" for every one of them. legacy when not given.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glob.h>
+
+#define CIP8_NO_SDL
+#include "cip8.h"
+#include "cip8_sched.h"
+#include "cip8_cache.h"
+#include "cip8_pool.h"
+#include "cip8_jit.h"
+#include "cip8_replay.h"
+
+#define VERIFY_RANDOM_WORDS 256
+
+typedef struct {
+    const char* name;
+    size_t (*run)(Cip8Jit* jit, Cip8* cip, size_t count);
+} Engine;
+
+static size_t run_switch(Cip8Jit* jit, Cip8* cip, size_t count) {
+    size_t n = 0;
+    while(n < count && !cip->halted) {
+        cip8_step(cip);
+        n++;
+    }
+    return n;
+}
+static size_t run_threaded(Cip8Jit* jit, Cip8* cip, size_t count) {
+    return cip8_run_threaded(cip,count);
+}
+static size_t run_run(Cip8Jit* jit, Cip8* cip, size_t count) {
+    return cip8_run(cip,count);
+}
+static size_t run_jit(Cip8Jit* jit, Cip8* cip, size_t count) {
+    return cip8_jit_run(jit,cip,count);
+}
+#ifdef CIP8_VERIFY_AOT
+#include CIP8_VERIFY_AOT
+static size_t run_aot(Cip8Jit* jit, Cip8* cip, size_t count) {
+    return cip8_aot_run(cip,count);
+}
+#endif
+
+static const Engine engines[] = {
+    {"switch",   run_switch},
+    {"threaded", run_threaded},
+    {"run",      run_run},
+    {"jit",      run_jit},
+#ifdef CIP8_VERIFY_AOT
+    {"aot",      run_aot},
+#endif
+};
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+typedef struct {
+    char name[256];
+    const Cip8* image;
+    uint64_t page_hash[CIP8_PAGES]; // of the image's pages, a machine still sharing one does not hash it again
+    uint8_t bytes[2 * VERIFY_RANDOM_WORDS]; // of a generated rom, to write it out when it fails
+    size_t size;                            // 0 for a rom from a file
+} Rom;
+
+typedef struct {
+    const Rom* rom;
+    const Engine* engine;
+    Cip8Quirks quirks;
+    uint64_t instructions;
+    uint32_t ips;
+    uint64_t interval;
+    const Cip8InputLog* replay; // NULL for the scripted presses
+
+    // filled by the task
+    uint64_t checked;      // instructions both ran and agreed on
+    Cip8Trap trap;         // of the reference, where it stopped
+    bool halted;
+    bool mismatch;
+    uint64_t good;         // last cycle the hashes agreed at, the snapshots are from there
+    uint64_t diverged;     // the instruction from here to the next is the first they disagree after
+    Cip8Snapshot* ref_good;
+    Cip8Snapshot* cand_good;
+} Job;
+
+// one side of the lockstep, the reference when engine is NULL
+typedef struct {
+    Cip8* cip;
+    const Engine* engine;
+    Cip8Jit* jit;
+} Side;
+
+// traps are part of the state like everything else, an engine has to stop on the same inst
+static size_t side_run(Side* side, size_t count) {
+    if(side->engine) return side->engine->run(side->jit,side->cip,count);
+    size_t n = 0;
+    while(n < count && !side->cip->halted) {
+        cip8_step_reference(side->cip);
+        n++;
+    }
+    return n;
+}
+
+// the key presses of cip8-bench, a new set every frame
+static uint16_t script_keys(uint64_t frame) {
+    uint8_t key = (frame / 16 * 7 + 3) % 16;
+    return frame % 16 < 8 ? 1u << key : 0;
+}
+// timer ticks due at or before cycle, tick t is at t * ips / 60 like in cip8_sched.h
+static uint64_t ticks_upto(uint64_t cycle, uint32_t ips) {
+    return (CIP8_TIMER_HZ * (cycle + 1) - 1) / ips;
+}
+// first replay record after cycle
+static size_t replay_after(const Cip8InputLog* log, uint64_t cycle) {
+    size_t lo = 0, hi = log->count;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(log->records[mid].cycle <= cycle) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+// what happens at cycle once the machine got there: the timers tick and the keys change
+static void job_events(const Job* job, Cip8* cip, uint64_t cycle) {
+    uint64_t ticks = ticks_upto(cycle,job->ips);
+    uint64_t before = cycle ? ticks_upto(cycle - 1,job->ips) : 0;
+    for (uint64_t t = before; t < ticks; t++) cip8_tick_timers(cip);
+    if(job->replay) {
+        size_t r = replay_after(job->replay,cycle);
+        if(r > 0 && job->replay->records[r - 1].cycle == cycle) cip->keys = job->replay->records[r - 1].keys;
+    } else if(ticks != before || cycle == 0) {
+        cip->keys = script_keys(ticks);
+    }
+}
+// runs side from cycle from to to with every event in (from,to] on time, returns where it got
+static uint64_t job_span(const Job* job, Side* side, uint64_t from, uint64_t to) {
+    uint64_t at = from;
+    while(at < to) {
+        uint64_t next = (ticks_upto(at,job->ips) + 1) * job->ips / CIP8_TIMER_HZ;
+        if(job->replay) {
+            size_t r = replay_after(job->replay,at);
+            if(r < job->replay->count && job->replay->records[r].cycle < next) next = job->replay->records[r].cycle;
+        }
+        if(next > to) next = to;
+        uint64_t ran = side_run(side,next - at);
+        at += ran;
+        if(at < next) return at;
+        job_events(job,side->cip,at);
+    }
+    return at;
+}
+
+// registers, I, ip, sp, timers, the generator, display and memory. pages still shared with the
+// image hash to what the image's did without being read
+static uint64_t verify_hash(const Rom* rom, const Cip8* cip) {
+    uint64_t h = CIP8_FNV_OFFSET;
+    for (size_t p = 0; p < CIP8_PAGES; p++) {
+        uint64_t ph = cip->pages[p] == rom->image->pages[p] ? rom->page_hash[p] :
+                      cip8_fnv(CIP8_FNV_OFFSET,cip->pages[p]->bytes,CIP8_PAGE_SIZE);
+        h = cip8_fnv(h,&ph,sizeof(ph));
+    }
+    h = cip8_fnv(h,cip->regs.V,sizeof(cip->regs.V));
+    h = cip8_fnv(h,&cip->regs.I,sizeof(cip->regs.I));
+    h = cip8_fnv(h,&cip->ip,sizeof(cip->ip));
+    h = cip8_fnv(h,&cip->sp,sizeof(cip->sp));
+    h = cip8_fnv(h,&cip->delay_timer,sizeof(cip->delay_timer));
+    h = cip8_fnv(h,&cip->sound_timer,sizeof(cip->sound_timer));
+    h = cip8_fnv(h,&cip->rng,sizeof(cip->rng));
+    h = cip8_fnv(h,&cip->halted,sizeof(cip->halted));
+    h = cip8_fnv(h,&cip->trap,sizeof(cip->trap));
+    h = cip8_fnv(h,cip->display,sizeof(cip->display));
+    return h;
+}
+
+// both sides back at the last agreeing snapshot and run to cycle, true when they agree there
+static bool job_probe(Job* job, Side* ref, Side* cand, uint64_t cycle) {
+    cip8_restore(ref->cip,job->ref_good);
+    cip8_restore(cand->cip,job->cand_good);
+    uint64_t r = job_span(job,ref,job->good,cycle);
+    uint64_t c = job_span(job,cand,job->good,cycle);
+    return r == c && verify_hash(job->rom,ref->cip) == verify_hash(job->rom,cand->cip);
+}
+
+static void run_job(void* arg, size_t worker) {
+    Job* job = arg;
+    Cip8* cips = malloc(2 * sizeof(Cip8));
+    Cip8Jit* jit = malloc(sizeof(Cip8Jit));
+    job->ref_good = malloc(sizeof(Cip8Snapshot));
+    job->cand_good = malloc(sizeof(Cip8Snapshot));
+    assert(cips && jit && job->ref_good && job->cand_good && "out of memory for a verify job");
+    cip8_jit_init(jit);
+    Side ref = {.cip = &cips[0]}, cand = {.cip = &cips[1], .engine = job->engine, .jit = jit};
+    cip8_init_shared(ref.cip,job->rom->image);
+    cip8_init_shared(cand.cip,job->rom->image);
+    ref.cip->quirks = cand.cip->quirks = job->quirks;
+    if(job->replay) {
+        cip8_seed(ref.cip,job->replay->seed);
+        cip8_seed(cand.cip,job->replay->seed);
+    }
+    job_events(job,ref.cip,0);
+    job_events(job,cand.cip,0);
+
+    uint64_t cycle = 0;
+    while(cycle < job->instructions) {
+        job->good = cycle;
+        cip8_snapshot(ref.cip,job->ref_good);
+        cip8_snapshot(cand.cip,job->cand_good);
+        uint64_t to = cycle + job->interval < job->instructions ? cycle + job->interval : job->instructions;
+        // the reference decides how far this span goes, it may stop short
+        uint64_t r = job_span(job,&ref,cycle,to);
+        uint64_t c = job_span(job,&cand,cycle,r);
+        if(c != r || verify_hash(job->rom,ref.cip) != verify_hash(job->rom,cand.cip)) {
+            // agreed at good, not at r: find the first cycle they disagree at
+            uint64_t lo = job->good, hi = r;
+            while(hi - lo > 1) {
+                uint64_t mid = lo + (hi - lo) / 2;
+                if(job_probe(job,&ref,&cand,mid)) lo = mid; else hi = mid;
+            }
+            job->mismatch = true;
+            job->diverged = lo;
+            break;
+        }
+        job->checked = cycle = r;
+        if(r < to) break;
+    }
+    job->trap = ref.cip->trap;
+    job->halted = ref.cip->halted;
+
+    cip8_jit_free(jit);
+    free(jit);
+    cip8_free(ref.cip);
+    cip8_free(cand.cip);
+    free(cips);
+}
+
+static void print_regs(const char* side, const Cip8* cip) {
+    printf("    %-9s ip=0x%03X I=0x%03X sp=0x%03X dt=%d st=%d V=",side,cip->ip,cip->regs.I,cip->sp,
+           cip->delay_timer,cip->sound_timer);
+    for (size_t x = 0; x < 16; x++) printf("%02X%s",cip->regs.V[x],x < 15 ? " " : "\n");
+}
+// replays the divergence from the job's snapshots: the instruction, then both machines after it
+static void report_mismatch(const Job* job) {
+    Cip8* cips = malloc(2 * sizeof(Cip8));
+    Cip8Jit* jit = malloc(sizeof(Cip8Jit));
+    assert(cips && jit && "out of memory for a report");
+    cip8_jit_init(jit);
+    Side ref = {.cip = &cips[0]}, cand = {.cip = &cips[1], .engine = job->engine, .jit = jit};
+    cip8_init_shared(ref.cip,job->rom->image);
+    cip8_init_shared(cand.cip,job->rom->image);
+    ref.cip->quirks = cand.cip->quirks = job->quirks;
+    cip8_restore(ref.cip,job->ref_good);
+    cip8_restore(cand.cip,job->cand_good);
+    job_span(job,&ref,job->good,job->diverged);
+
+    printf("    first differing instruction, %llu in:\n    ",(unsigned long long)job->diverged);
+    cip8_print_inst(*ref.cip,cip8_decode_inst(cip8_read16(ref.cip,ref.cip->ip)));
+    print_regs("before",ref.cip);
+    // the engine runs the whole span in one go like the bisection did, stopping it one instruction
+    // earlier can break up what went wrong (a fused pair runs as two single insts)
+    uint64_t r = job_span(job,&ref,job->diverged,job->diverged + 1);
+    uint64_t c = job_span(job,&cand,job->good,job->diverged + 1);
+    print_regs("reference",ref.cip);
+    print_regs(job->engine->name,cand.cip);
+    if(r != c) printf("    the engine ran %llu instructions, the reference %llu\n",
+                      (unsigned long long)(c - job->diverged),(unsigned long long)(r - job->diverged));
+    for (Addr a = 0; a < MEMORY_SIZE; a++) {
+        if(cip8_read(ref.cip,a) != cip8_read(cand.cip,a)) {
+            printf("    memory differs first at 0x%03X: 0x%02X against 0x%02X\n",a,cip8_read(ref.cip,a),cip8_read(cand.cip,a));
+            break;
+        }
+    }
+    if(memcmp(ref.cip->display,cand.cip->display,sizeof(ref.cip->display)) != 0) printf("    display differs\n");
+    if(ref.cip->trap != cand.cip->trap) printf("    trapped on %s against %s\n",cip8_trap_name(ref.cip->trap),cip8_trap_name(cand.cip->trap));
+
+    cip8_jit_free(jit);
+    free(jit);
+    cip8_free(ref.cip);
+    cip8_free(cand.cip);
+    free(cips);
+}
+
+// random well formed roms: a main loop that jumps back to the start from its last word, then
+// subroutines that each end in a return. calls only go to the start of a subroutine and a
+// subroutine calls nothing, so every call returns and the stack never holds more than one. jumps
+// land on the first word of an instruction in their own part, forward in a subroutine so it gets
+// to its return, a computed jump loads its offset into both V0 and the VX of jump_vx first, and a
+// skip never skips a part's last word or into the middle of a pair. what the rom does to memory is
+// up to it, including writing over itself
+enum { RANDOM_OP, RANDOM_JUMP, RANDOM_CALL, RANDOM_COMPUTED };
+typedef struct {
+    Cip8 rng;
+    size_t words;
+    uint16_t* code;
+    uint8_t* kind;   // RANDOM_JUMP, _CALL and _COMPUTED get their target once the part is done
+    bool* start;     // first word of an instruction, somewhere a jump can land
+    size_t subs[VERIFY_RANDOM_WORDS];
+    size_t sub_count;
+} RandomRom;
+
+static uint16_t random_word(RandomRom* gen) {
+    return (cip8_random(&gen->rng) << 8) | cip8_random(&gen->rng);
+}
+static bool random_skips(uint16_t code) {
+    uint8_t op = code >> 12;
+    return op == 0x3 || op == 0x4 || op == 0x5 || op == 0x9 || op == 0xE;
+}
+// a word in [lo,hi) an instruction starts at, there is always the part's last one
+static size_t random_start(RandomRom* gen, size_t lo, size_t hi, size_t not) {
+    for (;;) {
+        size_t w = lo + random_word(gen) % (hi - lo);
+        if(gen->start[w] && (w != not || hi - lo == 1)) return w;
+    }
+}
+static void random_part(RandomRom* gen, size_t lo, size_t end, bool sub) {
+    static const uint8_t alu[] = {0x0,0x1,0x2,0x3,0x4,0x5,0x6,0x7,0xE};
+    static const uint8_t misc[] = {0x07,0x0A,0x15,0x18,0x1E,0x33,0x55,0x65};
+    static const uint8_t plain[] = {0x3,0x4,0x6,0x7,0xC,0xD};
+    bool skipped = false;
+    for (size_t w = lo; w < end - 1; w++) {
+        uint16_t r = random_word(gen);
+        uint16_t x = r & 0x0F00, y = r & 0x00F0;
+        uint8_t pick = cip8_random(&gen->rng);
+        uint16_t code;
+        gen->start[w] = true;
+        if(pick < 8 && !sub && gen->sub_count) {
+            code = 0x2000;
+            gen->kind[w] = RANDOM_CALL;
+        } else if(pick < 12 && !sub && !skipped && w + 3 < end) {
+            // V0 and VX set to the offset, the B word gets the base once the target is known
+            gen->kind[w + 2] = RANDOM_COMPUTED;
+            w += 2;
+            code = 0xB000;
+        } else if(pick < 24) {
+            code = 0x1000;
+            gen->kind[w] = RANDOM_JUMP;
+        } else if(pick < 32) {
+            code = 0x00E0;
+        } else if(pick < 40 && !skipped && w + 2 < end) {
+            gen->code[w] = 0x6000 | x | (cip8_random(&gen->rng) & 0xF);
+            w++;
+            code = 0xF029 | x;
+        } else if(pick < 64) {
+            code = 0x8000 | x | y | alu[cip8_random(&gen->rng) % sizeof(alu)];
+        } else if(pick < 72) {
+            code = (cip8_random(&gen->rng) & 1 ? 0x5000 : 0x9000) | x | y;
+        } else if(pick < 80) {
+            code = 0xE000 | x | (cip8_random(&gen->rng) & 1 ? 0x9E : 0xA1);
+        } else if(pick < 104) {
+            code = 0xF000 | x | misc[cip8_random(&gen->rng) % sizeof(misc)];
+        } else if(pick < 112) {
+            // I mostly points past the rom, now and then into it so the rom rewrites itself
+            code = 0xA000 | (pick & 7 ? 0x600 + r % 0x800 : PROGRAM_START + 2 * (r % gen->words));
+        } else {
+            code = plain[cip8_random(&gen->rng) % sizeof(plain)] << 12 | (r & 0x0FFF);
+        }
+        if(random_skips(code) && w + 2 >= end) code = 0x8000 | x | y;
+        gen->code[w] = code;
+        skipped = random_skips(code);
+    }
+    gen->code[end - 1] = sub ? 0x00EE : 0x1000 | (PROGRAM_START + 2 * lo);
+    gen->start[end - 1] = true;
+
+    for (size_t w = lo; w < end; w++) {
+        switch (gen->kind[w]) {
+            case RANDOM_JUMP:
+                gen->code[w] |= PROGRAM_START + 2 * (sub ? random_start(gen,w + 1,end,end) : random_start(gen,lo,end,w));
+                break;
+            case RANDOM_CALL:
+                gen->code[w] |= PROGRAM_START + 2 * gen->subs[random_word(gen) % gen->sub_count];
+                break;
+            case RANDOM_COMPUTED: {
+                Addr target = PROGRAM_START + 2 * random_start(gen,lo,end,w - 2);
+                uint8_t offset = cip8_random(&gen->rng) & 0x1E;
+                Addr base = target - offset;
+                gen->code[w - 2] = 0x6000 | offset;
+                gen->code[w - 1] = 0x6000 | (base & 0x0F00) | offset;
+                gen->code[w] |= base;
+            } break;
+        }
+    }
+}
+static void random_rom(uint64_t seed, uint8_t* bytes, size_t words) {
+    RandomRom* gen = calloc(1,sizeof(RandomRom));
+    assert(gen && "out of memory for a random rom");
+    gen->code = calloc(words,sizeof(uint16_t));
+    gen->kind = calloc(words,sizeof(uint8_t));
+    gen->start = calloc(words,sizeof(bool));
+    assert(gen->code && gen->kind && gen->start && "out of memory for a random rom");
+    cip8_seed(&gen->rng,seed);
+    gen->words = words;
+    // the last quarter is subroutines of 3 to 12 words, laid out first so main knows where they are
+    size_t main_end = words - words / 4;
+    for (size_t s = main_end; s < words;) {
+        size_t len = 3 + cip8_random(&gen->rng) % 10;
+        if(words - s < len + 3) len = words - s;
+        random_part(gen,s,s + len,true);
+        gen->subs[gen->sub_count++] = s;
+        s += len;
+    }
+    random_part(gen,0,main_end,false);
+    for (size_t w = 0; w < words; w++) {
+        bytes[2 * w] = gen->code[w] >> 8;
+        bytes[2 * w + 1] = gen->code[w] & 0xFF;
+    }
+    free(gen->code);
+    free(gen->kind);
+    free(gen->start);
+    free(gen);
+}
+
+// true when name is one of the comma separated names in list
+static bool listed(const char* list, const char* name) {
+    size_t len = strlen(name);
+    for (const char* p = strstr(list,name); p; p = strstr(p + 1,name)) {
+        if((p == list || p[-1] == ',') && (p[len] == 0 || p[len] == ',')) return true;
+    }
+    return false;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,"usage: %s [-j threads] [-c instructions] [-s ips] [-n interval] [-e engines] [-q profiles] [-p replay.keys] [-g random] [-r seed] [rom ...]\n",name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    size_t threads = 0;
+    uint64_t instructions = 1000000;
+    uint32_t ips = CIP8_DEFAULT_IPS;
+    uint64_t interval = 1000;
+    size_t generated = 0;
+    uint64_t seed = CIP8_DEFAULT_SEED;
+    const char* engine_list = NULL;
+    const char* quirk_list = NULL;
+    const char* replay_file = NULL;
+
+    const char** paths = calloc(argc,sizeof(char*));
+    size_t path_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            switch (argv[i][1]) {
+                case 'j': threads      = strtoull(argv[++i],NULL,10); break;
+                case 'c': instructions = strtoull(argv[++i],NULL,10); break;
+                case 's': ips          = strtoul(argv[++i],NULL,10);  break;
+                case 'n': interval     = strtoull(argv[++i],NULL,10); break;
+                case 'e': engine_list  = argv[++i];                   break;
+                case 'q': quirk_list   = argv[++i];                   break;
+                case 'p': replay_file  = argv[++i];                   break;
+                case 'g': generated    = strtoull(argv[++i],NULL,10); break;
+                case 'r': seed         = strtoull(argv[++i],NULL,10); break;
+                default: usage(argv[0]);
+            }
+        } else if(argv[i][0] == '-') {
+            usage(argv[0]);
+        } else {
+            paths[path_count++] = argv[i];
+        }
+    }
+    if(ips == 0 || instructions == 0 || interval == 0) usage(argv[0]);
+
+    glob_t found = {0};
+    if(path_count == 0 && generated == 0) {
+        if(glob("tests/*.ch8",0,NULL,&found) != 0) {
+            printf("[ERROR]: no roms given and none in tests/\n");
+            return 1;
+        }
+        free(paths);
+        paths = (const char**)found.gl_pathv;
+        path_count = found.gl_pathc;
+    }
+
+    bool use[ENGINE_COUNT];
+    size_t engine_count = 0;
+    for (size_t e = 0; e < ENGINE_COUNT; e++) {
+        use[e] = !engine_list || listed(engine_list,engines[e].name);
+        engine_count += use[e];
+    }
+    bool use_quirks[CIP8_QUIRKS_COUNT];
+    size_t quirk_count = 0;
+    for (int q = 0; q < CIP8_QUIRKS_COUNT; q++) {
+        use_quirks[q] = quirk_list ? strcmp(quirk_list,"all") == 0 || listed(quirk_list,cip8_quirks_name(q)) : q == CIP8_QUIRKS_LEGACY;
+        quirk_count += use_quirks[q];
+    }
+    if(quirk_count == 0) usage(argv[0]);
+
+    Cip8InputLog replay;
+    cip8_input_log_init(&replay,CIP8_DEFAULT_SEED);
+    if(replay_file && !cip8_input_log_load(&replay,replay_file)) return 1;
+
+    Cip8Cache cache;
+    cip8_cache_init(&cache);
+    size_t rom_count = path_count + generated;
+    Rom* roms = calloc(rom_count,sizeof(Rom));
+    assert(roms && "out of memory for the roms");
+    for (size_t r = 0; r < rom_count; r++) {
+        Rom* rom = &roms[r];
+        if(r < path_count) {
+            snprintf(rom->name,sizeof(rom->name),"%s",paths[r]);
+            rom->image = cip8_cache_load(&cache,paths[r]);
+        } else {
+            size_t n = r - path_count;
+            snprintf(rom->name,sizeof(rom->name),"random %zu",n);
+            rom->size = sizeof(rom->bytes);
+            random_rom(seed + n,rom->bytes,VERIFY_RANDOM_WORDS);
+            rom->image = cip8_cache_get(&cache,rom->bytes,rom->size);
+        }
+        if(!rom->image) return 1;
+        for (size_t p = 0; p < CIP8_PAGES; p++) {
+            rom->page_hash[p] = cip8_fnv(CIP8_FNV_OFFSET,rom->image->pages[p]->bytes,CIP8_PAGE_SIZE);
+        }
+    }
+
+    size_t job_count = rom_count * engine_count * quirk_count;
+    Job* jobs = calloc(job_count,sizeof(Job));
+    assert(jobs && "out of memory for the jobs");
+    Cip8Pool pool;
+    cip8_pool_init(&pool,threads);
+    size_t k = 0;
+    for (size_t r = 0; r < rom_count; r++) {
+        for (size_t e = 0; e < ENGINE_COUNT; e++) {
+            for (int q = 0; q < CIP8_QUIRKS_COUNT; q++) {
+                if(!use[e] || !use_quirks[q]) continue;
+                Job* job = &jobs[k];
+                job->rom = &roms[r];
+                job->engine = &engines[e];
+                job->quirks = q;
+                job->instructions = instructions;
+                job->ips = ips;
+                job->interval = interval;
+                job->replay = replay_file ? &replay : NULL;
+                cip8_pool_submit(&pool,k,(Cip8Task){run_job,job});
+                k++;
+            }
+        }
+    }
+    cip8_pool_wait(&pool);
+    cip8_pool_free(&pool);
+
+    size_t failed = 0;
+    uint64_t ran = 0;
+    for (size_t j = 0; j < job_count; j++) {
+        Job* job = &jobs[j];
+        ran += job->mismatch ? job->diverged : job->checked;
+        char why[32] = "";
+        if(job->halted && !job->mismatch) snprintf(why,sizeof(why)," (%s)",job->trap ? cip8_trap_name(job->trap) : "halted");
+        printf("%-28s %-8s %-6s %10llu instructions  %s%s\n",job->rom->name,job->engine->name,cip8_quirks_name(job->quirks),
+               (unsigned long long)(job->mismatch ? job->diverged : job->checked),job->mismatch ? "MISMATCH" : "ok",why);
+        if(job->mismatch) {
+            failed++;
+            report_mismatch(job);
+            if(job->rom->size) {
+                char name[64];
+                snprintf(name,sizeof(name),"verify-%zu.ch8",(size_t)(job->rom - roms) - path_count);
+                FILE* f = fopen(name,"wb");
+                if(f) {
+                    fwrite(job->rom->bytes,1,job->rom->size,f);
+                    fclose(f);
+                    printf("    written to %s\n",name);
+                }
+            }
+        }
+        free(job->ref_good);
+        free(job->cand_good);
+    }
+    // a run that traps early checks little, this shows when the generated roms stop doing that
+    fprintf(stderr,"[INFO]: %zu roms, %zu engines, %zu profiles, %zu mismatches, %llu instructions a run on average\n",
+            rom_count,engine_count,quirk_count,failed,(unsigned long long)(job_count ? ran / job_count : 0));
+
+    cip8_input_log_free(&replay);
+    cip8_cache_free(&cache);
+    free(jobs);
+    free(roms);
+    if(found.gl_pathv) {
+        globfree(&found);
+    } else {
+        free(paths);
+    }
+    return failed ? 1 : 0;
+}